@@ -0,0 +1,25 @@
+#ifndef HARNESS_HPP
+#define HARNESS_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+// Times a piece of code over a number of repetitions and collects the results in a json file.
+// The setup function is called before each repetition and is not timed.
+class BenchmarkSuite {
+public:
+  int reps;
+  Json::Value results;
+
+  BenchmarkSuite(int reps);
+  ~BenchmarkSuite(){};
+
+  void run(std::string name,std::string size,std::function<void()> setup,std::function<void()> code);
+  void run(std::string name,std::string size,std::function<void()> code);
+  void write(std::string filename,const Json::Value& meta);
+};
+
+#endif /* HARNESS_HPP */
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Runs the microbenchmarks and times each stage of the pipeline on scaled-up versions of tests/test_0.
+# Must be called from the MOLET root directory (this is what 'make bench' does).
+# Environment variables:
+#   BENCH_REPS   - repetitions of each microbenchmark (default 10)
+#   BENCH_SCALES - scale factors of the end-to-end runs (default "1 2 4"): the field of view, the number of intrinsic (Nin)
+#                  and extrinsic (Nex) light curves, and the number of observing epochs (cadence) are all multiplied by it.
+
+
+timestage () {
+    stage=$1
+    shift
+    start=`date +%s.%N`
+    "$@" > /dev/null 2>> ${case_path}"output/bench_errors.txt"
+    exit_code=$?
+    end=`date +%s.%N`
+    seconds=`awk -v a=$start -v b=$end 'BEGIN{printf "%.3f",b-a}'`
+    printf "%-12s %-32s %10s s\n" "scale $scale" "$stage" "$seconds"
+    echo "{\"scale\":$scale,\"stage\":\"$stage\",\"seconds\":$seconds,\"exit_code\":$exit_code}" >> $stages_file
+}
+
+
+molet_home=`pwd`"/"
+results_dir=${molet_home}"benchmarks/results/"
+mkdir -p $results_dir
+
+reps=${BENCH_REPS:-10}
+scales=${BENCH_SCALES:-"1 2 4"}
+label=`git rev-parse --short HEAD 2>/dev/null`
+stamp=`date +%Y%m%d_%H%M%S`
+
+
+
+# Microbenchmarks
+####################################################################################
+printf "Microbenchmarks:\n"
+micro_file=${results_dir}"micro_"${stamp}".json"
+${molet_home}"benchmarks/bin/bench" $micro_file $reps $label
+
+
+
+# End-to-end
+####################################################################################
+printf "\nEnd-to-end stages:\n"
+test_path=${molet_home}"tests/test_0/"
+instrument=`grep -o '^[^//]*' ${test_path}molet_input.json | jq -r '.instruments[0].name'`
+work_dir=`mktemp -d`
+stages_file=${work_dir}"/stages.txt"
+touch $stages_file
+
+for scale in $scales
+do
+    case_path=${work_dir}"/scale_"${scale}"/"
+    mkdir -p ${case_path}"input_files" ${case_path}"output"
+
+    # Wider field of view and denser cadence (s-1 extra epochs between each pair of the original ones)
+    grep -o '^[^//]*' ${test_path}molet_input.json | jq --argjson s $scale '
+        .instruments |= map(
+            .["field-of-view_xmin"] *= $s | .["field-of-view_xmax"] *= $s |
+            .["field-of-view_ymin"] *= $s | .["field-of-view_ymax"] *= $s |
+            .time |= ( . as $t | [range(0;length-1) as $i | range(0;$s) as $k | $t[$i] + ($t[$i+1]-$t[$i])*$k/$s] + [$t[-1]] )
+        )' > ${case_path}"molet_input.json"
+
+    # More intrinsic light curves and more extrinsic light curves per image
+    jq --argjson s $scale '[range(0;$s) as $k | .[]]' ${test_path}"input_files/"${instrument}"_LC_intrinsic.json" > ${case_path}"input_files/"${instrument}"_LC_intrinsic.json"
+    jq --argjson s $scale 'map( . as $lcs | [range(0;$s) as $k | $lcs[]] )' ${test_path}"input_files/"${instrument}"_LC_extrinsic.json" > ${case_path}"input_files/"${instrument}"_LC_extrinsic.json"
+
+    # Same calls as in molet_driver.sh (custom variability)
+    infile=${case_path}"molet_input.json"
+    timestage "angular_diameter_distances" ${molet_home}"cosmology/angular_diameter_distances/bin/angular_diameter_distances" $infile $case_path
+    timestage "fproject"                   ${molet_home}"lensed_extended_source/vkl_fproject/bin/fproject" $infile $case_path $case_path
+    timestage "point_source"               ${molet_home}"lensed_point_source/vkl_point_source/bin/point_source" $infile $case_path $case_path
+    timestage "llm"                        ${molet_home}"lens_light_mass/vkl_llm/bin/llm" $infile $case_path $case_path
+    timestage "setup_dirs"                 ${molet_home}"combined_light/setup_dirs.sh" $infile $case_path $case_path
+    timestage "combine_light"              ${molet_home}"combined_light/bin/combine_light" $infile $case_path $case_path
+done
+
+e2e_file=${results_dir}"e2e_"${stamp}".json"
+jq -s --arg label "$label" --arg date "`date +%Y-%m-%dT%H:%M:%S`" '{"meta":{"label":$label,"date":$date},"stages":.}' $stages_file > $e2e_file
+rm -r $work_dir
+
+printf "\nResults in: %s\n            %s\n" $micro_file $e2e_file
@@ -0,0 +1,221 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+#include "vkllib.hpp"
+#include "instruments.hpp"
+#include "noise.hpp"
+#include "auxiliary_functions.hpp"
+#include "caustics.hpp"
+#include "polygons.hpp"
+#include "multi_plane.hpp"
+
+#include "harness.hpp"
+
+
+// Microbenchmarks of the hot spots of each MOLET stage.
+// The sizes bracket the ones of the test inputs, e.g. a 3.5 arcsec field of view at 0.035 arcsec per pixel with a x10 super-resolution.
+
+static void fillGaussian(RectGrid* grid,double sigma){
+  for(int i=0;i<grid->Ny;i++){
+    for(int j=0;j<grid->Nx;j++){
+      double x = grid->center_x[j];
+      double y = grid->center_y[i];
+      grid->z[i*grid->Nx+j] = exp(-(x*x+y*y)/(2.0*sigma*sigma));
+    }
+  }
+}
+
+static void fillEllipse(RectGrid* grid,double a,double b){
+  for(int i=0;i<grid->Ny;i++){
+    for(int j=0;j<grid->Nx;j++){
+      double x = grid->center_x[j];
+      double y = grid->center_y[i];
+      grid->z[i*grid->Nx+j] = ( x*x/(a*a) + y*y/(b*b) < 1.0 )? 1 : 0;
+    }
+  }
+}
+
+static Json::Value parseJson(std::string str){
+  Json::Value json;
+  std::istringstream(str) >> json;
+  return json;
+}
+
+
+int main(int argc,char* argv[]){
+  /*
+    Usage: bench <output json file> [repetitions] [label]
+  */
+  if( argc < 2 ){
+    fprintf(stderr,"Usage: %s <output json file> [repetitions] [label]\n",argv[0]);
+    return 1;
+  }
+  std::string outfile = argv[1];
+  int reps = 10;
+  if( argc > 2 ){
+    reps = atoi(argv[2]);
+  }
+  std::string label = "";
+  if( argc > 3 ){
+    label = argv[3];
+  }
+
+  BenchmarkSuite suite(reps);
+  double fov = 3.5;
+  std::vector<int> sizes = {100,250,500,1000};
+
+
+  //=============== BEGIN:INSTRUMENT CONVOLUTION =======================
+  Json::Value no_noise;
+  no_noise["type"] = "NoNoise";
+  for(int n=0;n<sizes.size();n++){
+    int N = sizes[n];
+    RectGrid grid(N,N,-fov/2.0,fov/2.0,-fov/2.0,fov/2.0);
+    fillGaussian(&grid,0.3);
+    std::vector<double> original(grid.z,grid.z+grid.Nz);
+
+    Instrument mycam("test_CAM",no_noise);
+    mycam.interpolatePSF(&grid);
+    mycam.cropPSF(0.99);
+    mycam.createKernel(grid.Nx,grid.Ny);
+    suite.run("Instrument::convolve",std::to_string(N)+"x"+std::to_string(N),
+	      [&](){ memcpy(grid.z,original.data(),grid.Nz*sizeof(double)); },
+	      [&](){ mycam.convolve(&grid); });
+
+    Instrument mycam_float("test_CAM",no_noise);
+    mycam_float.single_precision = true;
+    mycam_float.interpolatePSF(&grid);
+    mycam_float.cropPSF(0.99);
+    mycam_float.createKernel(grid.Nx,grid.Ny);
+    suite.run("Instrument::convolve (float)",std::to_string(N)+"x"+std::to_string(N),
+	      [&](){ memcpy(grid.z,original.data(),grid.Nz*sizeof(double)); },
+	      [&](){ mycam_float.convolve(&grid); });
+  }
+
+  // PSF preparation of a 1000x1000 super-resolved grid: from the instrument files, and from the on-disk cache
+  {
+    RectGrid grid(1000,1000,-fov/2.0,fov/2.0,-fov/2.0,fov/2.0);
+    std::string cache = "/tmp/bench_psf_cache.bin";
+    remove(cache.c_str());
+    suite.run("PSF preparation","1000x1000",
+	      [&](){
+		Instrument mycam("test_CAM",no_noise);
+		mycam.interpolatePSF(&grid);
+		mycam.cropPSF(0.99);
+		mycam.createKernel(grid.Nx,grid.Ny);
+		mycam.writePSFCache(cache,"bench");
+	      });
+    suite.run("PSF preparation (cached)","1000x1000",
+	      [&](){
+		Instrument mycam("test_CAM",no_noise);
+		mycam.readPSFCache(cache,"bench");
+	      });
+    remove(cache.c_str());
+  }
+  //================= END:INSTRUMENT CONVOLUTION =======================
+
+
+
+  //=============== BEGIN:NOISE =======================
+  for(int n=0;n<sizes.size();n++){
+    int N = sizes[n];
+    RectGrid grid(N,N,-fov/2.0,fov/2.0,-fov/2.0,fov/2.0);
+    fillGaussian(&grid,0.3);
+    std::vector<double> original(grid.z,grid.z+grid.Nz);
+
+    UniformGaussian noise(50.0);
+    suite.run("UniformGaussian::addNoise",std::to_string(N)+"x"+std::to_string(N),
+	      [&](){ memcpy(grid.z,original.data(),grid.Nz*sizeof(double)); },
+	      [&](){ noise.addNoise(&grid); });
+  }
+  //================= END:NOISE =======================
+
+
+
+  //=============== BEGIN:LIGHT CURVE INTERPOLATION =======================
+  // A densely sampled light curve of 10 years, observed with an increasing number of epochs spanning 3000 days
+  std::vector<double> lc_time(36500);
+  std::vector<double> lc_signal(36500);
+  for(int t=0;t<lc_time.size();t++){
+    lc_time[t]   = 0.1*t;
+    lc_signal[t] = 1.0 + 0.3*sin(0.01*lc_time[t]) + 0.1*sin(0.13*lc_time[t]);
+  }
+  LightCurve lc(lc_time,lc_signal);
+  std::vector<int> epochs = {100,1000,10000,100000};
+  for(int n=0;n<epochs.size();n++){
+    std::vector<double> obs_time(epochs[n]);
+    for(int t=0;t<obs_time.size();t++){
+      obs_time[t] = 200.0 + 3000.0*t/obs_time.size();
+    }
+    std::vector<double> interpolated(obs_time.size());
+    suite.run("LightCurve::interpolate",std::to_string(epochs[n])+" epochs",
+	      [&](){ lc.interpolate(obs_time,37.5,interpolated.data()); });
+  }
+  //================= END:LIGHT CURVE INTERPOLATION =======================
+
+
+
+  //=============== BEGIN:CONTOURS =======================
+  for(int n=0;n<sizes.size();n++){
+    int N = sizes[n];
+    RectGrid grid(N,N,-fov/2.0,fov/2.0,-fov/2.0,fov/2.0);
+    fillEllipse(&grid,1.2,0.8);
+    suite.run("mooreNeighborTracing",std::to_string(N)+"x"+std::to_string(N),
+	      [&](){ std::vector<Contour> contours = mooreNeighborTracing(&grid); });
+  }
+  //================= END:CONTOURS =======================
+
+
+
+  //=============== BEGIN:LENS =======================
+  // The lens of tests/test_0, with the distances for z_l=0.77 and z_s=2.03
+  Json::Value lenses = parseJson("[{\"redshift\":0.77,\"mass_model\":["
+				 "{\"type\":\"sie\",\"pars\":{\"b\":1.1,\"q\":0.8,\"pa\":-145.0,\"x0\":0.0,\"y0\":0.0}},"
+				 "{\"type\":\"external_shear\",\"pars\":{\"g\":0.032,\"phi\":-40.0}}]}]");
+  Json::Value cosmo  = parseJson("[{\"Dl\":1530.0,\"Ds\":1730.0,\"Dls\":910.0,\"Dlj\":[0.0]}]");
+  MultiPlaneLens mylens(lenses,cosmo,"");
+
+  std::vector<int> crit_sizes = {35,100,350};
+  for(int n=0;n<crit_sizes.size();n++){
+    int N = crit_sizes[n];
+    RectGrid coarse(N,N,-fov/2.0,fov/2.0,-fov/2.0,fov/2.0);
+    suite.run("marchingSquaresCriticals",std::to_string(N)+"x"+std::to_string(N),
+	      [&](){ std::vector<Contour> contours = marchingSquaresCriticals(&mylens,&coarse,0.035/100.0); });
+  }
+
+  // Image finding for a few source positions, inside and outside the caustics
+  std::vector<point> sources = {{-0.05,0.05},{0.0,0.0},{0.2,-0.1},{0.6,0.4}};
+  for(int s=0;s<sources.size();s++){
+    char size[32];
+    sprintf(size,"(%.2f,%.2f)",sources[s].x,sources[s].y);
+    suite.run("findImagePositions",size,
+	      [&](){
+		std::vector<double> xc,yc,rc;
+		findImagePositions(&mylens,sources[s],-fov/2.0,fov/2.0,-fov/2.0,fov/2.0,0.035/100.0,xc,yc,rc);
+	      });
+  }
+  //================= END:LENS =======================
+
+
+
+  //=============== BEGIN:OUTPUT =======================
+  Json::Value meta;
+  meta["label"] = label;
+  meta["reps"]  = reps;
+  char date[64];
+  time_t now = time(NULL);
+  strftime(date,sizeof(date),"%Y-%m-%dT%H:%M:%S",localtime(&now));
+  meta["date"] = date;
+  suite.write(outfile,meta);
+  //================= END:OUTPUT =======================
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+#include "harness.hpp"
+
+BenchmarkSuite::BenchmarkSuite(int reps):reps(reps){
+  this->results = Json::Value(Json::arrayValue);
+}
+
+void BenchmarkSuite::run(std::string name,std::string size,std::function<void()> setup,std::function<void()> code){
+  std::vector<double> times(this->reps);
+  setup();
+  code(); // warm up: page faults, fftw plans, caches
+  for(int r=0;r<this->reps;r++){
+    setup();
+    auto start = std::chrono::steady_clock::now();
+    code();
+    auto end = std::chrono::steady_clock::now();
+    times[r] = std::chrono::duration<double,std::milli>(end-start).count();
+  }
+  std::sort(times.begin(),times.end());
+  double mean = 0.0;
+  for(int r=0;r<this->reps;r++){
+    mean += times[r];
+  }
+  mean /= this->reps;
+
+  Json::Value entry;
+  entry["name"]      = name;
+  entry["size"]      = size;
+  entry["reps"]      = this->reps;
+  entry["min_ms"]    = times[0];
+  entry["median_ms"] = times[this->reps/2];
+  entry["mean_ms"]   = mean;
+  entry["max_ms"]    = times[this->reps-1];
+  this->results.append(entry);
+  printf("%-40s %-16s %12.4f ms (median of %d)\n",name.c_str(),size.c_str(),times[this->reps/2],this->reps);
+}
+
+void BenchmarkSuite::run(std::string name,std::string size,std::function<void()> code){
+  this->run(name,size,[](){},code);
+}
+
+void BenchmarkSuite::write(std::string filename,const Json::Value& meta){
+  Json::Value json;
+  json["meta"] = meta;
+  json["benchmarks"] = this->results;
+  std::ofstream file(filename,std::ofstream::out);
+  file << json;
+  file.close();
+}
@@ -6,7 +6,8 @@
 
 #include "json/json.h"
 
-class PSF;
+class RectGrid;
+class Instrument;
 
 class LightCurve {
 public:
@@ -26,6 +27,10 @@ public:
 
 void outputLightCurvesJson(std::vector<LightCurve*> lcs,std::string filename);
 
+// The seeing (FWHM in arcsec) at each observed epoch, from the "seeing" of the instrument: either a list with a value per epoch,
+// or the name of a file in input_files with a seeing curve in the same format as the light curves. Empty if there is no seeing.
+std::vector<double> epochSeeing(const Json::Value& instrument,std::vector<double> tobs,std::string in_path);
+
 
 
 class TransformPSF {
@@ -39,7 +44,7 @@ public:
   TransformPSF(double a,double b,double c,bool d,bool e);
   
   void applyTransform(double xin,double yin,double& xout,double& yout);
-  double interpolateValue(double x,double y,PSF* mypsf);
+  double interpolateValue(double x,double y,RectGrid* psf);
 
 private:
   double cosrot;
@@ -47,4 +52,36 @@ private:
 };
 
 
+
+// Interpolates the PSF of an instrument at the pixel size of a Nx x Ny frame of the given width and height, without allocating the frame.
+// The scaled PSF depends only on the pixel size, as long as the grid is wider than the original PSF (or is the whole frame, if that is narrower),
+// so a grid just wide enough gives the same PSF as the full frame.
+void scalePSF(Instrument* mycam,int Nx,int Ny,double width,double height);
+
+
+// The super-resolved frame of an instrument in the out-of-core mode: the lensed source and lens light images are read from their files
+// in square tiles, each one convolved together with a halo as wide as the PSF (overlap-save), binned, and added to the observed image.
+// The peak memory is set by the tile size and the PSF, independently of the field of view.
+class TiledFrame {
+public:
+  int Nx;     // super-resolved pixels
+  int Ny;     // super-resolved pixels
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+  int factor; // super-resolution factor
+  int tile;   // side of the tiles, in super-resolved pixels
+  int halo;   // in super-resolved pixels
+  int region; // side of the convolved regions (tile plus halos)
+
+  TiledFrame(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax,int factor,int tile_size);
+
+  void setHalo(Instrument* mycam);
+  void createKernel(Instrument* mycam);
+  RectGrid* observedImage(Instrument* mycam,std::vector<std::string> super_files);
+  RectGrid* binnedImage(std::string super_file);
+};
+
+
 #endif /* AUXILIARY_HPP */
@@ -0,0 +1,84 @@
+#ifndef CUTOUTS_HPP
+#define CUTOUTS_HPP
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+class RectGrid;
+class offsetPSF;
+class BaseNoise;
+
+// The PSF of a point source image for a unit flux, binned to the observed resolution, and its place in the observed image
+class Stamp {
+public:
+  int i0; // first row in the observed image
+  int j0; // first column in the observed image
+  int ni;
+  int nj;
+  std::vector<double> z;
+};
+
+// Composes the cutouts of the time varying light: the noiseless static light at the observed resolution (the base), plus the point source images,
+// each one a pre-binned PSF stamp times the flux of the image at the epoch, plus the noise, converted to magnitudes or not.
+// The base and the stamps are prepared once and shared by all the mocks and epochs, so a cutout costs a copy of the base, the stamps, and the noise.
+class CutoutCompositor {
+public:
+  RectGrid* base; // not owned
+  int factor;     // super-resolution factor of the frame of the PSF offsets
+  std::vector<Stamp> stamps;
+
+  CutoutCompositor(RectGrid* base,int factor);
+
+  void addStamp(offsetPSF offset,RectGrid* psf,double weight);
+  void compose(const std::vector<double>& fluxes,BaseNoise* noise,long seed,bool mag,double* out);
+
+private:
+  double base_max;
+  long base_argmax;
+};
+
+// The seed of the noise of the cutout at epoch t of a mock (counted as index_in*N_ex+index_ex), given the initial seed of the noise model.
+// It is the seed that the noise model would have after being called once for each previous cutout, in the order of the loops of combine_light.
+long cutoutSeed(long base_seed,int mock,int Nepochs,int t);
+
+
+// The ingredients of the cutouts of an instrument, from which the cutout of any mock and epoch can be created on demand,
+// identical to the one that combine_light would write: the compositor of each PSF (base and stamps), the PSF of each epoch,
+// the noise model and its seed, and the fluxes of the images at each epoch of each mock.
+// The file is written by combine_light in the lazy mode (the fluxes are appended one mock at a time), and read by get_cutout.
+// Only the header and the compositors are read in memory, the fluxes of a cutout are read from the file when it is created.
+class CutoutStore {
+public:
+  std::string instrument;
+  int Nx;
+  int Ny;
+  int Nimages;
+  int Nepochs;
+  int N_in;
+  int N_ex;
+  bool mag;
+  bool single_precision;
+  long base_seed;
+  Json::Value noise_pars;
+  std::vector<int> epoch_psf;
+  std::vector<CutoutCompositor*> compositors;
+
+  CutoutStore(std::string filename,std::string instrument,std::vector<CutoutCompositor*> compositors,std::vector<int> epoch_psf,int Nimages,int N_in,int N_ex,Json::Value noise_pars,long base_seed,bool mag,bool single_precision); // write
+  CutoutStore(std::string filename); // read
+  CutoutStore(const CutoutStore& other) = delete;
+  ~CutoutStore();
+
+  void appendMock(const std::vector<double>& fluxes); // the fluxes of the next mock, for each epoch and image: fluxes[t*Nimages+q]
+  void cutout(int index_in,int index_ex,int t,double* out);
+
+private:
+  std::fstream file;
+  std::streampos fluxes_start;
+  BaseNoise* noise = NULL;
+  std::vector<RectGrid*> bases; // owned, when read
+};
+
+#endif /* CUTOUTS_HPP */
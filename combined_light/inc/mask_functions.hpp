@@ -3,8 +3,10 @@
 
 #include <string>
 
-class ImagePlane;
+class RectGrid;
 
-void createMask(ImagePlane* image,double smear,double threshold,std::string outfile);
+// A binary mask of the lensed arcs of an image: the pixels brighter than 'threshold' times the brightest one, blurred by a Gaussian
+// whose 3 sigma are 'smear' times the width of the ring containing them, and thresholded again.
+void createMask(RectGrid* image,double smear,double threshold,std::string outfile,bool single_precision=false);
 
 #endif /* MASK_HPP */
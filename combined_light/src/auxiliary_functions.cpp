@@ -2,8 +2,13 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+
+#include "vkllib.hpp"
 
 #include "auxiliary_functions.hpp"
+#include "instruments.hpp"
+#include "fits_output.hpp"
 
 
 // START:LIGHTCURVE ========================================================================================
@@ -94,6 +99,35 @@ void outputLightCurvesJson(std::vector<LightCurve*> lcs,std::string filename){
   lcs_file.close();									      
 }
 
+std::vector<double> epochSeeing(const Json::Value& instrument,std::vector<double> tobs,std::string in_path){
+  std::vector<double> seeing;
+  if( !instrument.isMember("seeing") ){
+    return seeing;
+  }
+  seeing.resize(tobs.size());
+  if( instrument["seeing"].isArray() ){
+    if( instrument["seeing"].size() != instrument["time"].size() ){
+      fprintf(stderr,"The seeing of instrument '%s' has %d values, but there are %d observed epochs!\n",instrument["name"].asString().c_str(),instrument["seeing"].size(),instrument["time"].size());
+      exit(1);
+    }
+    for(int t=0;t<tobs.size();t++){
+      seeing[t] = instrument["seeing"][t].asDouble();
+    }
+  } else {
+    Json::Value seeing_curve;
+    std::ifstream fin(in_path+"/input_files/"+instrument["seeing"].asString(),std::ifstream::in);
+    fin >> seeing_curve;
+    fin.close();
+    LightCurve curve(seeing_curve);
+    if( curve.time.front() > tobs.front() || curve.time.back() <= tobs.back() ){
+      fprintf(stderr,"The seeing curve '%s' (%f to %f days) does not cover the observing period (%f to %f days)!\n",instrument["seeing"].asString().c_str(),curve.time.front(),curve.time.back(),tobs.front(),tobs.back());
+      exit(1);
+    }
+    curve.interpolate(tobs,0.0,seeing.data());
+  }
+  return seeing;
+}
+
 
 
 
@@ -121,7 +155,140 @@ void TransformPSF::applyTransform(double xin,double yin,double& xout,double& you
   }
 }
 
-double TransformPSF::interpolateValue(double x,double y,PSF* mypsf){
-  return 1.0;
+double TransformPSF::interpolateValue(double x,double y,RectGrid* psf){
+  // Bilinear interpolation of the PSF, centered on its grid and zero outside it, at the transformed position (x,y)
+  double xt,yt;
+  this->applyTransform(x,y,xt,yt);
+  double dx = psf->width/psf->Nx;
+  double dy = psf->height/psf->Ny;
+  // Continuous pixel indices, with the first row at the top
+  double u = (xt + psf->width/2.0)/dx - 0.5;
+  double v = (psf->height/2.0 - yt)/dy - 0.5;
+  int j = static_cast<int>(floor(u));
+  int i = static_cast<int>(floor(v));
+  double wx = u - j;
+  double wy = v - i;
+
+  double value = 0.0;
+  int ii[2] = {i,i+1};
+  int jj[2] = {j,j+1};
+  double wi[2] = {1.0-wy,wy};
+  double wj[2] = {1.0-wx,wx};
+  for(int a=0;a<2;a++){
+    for(int b=0;b<2;b++){
+      if( ii[a] >= 0 && ii[a] < psf->Ny && jj[b] >= 0 && jj[b] < psf->Nx ){
+	value += wi[a]*wj[b]*psf->z[ii[a]*psf->Nx+jj[b]];
+      }
+    }
+  }
+  return value;
 }
 // END:TRANSFORM PSF =====================================================================================
+
+
+
+
+
+// START:TILED FRAME =====================================================================================
+void scalePSF(Instrument* mycam,int Nx,int Ny,double width,double height){
+  double step_x = width/Nx;
+  double step_y = height/Ny;
+  int psf_Nx = std::min(Nx,static_cast<int>(ceil(mycam->original_psf->width/step_x)) + 1);
+  int psf_Ny = std::min(Ny,static_cast<int>(ceil(mycam->original_psf->height/step_y)) + 1);
+  RectGrid psf_grid(psf_Nx,psf_Ny,0,psf_Nx*step_x,0,psf_Ny*step_y);
+  mycam->interpolatePSF(&psf_grid);
+}
+
+TiledFrame::TiledFrame(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax,int factor,int tile_size):Nx(Nx),Ny(Ny),xmin(xmin),xmax(xmax),ymin(ymin),ymax(ymax),factor(factor){
+  this->tile = std::min(factor*tile_size,std::max(Nx,Ny));
+}
+
+void TiledFrame::setHalo(Instrument* mycam){
+  // The convolution of a region is circular, so the halo must be wider than half the PSF for the tile at its center to be exact.
+  // The regions are square, as expected by Instrument::createKernel.
+  this->halo   = std::max(mycam->cropped_psf->Nx,mycam->cropped_psf->Ny)/2 + 1;
+  this->region = this->tile + 2*this->halo;
+}
+
+void TiledFrame::createKernel(Instrument* mycam){
+  this->setHalo(mycam);
+  mycam->createKernel(this->region,this->region);
+}
+
+RectGrid* TiledFrame::observedImage(Instrument* mycam,std::vector<std::string> super_files){
+  std::vector<FitsFrame*> frames(super_files.size());
+  for(int f=0;f<super_files.size();f++){
+    frames[f] = new FitsFrame(super_files[f],this->Nx,this->Ny,this->xmin,this->xmax,this->ymin,this->ymax);
+  }
+  
+  RectGrid* obs_img = new RectGrid(this->Nx/this->factor,this->Ny/this->factor,this->xmin,this->xmax,this->ymin,this->ymax);
+  for(int i=0;i<obs_img->Nz;i++){
+    obs_img->z[i] = 0.0;
+  }
+
+  int h = this->halo;
+  for(int i0=0;i0<this->Ny;i0+=this->tile){
+    for(int j0=0;j0<this->Nx;j0+=this->tile){
+      // Sum of all the frames over the tile and its halo (zero beyond the frame), convolved with the PSF
+      RectGrid* region = frames[0]->newTile(i0-h,j0-h,this->region,this->region);
+      RectGrid* buffer = frames[0]->newTile(i0-h,j0-h,this->region,this->region);
+      frames[0]->readTile(i0-h,j0-h,region);
+      for(int f=1;f<frames.size();f++){
+	frames[f]->readTile(i0-h,j0-h,buffer);
+	for(int i=0;i<region->Nz;i++){
+	  region->z[i] += buffer->z[i];
+	}
+      }
+      delete(buffer);
+      mycam->convolve(region);
+
+      // Keep the tile, bin it to the observed resolution and place it in the observed image
+      int ni = std::min(this->tile,this->Ny-i0);
+      int nj = std::min(this->tile,this->Nx-j0);
+      RectGrid* core = frames[0]->newTile(i0,j0,ni,nj);
+      for(int i=0;i<ni;i++){
+	for(int j=0;j<nj;j++){
+	  core->z[i*nj+j] = region->z[(h+i)*this->region+h+j];
+	}
+      }
+      delete(region);
+      RectGrid* obs_tile = core->embeddedNewGrid(nj/this->factor,ni/this->factor,"integrate");
+      delete(core);
+      for(int i=0;i<obs_tile->Ny;i++){
+	for(int j=0;j<obs_tile->Nx;j++){
+	  obs_img->z[(i0/this->factor+i)*obs_img->Nx+j0/this->factor+j] = obs_tile->z[i*obs_tile->Nx+j];
+	}
+      }
+      delete(obs_tile);
+    }
+  }
+
+  for(int f=0;f<frames.size();f++){
+    delete(frames[f]);
+  }
+  return obs_img;
+}
+
+RectGrid* TiledFrame::binnedImage(std::string super_file){
+  // A super-resolved image binned to the observed resolution, without a convolution, read one tile at a time
+  FitsFrame frame(super_file,this->Nx,this->Ny,this->xmin,this->xmax,this->ymin,this->ymax);
+  RectGrid* obs_img = new RectGrid(this->Nx/this->factor,this->Ny/this->factor,this->xmin,this->xmax,this->ymin,this->ymax);
+  for(int i0=0;i0<this->Ny;i0+=this->tile){
+    for(int j0=0;j0<this->Nx;j0+=this->tile){
+      int ni = std::min(this->tile,this->Ny-i0);
+      int nj = std::min(this->tile,this->Nx-j0);
+      RectGrid* core = frame.newTile(i0,j0,ni,nj);
+      frame.readTile(i0,j0,core);
+      RectGrid* obs_tile = core->embeddedNewGrid(nj/this->factor,ni/this->factor,"integrate");
+      delete(core);
+      for(int i=0;i<obs_tile->Ny;i++){
+	for(int j=0;j<obs_tile->Nx;j++){
+	  obs_img->z[(i0/this->factor+i)*obs_img->Nx+j0/this->factor+j] = obs_tile->z[i*obs_tile->Nx+j];
+	}
+      }
+      delete(obs_tile);
+    }
+  }
+  return obs_img;
+}
+// END:TILED FRAME =====================================================================================
@@ -1,7 +1,10 @@
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <string>
+#include <map>
+#include <random>
 
 #include "json/json.h"
 
@@ -11,77 +14,200 @@
 #include "mask_functions.hpp"
 #include "instruments.hpp"
 #include "noise.hpp"
+#include "profiler.hpp"
+#include "fits_output.hpp"
+#include "cutouts.hpp"
+#include "molet_config.hpp"
+#include "task_graph.hpp"
+#include "shared_frame.hpp"
+#include "hash_bytes.hpp"
 
 int main(int argc,char* argv[]){
 
   //=============== BEGIN:PARSE INPUT =======================
-  std::ifstream fin;
+  Profiler::getInstance()->setStage("combine_light");
   Json::Value::Members jmembers;
 
-  // Read the main projection parameters
-  Json::Value root;
-  fin.open(argv[1],std::ifstream::in);
-  fin >> root;
-  fin.close();
-
   std::string in_path = argv[2];
   std::string out_path = argv[3];
 
-  std::string cut_out_scale;
-  if( root.isMember("output_options") ){
-    cut_out_scale = root["output_options"]["cut_outs"]["scale"].asString();
-  } else {
-    cut_out_scale = "mag";
+  // Read the main projection parameters
+  MoletConfig config(argv[1],out_path);
+  const Json::Value& root = config.root;
+
+  std::string cut_out_scale = config.output.cut_out_scale;
+  bool lazy_cutouts = config.output.lazy_cutouts;
+  bool single_precision = config.output.single_precision;
+  int tile_size = config.output.tile_size;
+  bool direct = config.output.direct;
+  if( direct ){
+    // The images are already at the observed resolution
+    tile_size = 0;
+  }
+  bool mask = config.output.mask;
+  double mask_smear = config.output.mask_smear;
+  double mask_threshold = config.output.mask_threshold;
+
+  // The super-resolved images of fproject and llm are on the frame shared by all the instruments
+  std::vector<double> resolutions;
+  for(int b=0;b<config.instruments.size();b++){
+    resolutions.push_back(Instrument::getResolution(config.instruments[b].name));
   }
+  SharedFrame shared(config.instruments,resolutions);
 
   
   // Loop over the instruments
+  // The instruments are independent of each other: each one is a task, and the tasks are run at the same time by a TaskGraph
   // ===================================================================================================================
   // ===================================================================================================================
-  for(int b=0;b<root["instruments"].size();b++){
-    const Json::Value instrument = root["instruments"][b];
-    std::string instrument_name = root["instruments"][b]["name"].asString();
-    Instrument mycam(instrument_name,root["instruments"][b]["noise"]);
+  auto processInstrument = [&](int b) -> int {
+    std::ifstream fin;
+    const Json::Value& instrument = root["instruments"][b];
+    const InstrumentConfig& inst = config.instruments[b];
+    std::string instrument_name = inst.name;
+    Instrument mycam(instrument_name,inst.noise);
+    mycam.single_precision = single_precision;
     
     // Set output image plane in super-resolution
-    double xmin = root["instruments"][b]["field-of-view_xmin"].asDouble();
-    double xmax = root["instruments"][b]["field-of-view_xmax"].asDouble();
-    double ymin = root["instruments"][b]["field-of-view_ymin"].asDouble();
-    double ymax = root["instruments"][b]["field-of-view_ymax"].asDouble();
+    double xmin = inst.xmin;
+    double xmax = inst.xmax;
+    double ymin = inst.ymin;
+    double ymax = inst.ymax;
     int res_x = static_cast<int>(ceil((xmax-xmin)/mycam.resolution));
     int res_y = static_cast<int>(ceil((ymax-ymin)/mycam.resolution));
-    int super_res_x = 10*res_x;
-    int super_res_y = 10*res_y;
-    RectGrid mysim(super_res_x,super_res_y,xmin,xmax,ymin,ymax);
-    
+    // In the direct integration mode the images are integrated over the observed pixels by fproject and llm, and everything below is done at the observed resolution,
+    // except the stamps of the point images
+    int factor = (direct)? 1 : 10;
+    int super_res_x = factor*res_x;
+    int super_res_y = factor*res_y;
+
+    // The super-resolved images are read directly if this instrument has the shared frame, otherwise they are resampled to its frame
+    auto readSuper = [&](std::string filename) -> RectGrid* {
+      if( shared.isFrame(super_res_x,super_res_y,xmin,xmax,ymin,ymax) ){
+	return new RectGrid(super_res_x,super_res_y,xmin,xmax,ymin,ymax,filename);
+      }
+      RectGrid* shared_image = new RectGrid(shared.Nx,shared.Ny,shared.xmin,shared.xmax,shared.ymin,shared.ymax,filename);
+      RectGrid* image = shared.resample(shared_image,super_res_x,super_res_y,xmin,xmax,ymin,ymax);
+      delete(shared_image);
+      return image;
+    };
+
+    // In the out-of-core mode the super-resolved frame is never held in memory as a whole, but processed in tiles
+    TiledFrame* tiled = NULL;
+    if( tile_size > 0 ){
+      tiled = new TiledFrame(super_res_x,super_res_y,xmin,xmax,ymin,ymax,10,tile_size);
+    }
 
     
     // Get the psf in super-resolution, crop it, and create convolution kernel
-    mycam.interpolatePSF(&mysim);
-    mycam.cropPSF(0.99);
-    mycam.createKernel(mysim.Nx,mysim.Ny);
-    
-    
-    // Create the fixed extended lensed light
-    RectGrid* extended = new RectGrid(super_res_x,super_res_y,xmin,xmax,ymin,ymax,out_path+"output/lensed_image_super.fits");
-    mycam.convolve(extended);
-    //extended->writeImage(output+"psf_lensed_image_super.fits");
+    // The cropped PSF and the transform of the kernel are cached in the output directory, for the same instrument, grid, and mode
+    ScopedTimer timer_psf("psf and kernel");
+    char recipe[256];
+    sprintf(recipe,"%dx%d %.10g %.10g %.10g %.10g direct:%d tile:%d",res_x,res_y,xmin,xmax,ymin,ymax,direct,tile_size);
+    std::string psf_cache = out_path + "output/psf_cache_" + instrument_name + ".bin";
+    if( getenv("MOLET_CACHE_DIR") != NULL ){
+      // A cache shared by many simulations (see molet_server), with a file per instrument and recipe
+      char name[32];
+      sprintf(name,"_%016llx.bin",(unsigned long long) hashBytes(hash_seed,recipe,strlen(recipe)));
+      psf_cache = std::string(getenv("MOLET_CACHE_DIR")) + "/psf_cache_" + instrument_name + name;
+    }
+    auto createKernel = [&](Instrument* cam){
+      if( direct ){
+	cam->createKernel(res_x,res_y);
+      } else if( tiled == NULL ){
+	cam->createKernel(super_res_x,super_res_y);
+      } else {
+	tiled->createKernel(cam);
+      }
+    };
+    auto preparePSF = [&](Instrument* cam){
+      if( !cam->readPSFCache(psf_cache,recipe) ){
+	scalePSF(cam,10*res_x,10*res_y,xmax-xmin,ymax-ymin);
+	cam->cropPSF(0.99);
+	if( direct ){
+	  cam->integratePSF(10);
+	}
+	createKernel(cam);
+	cam->writePSFCache(psf_cache,recipe);
+      } else if( tiled != NULL ){
+	tiled->setHalo(cam);
+      }
+    };
+    preparePSF(&mycam);
+    timer_psf.stop();
+
+
+    // Mask of the lensed arcs, from the lensed source binned to the observed resolution
+    if( mask ){
+      ScopedTimer timer_mask("mask");
+      RectGrid* lensed = NULL;
+      if( direct ){
+	lensed = new RectGrid(res_x,res_y,xmin,xmax,ymin,ymax,out_path+"output/lensed_image_obs.fits");
+      } else if( tiled == NULL ){
+	RectGrid* lensed_super = readSuper(out_path+"output/lensed_image_super.fits");
+	lensed = lensed_super->embeddedNewGrid(res_x,res_y,"integrate");
+	delete(lensed_super);
+      } else {
+	lensed = tiled->binnedImage(out_path+"output/lensed_image_super.fits");
+      }
+      createMask(lensed,mask_smear,mask_threshold,out_path+"output/mask_"+instrument_name+".fits",single_precision);
+      delete(lensed);
+      timer_mask.stop();
+    }
     
-    // Create the fixed lens galaxy light
-    RectGrid* lens_light = new RectGrid(super_res_x,super_res_y,xmin,xmax,ymin,ymax,out_path+"output/lens_light_super.fits");
-    mycam.convolve(lens_light);
-    //lens_light->writeImage(output+"psf_lens_light_super.fits");
     
-
-    // Combined light of the observed base image (binned from 'super' to observed resolution)
-    RectGrid* base = new RectGrid(super_res_x,super_res_y,xmin,xmax,ymin,ymax); 
-    for(int i=0;i<base->Nz;i++){
-      base->z[i] = lens_light->z[i] + extended->z[i];
+    // Combined light of the fixed extended lensed light and the lens galaxy light.
+    // The convolution is linear, so the sum is convolved once and only two super-resolved images are in memory at any time.
+    // The result is binned from 'super' to observed resolution to give the observed base image.
+    // The sum is kept only if it has to be convolved again, with the PSF of each distinct seeing.
+    bool seeing = config.point_source.present && instrument.isMember("seeing");
+    RectGrid* static_light = NULL;
+    if( direct ){
+      static_light = new RectGrid(res_x,res_y,xmin,xmax,ymin,ymax,out_path+"output/lensed_image_obs.fits");
+      RectGrid* lens_light = new RectGrid(res_x,res_y,xmin,xmax,ymin,ymax,out_path+"output/lens_light_obs.fits");
+      for(int i=0;i<static_light->Nz;i++){
+	static_light->z[i] += lens_light->z[i];
+      }
+      delete(lens_light);
+    } else if( tiled == NULL ){
+      static_light = readSuper(out_path+"output/lensed_image_super.fits");
+      RectGrid* lens_light = readSuper(out_path+"output/lens_light_super.fits");
+      for(int i=0;i<static_light->Nz;i++){
+	static_light->z[i] += lens_light->z[i];
+      }
+      delete(lens_light);
+    }
+    auto observeStatic = [&](Instrument* cam){
+      RectGrid* obs = NULL;
+      if( tiled != NULL ){
+	obs = tiled->observedImage(cam,{out_path+"output/lensed_image_super.fits",out_path+"output/lens_light_super.fits"});
+      } else {
+	RectGrid* base = static_light;
+	if( seeing ){
+	  base = new RectGrid(static_light->Nx,static_light->Ny,xmin,xmax,ymin,ymax);
+	  for(int i=0;i<base->Nz;i++){
+	    base->z[i] = static_light->z[i];
+	  }
+	} else {
+	  static_light = NULL;
+	}
+	cam->convolve(base);
+	if( direct ){
+	  obs = base;
+	} else {
+	  //base->writeImage(output+"psf_base_super.fits");
+	  obs = base->embeddedNewGrid(res_x,res_y,"integrate");
+	  delete(base);
+	}
+      }
+      return obs;
+    };
+    ScopedTimer timer_conv("convolution");
+    RectGrid* obs_base = NULL;
+    if( !seeing ){
+      obs_base = observeStatic(&mycam);
     }
-    delete(extended);
-    delete(lens_light);
-    RectGrid* obs_base = base->embeddedNewGrid(res_x,res_y,"integrate");
-    delete(base);
+    timer_conv.stop();
 
 
 
@@ -95,11 +221,13 @@ int main(int argc,char* argv[]){
 
     
 
-    if( !root.isMember("point_source") ){
+    if( !config.point_source.present ){
       //=============== CREATE A SINGLE STATIC IMAGE ====================
 
       // Adding noise here
+      ScopedTimer timer_noise("noise");
       mycam.noise->addNoise(obs_base);
+      timer_noise.stop();
       
       // Convert to magnitudes
       if( cut_out_scale == "mag" ){
@@ -109,7 +237,7 @@ int main(int argc,char* argv[]){
       }
 
       // Output the observed base image
-      FitsInterface::writeFits(obs_base->Nx,obs_base->Ny,obs_base->z,out_path + "output/OBS_" + instrument_name + ".fits");
+      writeImage(obs_base->Nx,obs_base->Ny,obs_base->z,out_path + "output/OBS_" + instrument_name + ".fits",single_precision);
       delete(obs_base);
       
     } else {
@@ -120,22 +248,26 @@ int main(int argc,char* argv[]){
       fin.open(out_path+"output/multiple_images.json",std::ifstream::in);
       fin >> images;
       fin.close();
+      std::vector<double> image_dt(images.size());
+      std::vector<double> image_mag(images.size());
+      for(int q=0;q<images.size();q++){
+	image_dt[q]  = images[q]["dt"].asDouble();
+	image_mag[q] = images[q]["mag"].asDouble();
+      }
 
       
+      ScopedTimer timer_read("read light curves");
       // Get maximum image time delay
       double td_max = 0.0;
       for(int q=0;q<images.size();q++){
-	double td = images[q]["dt"].asDouble();
+	double td = image_dt[q];
 	if( td > td_max ){
 	  td_max = td;
 	}
       }
 
       // Get observed time vector
-      std::vector<double> tobs;
-      for(int t=0;t<instrument["time"].size();t++){
-	tobs.push_back(instrument["time"][t].asDouble());
-      }
+      std::vector<double> tobs = inst.time;
       double tobs_t0   = tobs[0];
       double tobs_tmax = tobs.back();
       double tobs_Dt   = tobs_tmax - tobs_t0;
@@ -156,7 +288,7 @@ int main(int argc,char* argv[]){
 
       // Read intrinsic light curve(s) from JSON
       Json::Value intrinsic_lc;
-      if( root["point_source"]["variability"]["intrinsic"]["type"].asString() == "custom" ){
+      if( config.point_source.intrinsic_type == "custom" ){
 	fin.open(in_path+"/input_files/"+instrument_name+"_LC_intrinsic.json",std::ifstream::in);
       } else {
 	fin.open(out_path+"output/"+instrument_name+"_LC_intrinsic.json",std::ifstream::in);
@@ -190,7 +322,7 @@ int main(int argc,char* argv[]){
 
       // Check for unmicrolensed variability and read unmicrolensed light curves from JSON
       bool unmicro = false;
-      if( root["point_source"]["variability"].isMember("unmicro") ){
+      if( config.point_source.unmicro ){
 	unmicro = true;
       }
 
@@ -233,7 +365,7 @@ int main(int argc,char* argv[]){
       
       // Read extrinsic light curve(s) from JSON
       Json::Value extrinsic_lc;
-      if( root["point_source"]["variability"]["extrinsic"]["type"].asString() == "custom" ){
+      if( config.point_source.extrinsic_type == "custom" ){
 	fin.open(in_path+"/input_files/"+instrument_name+"_LC_extrinsic.json",std::ifstream::in);
       } else {
 	fin.open(out_path+"output/"+instrument_name+"_LC_extrinsic.json",std::ifstream::in);
@@ -268,39 +400,117 @@ int main(int argc,char* argv[]){
       }
 
       
-      // Configure the PSF for the point source
-      // Perturb the PSF at each image location
-      std::vector<Instrument*> Instrument_list(images.size());
-      for(int q=0;q<images.size();q++){
-	//TransformPSF* dum = new TransformPSF(images[q]["x"].asDouble(),images[q]["y"].asDouble(),0.0,false,false);
-	//transPSF[q] = dum;
-	Instrument_list[q] = &mycam; // just copy the same instrument pointer per image
+      timer_read.stop();
+
+      // Configure the PSF at each epoch
+      // With a seeing, the instrument PSF is blurred by the atmosphere, differently at each epoch.
+      // The static light and the PSF stamps are prepared once per distinct seeing (to 0.001 arcsec) and reused by all the mocks.
+      std::vector<int> epoch_psf(tobs.size(),0);
+      std::vector<Instrument*> seeing_cams = {&mycam};
+      std::vector<double> psf_seeing = {0.0};
+      std::vector<RectGrid*> obs_bases = {obs_base};
+      if( seeing ){
+	ScopedTimer timer_seeing("seeing");
+	std::vector<double> epoch_seeing = epochSeeing(instrument,tobs,in_path);
+	std::map<long,int> distinct;
+	Json::Value seeing_json;
+	seeing_cams.clear();
+	psf_seeing.clear();
+	obs_bases.clear();
+	for(int t=0;t<tobs.size();t++){
+	  long key = lround(1000.0*epoch_seeing[t]);
+	  if( distinct.find(key) == distinct.end() ){
+	    int p = distinct.size();
+	    distinct[key] = p;
+	    // The PSF prepared above is blurred, and the kernel of each seeing is created once
+	    Instrument* cam = new Instrument(instrument_name,inst.noise);
+	    cam->single_precision = single_precision;
+	    cam->copyPSF(&mycam);
+	    cam->blurPSF(key/1000.0);
+	    createKernel(cam);
+	    seeing_cams.push_back(cam);
+	    psf_seeing.push_back(key/1000.0);
+	    obs_bases.push_back( observeStatic(cam) );
+	    char buffer[8];
+	    sprintf(buffer,"%03d",p);
+	    writeImage(obs_bases[p]->Nx,obs_bases[p]->Ny,obs_bases[p]->z,out_path+"output/OBS_"+instrument_name+"_static_"+buffer+".fits",single_precision);
+	    seeing_json["seeing"].append(key/1000.0);
+	  }
+	  epoch_psf[t] = distinct[key];
+	  seeing_json["epoch_psf"].append(epoch_psf[t]);
+	}
+	std::ofstream seeing_file(out_path+"output/"+instrument_name+"_seeing.json");
+	seeing_file << seeing_json;
+	seeing_file.close();
+	delete(static_light);
+	static_light = NULL;
+	timer_seeing.stop();
       }
-      // Set the PSF related offsets for each image
-      std::vector<offsetPSF> PSFoffsets(images.size());
-      for(int q=0;q<images.size();q++){
-	PSFoffsets[q] = Instrument_list[q]->offsetPSFtoPosition(images[q]["x"].asDouble(),images[q]["y"].asDouble(),&mysim);
+      int Npsf = seeing_cams.size();
+
+      // The point images are stamped from the super-resolved PSF and binned to the observed pixels, so that they are placed to a tenth of a pixel.
+      // In the direct mode the PSF of the convolution is integrated over the observed pixels, so the stamps get their own super-resolved PSF, with the same seeing.
+      std::vector<Instrument*> stamp_cams = seeing_cams;
+      if( direct ){
+	Instrument* super_cam = new Instrument(instrument_name,inst.noise);
+	scalePSF(super_cam,10*res_x,10*res_y,xmax-xmin,ymax-ymin);
+	super_cam->cropPSF(0.99);
+	for(int p=0;p<Npsf;p++){
+	  Instrument* cam = new Instrument(instrument_name,inst.noise);
+	  cam->copyPSF(super_cam);
+	  cam->blurPSF(psf_seeing[p]);
+	  stamp_cams[p] = cam;
+	}
+	delete(super_cam);
       }
-      FILE* fh = fopen((out_path+"output/psf_locations.dat").c_str(),"w");
-      for(int q=0;q<images.size();q++){
-	PSFoffsets[q].printFrame(fh,mysim.Nx,mysim.Ny,mysim.width,mysim.height);
+
+      // The PSF at each image location (the same for all the images if the instrument PSF does not vary across the field), for each seeing
+      std::vector< std::vector<RectGrid*> > image_psfs(Npsf,std::vector<RectGrid*>(images.size()));
+      std::vector< std::vector<offsetPSF> > PSFoffsets(Npsf,std::vector<offsetPSF>(images.size()));
+      std::vector< std::vector<double> > psf_partial_sum(Npsf,std::vector<double>(images.size()));
+      // One file per instrument, since the instruments are processed concurrently
+      FILE* fh = fopen((out_path+"output/"+instrument_name+"_psf_locations.dat").c_str(),"w");
+      for(int p=0;p<Npsf;p++){
+	for(int q=0;q<images.size();q++){
+	  image_psfs[p][q] = stamp_cams[p]->psfAtPosition(images[q]["x"].asDouble(),images[q]["y"].asDouble());
+	  // Set the PSF related offsets for each image
+	  PSFoffsets[p][q] = stamp_cams[p]->offsetPSFtoPosition(images[q]["x"].asDouble(),images[q]["y"].asDouble(),10*res_x,10*res_y,xmax-xmin,ymax-ymin);
+	  PSFoffsets[p][q].printFrame(fh,10*res_x,10*res_y,xmax-xmin,ymax-ymin);
+	  // Calculate the appropriate PSF sums
+	  double sum = 0.0;
+	  for(int i=0;i<PSFoffsets[p][q].ni;i++){
+	    for(int j=0;j<PSFoffsets[p][q].nj;j++){
+	      int index_psf = i*image_psfs[p][q]->Nx + j;
+	      sum += image_psfs[p][q]->z[index_psf];
+	    }
+	  }
+	  psf_partial_sum[p][q] = sum;
+	}
       }
       fclose(fh);
-      // Calculate the appropriate PSF sums
-      std::vector<double> psf_partial_sum(images.size());
-      for(int q=0;q<images.size();q++){
-	double sum = 0.0;
-	for(int i=0;i<PSFoffsets[q].ni;i++){
-	  for(int j=0;j<PSFoffsets[q].nj;j++){
-	    int index_psf = i*Instrument_list[q]->cropped_psf->Nx + j;
-	    sum += Instrument_list[q]->cropped_psf->z[index_psf];
-	  }
+
+      // The cutouts of each seeing: the noiseless static light plus the stamps of the point source images, binned once to the observed resolution
+      std::vector<CutoutCompositor*> compositors(Npsf);
+      for(int p=0;p<Npsf;p++){
+	compositors[p] = new CutoutCompositor(obs_bases[p],10);
+	for(int q=0;q<images.size();q++){
+	  compositors[p]->addStamp(PSFoffsets[p][q],image_psfs[p][q],1.0/psf_partial_sum[p][q]);
 	}
-	psf_partial_sum[q] = sum;
+      }
+      std::vector<double> cutout(res_x*res_y);
+      std::vector<double> fluxes(images.size());
+
+      // In the lazy mode, only the ingredients of the cutouts are written, and any cutout can be created later with get_cutout
+      bool output_cutouts = config.point_source.output_cutouts;
+      CutoutStore* store = NULL;
+      if( output_cutouts && lazy_cutouts ){
+	store = new CutoutStore(out_path+"output/cutouts_"+instrument_name+".bin",instrument_name,compositors,epoch_psf,images.size(),N_in,N_ex,inst.noise,mycam.noise->seed,cut_out_scale == "mag",single_precision);
       }
       
       
-      std::srand(123);
+      // A generator per instrument, not std::rand, which is shared by the threads
+      std::minstd_rand delay_rng(123);
+      ScopedTimer timer_mocks("mock loop");
 
       // Loop over intrinsic light curves
       //0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=
@@ -316,18 +526,19 @@ int main(int argc,char* argv[]){
 	  //std::cout << mock << std::endl;
 
 	  // *********************** Product: Observed continuous light curves ***********************
+	  ScopedTimer timer_cont("continuous light curves");
 	  for(int itd=0;itd<3;itd++){
 
 
 	    // redefine time delays and td_max
-	    Json::Value mod_images = images;
+	    std::vector<double> mod_dt(images.size());
 	    for(int q=0;q<images.size();q++){
-	      mod_images[q]["dt"] = images[q]["dt"].asDouble() + std::rand() % 20 + 1;
+	      mod_dt[q] = image_dt[q] + delay_rng() % 20 + 1;
 	    }
 	    // Get maximum image time delay
 	    td_max = 0.0;
-	    for(int q=0;q<mod_images.size();q++){
-	      double td = mod_images[q]["dt"].asDouble();
+	    for(int q=0;q<images.size();q++){
+	      double td = mod_dt[q];
 	      if( td > td_max ){
 		td_max = td;
 	      }
@@ -342,21 +553,21 @@ int main(int argc,char* argv[]){
 
 
 	    
-	    std::vector<LightCurve*> cont_LC(mod_images.size());
-	    for(int q=0;q<mod_images.size();q++){
+	    std::vector<LightCurve*> cont_LC(images.size());
+	    for(int q=0;q<images.size();q++){
 	      cont_LC[q] = new LightCurve(tcont);
 	    }
 	    
 	    // Calculate the combined light curve for each image
-	    for(int q=0;q<mod_images.size();q++){
-	      double macro_mag = abs(mod_images[q]["mag"].asDouble());
+	    for(int q=0;q<images.size();q++){
+	      double macro_mag = abs(image_mag[q]);
 	      LightCurve* cont_LC_intrinsic = new LightCurve(tcont);
-	      LC_intrinsic[lc_in]->interpolate(cont_LC_intrinsic,td_max - mod_images[q]["dt"].asDouble());
+	      LC_intrinsic[lc_in]->interpolate(cont_LC_intrinsic,td_max - mod_dt[q]);
 	      
 	      if( unmicro ){
 		// === Combining three signals: intrinsic, intrinsic unmicrolensed, and extrinsic
 		LightCurve* cont_LC_unmicro = new LightCurve(tcont);
-		LC_unmicro[lc_in]->interpolate(cont_LC_unmicro,td_max - mod_images[q]["dt"].asDouble());
+		LC_unmicro[lc_in]->interpolate(cont_LC_unmicro,td_max - mod_dt[q]);
 		
 		if( LC_extrinsic[q][lc_ex]->time.size() > 0 ){ // Check if multiple image does not have a corresponding extrinsic light curve (i.e. a maximum image without a magnification map)
 		  LC_extrinsic[q][lc_ex]->interpolate(cont_LC[q],0.0);
@@ -397,11 +608,13 @@ int main(int argc,char* argv[]){
 
 
 	  }
+	  timer_cont.stop();
 	  // *********************** End of product **************************************************
 
 
 
 	  // *********************** Product: Observed sampled light curves **************************
+	  ScopedTimer timer_samp("sampled light curves");
 	  std::vector<LightCurve*> samp_LC(images.size());
 	  for(int q=0;q<images.size();q++){
 	    samp_LC[q] = new LightCurve(tobs);
@@ -409,14 +622,14 @@ int main(int argc,char* argv[]){
 	  
 	  // Calculate the combined light curve for each image
 	  for(int q=0;q<images.size();q++){
-	    double macro_mag = abs(images[q]["mag"].asDouble());
+	    double macro_mag = abs(image_mag[q]);
 	    LightCurve* samp_LC_intrinsic = new LightCurve(tobs);
-	    LC_intrinsic[lc_in]->interpolate(samp_LC_intrinsic,td_max - images[q]["dt"].asDouble());
+	    LC_intrinsic[lc_in]->interpolate(samp_LC_intrinsic,td_max - image_dt[q]);
 	    
 	    if( unmicro ){
 	      // === Combining three signals: intrinsic, intrinsic unmicrolensed, and extrinsic
 	      LightCurve* samp_LC_unmicro = new LightCurve(tobs);
-	      LC_unmicro[lc_in]->interpolate(samp_LC_unmicro,td_max - images[q]["dt"].asDouble());
+	      LC_unmicro[lc_in]->interpolate(samp_LC_unmicro,td_max - image_dt[q]);
 
 	      if( LC_extrinsic[q][lc_ex]->time.size() > 0 ){ // Check if multiple image does not have a corresponding extrinsic light curve (i.e. a maximum image without a magnification map)
 		LC_extrinsic[q][lc_ex]->interpolate(samp_LC[q],0.0);
@@ -449,75 +662,41 @@ int main(int argc,char* argv[]){
 	  
 	  // Write json light curves
 	  outputLightCurvesJson(samp_LC,out_path+mock+"/"+instrument_name+"_LC_sampled.json");
+	  timer_samp.stop();
 	  // *********************** End of product **************************************************
 
 
 	  
 	  
 	  // *********************** Product: Observed sampled cut-outs (images) *****************************
-	  if( root["point_source"]["output_cutouts"].asBool() ){
-	    for(int t=0;t<tobs.size();t++){
-
-	      // Loop over the truncated PSF (through PSF_offsets) for each image, and add their light to the pp_light image that contains all the point source light.
-	      RectGrid pp_light(super_res_x,super_res_y,xmin,xmax,ymin,ymax); // this has to be in intensity units in order to be able to add the different light components
-	      for(int q=0;q<images.size();q++){
-		for(int i=0;i<PSFoffsets[q].ni;i++){
-		  for(int j=0;j<PSFoffsets[q].nj;j++){
-		    int index_img = PSFoffsets[q].offset_image + i*pp_light.Nx + j;
-		    int index_psf = PSFoffsets[q].offset_cropped + i*Instrument_list[q]->cropped_psf->Nx + j;
-		    //pp_light.z[index_img] += 1.0;
-		    pp_light.z[index_img] += samp_LC[q]->signal[t]*Instrument_list[q]->cropped_psf->z[index_psf]/psf_partial_sum[q];
-		  }
+	  ScopedTimer timer_cutouts("cutouts");
+	  if( output_cutouts ){
+	    // Each cutout has its own noise seed, so it can also be created alone
+	    int mock_index = lc_in*N_ex + lc_ex;
+	    if( store != NULL ){
+	      std::vector<double> mock_fluxes(tobs.size()*images.size());
+	      for(int t=0;t<tobs.size();t++){
+		for(int q=0;q<images.size();q++){
+		  mock_fluxes[t*images.size()+q] = samp_LC[q]->signal[t];
 		}
 	      }
-
-	      /*
-	      char buffer[4];
-	      sprintf(buffer,"%03d",t);
-	      std::string timestep = buffer;
-	      FitsInterface::writeFits(pp_light.Nx,pp_light.Ny,pp_light.z,out_path+mock+"/OBS_"+instrument_name+"_"+timestep+".fits");
-	      */
-	      
-	      // Check the expected brightness of the multiple images vs the image
-
-		//double sum = 0.0;
-		//for(int i=0;i<pp_light.Nm;i++){
-		//sum += pp_light.img[i];
-		//}
-		//double fac = inf_dx*inf_dy;
-		//double true_sum = 0.0;
-		//for(int q=0;q<images.size();q++){
-		//true_sum += img_signal[q][t];
-		//}
-		//printf("True: %15.10f (%15.10f)  Numerical: %15.10f (%15.10f)\n",true_sum,-2.5*log10(true_sum),sum,-2.5*log10(sum));
-
-	      // Output Point Source image only
-	      //char baf[4];
-	      //sprintf(baf,"%03d",t);
-	      //std::string timesteep = baf;
-	      //pp_light.writeImage(out_path+mock+"/PS_"+instrument_name+"_"+timesteep+".fits");
-
-
-	      // Bin image from 'super' to observed resolution
-	      RectGrid* obs_img = pp_light.embeddedNewGrid(res_x,res_y,"additive");
-	      
-	      // Adding time-dependent noise here
-	      mycam.noise->addNoise(obs_img);
-	      
-	      // Finalize output (e.g convert to magnitudes) and write
-	      if( cut_out_scale == "mag" ){
-		for(int i=0;i<obs_img->Nz;i++){
-		  obs_img->z[i] = -2.5*log10(obs_img->z[i]);
+	      store->appendMock(mock_fluxes);
+	    } else {
+	      for(int t=0;t<tobs.size();t++){
+		// Static light, point source images and noise, in flux or magnitudes
+		for(int q=0;q<images.size();q++){
+		  fluxes[q] = samp_LC[q]->signal[t];
 		}
+		compositors[epoch_psf[t]]->compose(fluxes,mycam.noise,cutoutSeed(mycam.noise->seed,mock_index,tobs.size(),t),cut_out_scale == "mag",cutout.data());
+		
+		char buffer[4];
+		sprintf(buffer,"%03d",t);
+		std::string timestep = buffer;
+		writeImage(res_x,res_y,cutout.data(),out_path+mock+"/OBS_"+instrument_name+"_"+timestep+".fits",single_precision);
 	      }
-	      char buffer[4];
-	      sprintf(buffer,"%03d",t);
-	      std::string timestep = buffer;
-	      FitsInterface::writeFits(obs_img->Nx,obs_img->Ny,obs_img->z,out_path+mock+"/OBS_"+instrument_name+"_"+timestep+".fits");
-	      delete(obs_img);
-
 	    }
 	  }
+	  timer_cutouts.stop();
 	  // *********************** End of product **************************************************	    
 
 	  // Do some cleanup
@@ -532,6 +711,7 @@ int main(int argc,char* argv[]){
       }
       // Loop over intrinsic light curves ends here
       //0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=0=
+      timer_mocks.stop();
 
       
       for(int lc_in=0;lc_in<N_in;lc_in++){
@@ -550,16 +730,47 @@ int main(int argc,char* argv[]){
 	}
       }
 
+      delete(store);
+      for(int p=0;p<Npsf;p++){
+	for(int q=0;q<images.size();q++){
+	  delete(image_psfs[p][q]);
+	}
+	delete(compositors[p]);
+	delete(obs_bases[p]);
+	if( stamp_cams[p] != seeing_cams[p] ){
+	  delete(stamp_cams[p]);
+	}
+	if( seeing_cams[p] != &mycam ){
+	  delete(seeing_cams[p]);
+	}
+      }
+
     }
     //================= END:CREATE THE TIME VARYING LIGHT ====================
     
+    if( tiled != NULL ){
+      delete(tiled);
+    }
     
-    
+    return 0;
+  };
+
+  TaskGraph instrument_tasks;
+  std::vector<int> status(config.instruments.size(),0);
+  for(int b=0;b<config.instruments.size();b++){
+    instrument_tasks.add([&,b](){ status[b] = processInstrument(b); });
+  }
+  instrument_tasks.run(config.output.threads);
+  for(int b=0;b<config.instruments.size();b++){
+    if( status[b] != 0 ){
+      return status[b];
+    }
   }
   // Loop over the instruments ends here
   // ===================================================================================================================
   // ===================================================================================================================
 
   
+  Profiler::getInstance()->write(out_path+"output/timing_combine_light.json");
   return 0;
 }
@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+#include "vkllib.hpp"
+
+#include "cutouts.hpp"
+#include "instruments.hpp"
+#include "noise.hpp"
+
+
+// START:CUTOUT COMPOSITOR =====================================================================================
+CutoutCompositor::CutoutCompositor(RectGrid* base,int factor):base(base),factor(factor){
+  double* max = std::max_element(base->z,base->z+base->Nz);
+  this->base_max = *max;
+  this->base_argmax = max - base->z;
+}
+
+void CutoutCompositor::addStamp(offsetPSF offset,RectGrid* psf,double weight){
+  // The (weighted) part of the PSF that falls in the super-resolved frame, summed over the observed pixels
+  Stamp stamp;
+  int super_Nx = this->base->Nx*this->factor;
+  int r0 = offset.offset_image/super_Nx;
+  int c0 = offset.offset_image%super_Nx;
+  stamp.i0 = r0/this->factor;
+  stamp.j0 = c0/this->factor;
+  stamp.ni = (offset.ni > 0)? (r0+offset.ni-1)/this->factor - stamp.i0 + 1 : 0;
+  stamp.nj = (offset.nj > 0)? (c0+offset.nj-1)/this->factor - stamp.j0 + 1 : 0;
+  if( stamp.ni == 0 || stamp.nj == 0 ){
+    stamp.ni = 0;
+    stamp.nj = 0;
+  }
+  stamp.z.assign(stamp.ni*stamp.nj,0.0);
+  for(int i=0;i<offset.ni;i++){
+    int ii = (r0+i)/this->factor - stamp.i0;
+    for(int j=0;j<offset.nj;j++){
+      int jj = (c0+j)/this->factor - stamp.j0;
+      stamp.z[ii*stamp.nj+jj] += weight*psf->z[offset.offset_cropped+i*psf->Nx+j];
+    }
+  }
+  this->stamps.push_back(stamp);
+}
+
+void CutoutCompositor::compose(const std::vector<double>& fluxes,BaseNoise* noise,long seed,bool mag,double* out){
+  int Nx = this->base->Nx;
+  long N = this->base->Nz;
+  memcpy(out,this->base->z,N*sizeof(double));
+
+  // The stamps change only a few pixels, so the maximum (needed by the noise) is updated from the one of the base
+  double zmax = this->base_max;
+  for(int s=0;s<this->stamps.size();s++){
+    const Stamp& stamp = this->stamps[s];
+    for(int i=0;i<stamp.ni;i++){
+      double* row = out + (long) (stamp.i0+i)*Nx + stamp.j0;
+      const double* z = stamp.z.data() + i*stamp.nj;
+      for(int j=0;j<stamp.nj;j++){
+	row[j] += fluxes[s]*z[j];
+	zmax = std::max(zmax,row[j]);
+      }
+    }
+  }
+  if( out[this->base_argmax] < this->base_max ){
+    // A negative stamp value lowered the brightest pixel of the base
+    zmax = *std::max_element(out,out+N);
+  }
+
+  double offset = noise->seededNoise(out,N,zmax,seed);
+  if( mag ){
+    for(long i=0;i<N;i++){
+      out[i] = -2.5*log10(out[i] + offset);
+    }
+  } else if( offset != 0.0 ){
+    for(long i=0;i<N;i++){
+      out[i] += offset;
+    }
+  }
+}
+// END:CUTOUT COMPOSITOR =====================================================================================
+
+
+
+// START:CUTOUT STORE =====================================================================================
+static const char cutout_store_magic[8] = {'M','O','L','C','U','T','0','1'};
+
+long cutoutSeed(long base_seed,int mock,int Nepochs,int t){
+  long calls = (long) mock*Nepochs + t + 1;
+  return base_seed + 2*calls;
+}
+
+static void writeString(std::fstream& file,std::string str){
+  uint32_t length = str.size();
+  file.write((char*) &length,sizeof(uint32_t));
+  file.write(str.data(),length);
+}
+
+static std::string readString(std::fstream& file){
+  uint32_t length = 0;
+  file.read((char*) &length,sizeof(uint32_t));
+  std::string str(length,' ');
+  file.read(&str[0],length);
+  return str;
+}
+
+CutoutStore::CutoutStore(std::string filename,std::string instrument,std::vector<CutoutCompositor*> compositors,std::vector<int> epoch_psf,int Nimages,int N_in,int N_ex,Json::Value noise_pars,long base_seed,bool mag,bool single_precision):instrument(instrument),Nimages(Nimages),N_in(N_in),N_ex(N_ex),mag(mag),single_precision(single_precision),base_seed(base_seed),noise_pars(noise_pars),epoch_psf(epoch_psf),compositors(compositors){
+  this->Nx = compositors[0]->base->Nx;
+  this->Ny = compositors[0]->base->Ny;
+  this->Nepochs = epoch_psf.size();
+  this->file.open(filename,std::ios::out|std::ios::binary|std::ios::trunc);
+  if( !this->file.is_open() ){
+    fprintf(stderr,"Could not write the cutouts file '%s'\n",filename.c_str());
+    exit(1);
+  }
+
+  int dims[8] = {this->Nx,this->Ny,(int) compositors.size(),Nimages,this->Nepochs,N_in,N_ex,mag + 2*single_precision};
+  int64_t seed = base_seed;
+  std::stringstream noise_json;
+  noise_json << noise_pars;
+  this->file.write(cutout_store_magic,8);
+  this->file.write((char*) dims,8*sizeof(int));
+  this->file.write((char*) &seed,sizeof(int64_t));
+  writeString(this->file,instrument);
+  writeString(this->file,noise_json.str());
+  this->file.write((char*) epoch_psf.data(),this->Nepochs*sizeof(int));
+  for(int p=0;p<compositors.size();p++){
+    RectGrid* base = compositors[p]->base;
+    double extent[4] = {base->xmin,base->xmax,base->ymin,base->ymax};
+    this->file.write((char*) extent,4*sizeof(double));
+    this->file.write((char*) &compositors[p]->factor,sizeof(int));
+    this->file.write((char*) base->z,base->Nz*sizeof(double));
+    for(int q=0;q<Nimages;q++){
+      const Stamp& stamp = compositors[p]->stamps[q];
+      int window[4] = {stamp.i0,stamp.j0,stamp.ni,stamp.nj};
+      this->file.write((char*) window,4*sizeof(int));
+      this->file.write((char*) stamp.z.data(),stamp.z.size()*sizeof(double));
+    }
+  }
+  this->fluxes_start = this->file.tellp();
+}
+
+CutoutStore::CutoutStore(std::string filename){
+  this->file.open(filename,std::ios::in|std::ios::binary);
+  char magic[8];
+  int dims[8];
+  int64_t seed;
+  this->file.read(magic,8);
+  this->file.read((char*) dims,8*sizeof(int));
+  this->file.read((char*) &seed,sizeof(int64_t));
+  if( !this->file.good() || memcmp(magic,cutout_store_magic,8) != 0 ){
+    fprintf(stderr,"'%s' is not a cutouts file!\n",filename.c_str());
+    exit(1);
+  }
+  this->Nx       = dims[0];
+  this->Ny       = dims[1];
+  int Npsf       = dims[2];
+  this->Nimages  = dims[3];
+  this->Nepochs  = dims[4];
+  this->N_in     = dims[5];
+  this->N_ex     = dims[6];
+  this->mag      = dims[7] & 1;
+  this->single_precision = dims[7] & 2;
+  this->base_seed = seed;
+  this->instrument = readString(this->file);
+  std::istringstream(readString(this->file)) >> this->noise_pars;
+  this->noise = FactoryNoiseModel::getInstance()->createNoiseModel(this->noise_pars);
+  this->epoch_psf.resize(this->Nepochs);
+  this->file.read((char*) this->epoch_psf.data(),this->Nepochs*sizeof(int));
+
+  for(int p=0;p<Npsf;p++){
+    double extent[4];
+    int factor;
+    this->file.read((char*) extent,4*sizeof(double));
+    this->file.read((char*) &factor,sizeof(int));
+    RectGrid* base = new RectGrid(this->Nx,this->Ny,extent[0],extent[1],extent[2],extent[3]);
+    this->file.read((char*) base->z,base->Nz*sizeof(double));
+    this->bases.push_back(base);
+    CutoutCompositor* compositor = new CutoutCompositor(base,factor);
+    for(int q=0;q<this->Nimages;q++){
+      int window[4];
+      Stamp stamp;
+      this->file.read((char*) window,4*sizeof(int));
+      stamp.i0 = window[0];
+      stamp.j0 = window[1];
+      stamp.ni = window[2];
+      stamp.nj = window[3];
+      stamp.z.resize(stamp.ni*stamp.nj);
+      this->file.read((char*) stamp.z.data(),stamp.z.size()*sizeof(double));
+      compositor->stamps.push_back(stamp);
+    }
+    this->compositors.push_back(compositor);
+  }
+  if( !this->file.good() ){
+    fprintf(stderr,"The cutouts file '%s' is truncated!\n",filename.c_str());
+    exit(1);
+  }
+  this->fluxes_start = this->file.tellg();
+}
+
+CutoutStore::~CutoutStore(){
+  // The compositors are owned only if they were read from the file
+  if( !this->bases.empty() ){
+    for(int p=0;p<this->compositors.size();p++){
+      delete(this->compositors[p]);
+      delete(this->bases[p]);
+    }
+  }
+  delete(this->noise);
+}
+
+void CutoutStore::appendMock(const std::vector<double>& fluxes){
+  this->file.write((char*) fluxes.data(),this->Nepochs*this->Nimages*sizeof(double));
+}
+
+void CutoutStore::cutout(int index_in,int index_ex,int t,double* out){
+  if( index_in < 0 || index_in >= this->N_in || index_ex < 0 || index_ex >= this->N_ex || t < 0 || t >= this->Nepochs ){
+    fprintf(stderr,"There is no cutout %d of mock_%04d_%04d (%d mocks by %d, %d epochs)!\n",t,index_in,index_ex,this->N_in,this->N_ex,this->Nepochs);
+    exit(1);
+  }
+  int mock = index_in*this->N_ex + index_ex;
+  std::vector<double> fluxes(this->Nimages);
+  std::streamoff offset = ((std::streamoff) mock*this->Nepochs + t)*this->Nimages*sizeof(double);
+  this->file.seekg(this->fluxes_start + offset);
+  this->file.read((char*) fluxes.data(),this->Nimages*sizeof(double));
+  if( !this->file.good() ){
+    fprintf(stderr,"The fluxes of mock_%04d_%04d are missing from the cutouts file!\n",index_in,index_ex);
+    exit(1);
+  }
+  this->compositors[this->epoch_psf[t]]->compose(fluxes,this->noise,cutoutSeed(this->base_seed,mock,this->Nepochs,t),this->mag,out);
+}
+// END:CUTOUT STORE =====================================================================================
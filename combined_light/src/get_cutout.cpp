@@ -0,0 +1,39 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "cutouts.hpp"
+#include "fits_output.hpp"
+
+int main(int argc,char* argv[]){
+  /*
+    Usage: get_cutout <cutouts file> <index_in> <index_ex> <epoch|all> <output>
+    Creates the cutout of a mock at an epoch from the ingredients written by combine_light in the lazy mode (output/cutouts_<instrument>.bin),
+    identical to the one that would have been written in mock_<index_in>_<index_ex>/OBS_<instrument>_<epoch>.fits.
+    With 'all', the output is a directory where the cutouts of all the epochs are written with these names.
+  */
+  if( argc < 6 ){
+    fprintf(stderr,"Usage: %s <cutouts file> <index_in> <index_ex> <epoch|all> <output>\n",argv[0]);
+    return 1;
+  }
+  CutoutStore store(argv[1]);
+  int index_in = atoi(argv[2]);
+  int index_ex = atoi(argv[3]);
+  std::string epoch = argv[4];
+  std::string output = argv[5];
+
+  std::vector<double> cutout(store.Nx*store.Ny);
+  if( epoch == "all" ){
+    for(int t=0;t<store.Nepochs;t++){
+      store.cutout(index_in,index_ex,t,cutout.data());
+      char buffer[4];
+      sprintf(buffer,"%03d",t);
+      writeImage(store.Nx,store.Ny,cutout.data(),output+"/OBS_"+store.instrument+"_"+buffer+".fits",store.single_precision);
+    }
+  } else {
+    store.cutout(index_in,index_ex,atoi(epoch.c_str()),cutout.data());
+    writeImage(store.Nx,store.Ny,cutout.data(),output,store.single_precision);
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef DEFLECTION_FIELD_HPP
+#define DEFLECTION_FIELD_HPP
+
+#include <fstream>
+#include <vector>
+
+class CollectionMassModels;
+
+// The deflection angle (alpha = x - x_deflected) of a mass model collection sampled on a regular grid of nodes.
+// The nodes include the grid limits, i.e. x_j = xmin + j*dx with dx = (xmax-xmin)/(Nx-1), so that a field built on pixel centers
+// returns the exact values on them. Anywhere else in the grid the values are interpolated with bicubic convolution (Keys 1981),
+// which is exact on the nodes and has a continuous first derivative.
+class DeflectionField {
+public:
+  int Nx;
+  int Ny;
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+  double dx;
+  double dy;
+  std::vector<double> ax;
+  std::vector<double> ay;
+
+  DeflectionField(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax);
+  ~DeflectionField(){};
+
+  void fill(CollectionMassModels* mass_collection,int Nthreads=0);
+  bool interpolate(double x,double y,double& alpha_x,double& alpha_y);
+  void write(std::ofstream& out);
+  static DeflectionField* read(std::ifstream& in);
+
+private:
+  void fillRows(CollectionMassModels* mass_collection,int i_start,int i_step);
+};
+
+#endif /* DEFLECTION_FIELD_HPP */
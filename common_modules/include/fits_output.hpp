@@ -0,0 +1,59 @@
+#ifndef FITS_OUTPUT_HPP
+#define FITS_OUTPUT_HPP
+
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+class RectGrid;
+namespace CCfits {
+  class FITS;
+}
+
+// Output images in double (BITPIX -64) or single (BITPIX -32) precision.
+// The precision is set by "precision" in the "output_options" of the input json: "double" (default) or "float".
+// Single precision halves the size of the written images and of the FFT buffers of the convolution (see Instrument::convolve);
+// it is enough for the final mocks, whose noise is many orders of magnitude above the float rounding errors.
+bool singlePrecision(const Json::Value& root);
+
+void writeImage(int Nx,int Ny,double* z,std::string filename,bool single_precision);
+void writeImage(int Nx,int Ny,double* z,std::vector<std::string> keys,std::vector<std::string> values,std::vector<std::string> descriptions,std::string filename,bool single_precision);
+// Several images of the same size in a multi-extension FITS file, each one in an extension named after it, with the keys in the (empty) primary HDU.
+void writeImages(int Nx,int Ny,std::vector<double*> images,std::vector<std::string> names,std::vector<std::string> keys,std::vector<std::string> values,std::vector<std::string> descriptions,std::string filename,bool single_precision);
+
+
+// Side of the square tiles (in observed pixels) of the out-of-core mode, set by "tile_size" in the "out_of_core" member of "output_options".
+// Zero (default) means that the super-resolved frames are held in memory as a whole.
+int outOfCoreTileSize(const Json::Value& root);
+
+// A super-resolved frame that stays in a FITS file and is written or read in rectangular tiles, so that it never has to be held in memory as a whole.
+// Rows and columns are counted as in RectGrid (row 0 is the top of the frame), and the pixels of a tile coincide with the ones of the frame.
+// A tile may extend beyond the frame: the pixels outside it are read as zeros and are not written.
+class FitsFrame {
+public:
+  std::string filename;
+  int Nx;
+  int Ny;
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+  double step_x;
+  double step_y;
+
+  FitsFrame(std::string filename,int Nx,int Ny,double xmin,double xmax,double ymin,double ymax,bool single_precision); // create a new frame (filled with zeros)
+  FitsFrame(std::string filename,int Nx,int Ny,double xmin,double xmax,double ymin,double ymax); // open an existing frame for reading
+  FitsFrame(const FitsFrame& other) = delete;
+  ~FitsFrame();
+
+  void addKeys(std::vector<std::string> keys,std::vector<std::string> values,std::vector<std::string> descriptions);
+  RectGrid* newTile(int i0,int j0,int ni,int nj);
+  void writeTile(int i0,int j0,RectGrid* tile);
+  void readTile(int i0,int j0,RectGrid* tile);
+
+private:
+  CCfits::FITS* fits = NULL;
+};
+
+#endif /* FITS_OUTPUT_HPP */
@@ -0,0 +1,20 @@
+#ifndef HASH_BYTES_HPP
+#define HASH_BYTES_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit FNV-1a, stable across runs and platforms (unlike std::hash), for the keys and names of the files cached between runs.
+// Start from hash_seed and chain the calls to hash several values.
+const uint64_t hash_seed = 14695981039346656037ULL;
+
+inline uint64_t hashBytes(uint64_t h,const void* data,size_t size){
+  const unsigned char* p = (const unsigned char*) data;
+  for(size_t i=0;i<size;i++){
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+#endif /* HASH_BYTES_HPP */
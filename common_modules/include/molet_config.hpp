@@ -0,0 +1,94 @@
+#ifndef MOLET_CONFIG_HPP
+#define MOLET_CONFIG_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+// The molet_input.json, parsed once (with // and /* */ comments), validated, and converted to typed members for the parameters that the stages read in loops.
+// The mass models, light profiles and noise models are kept as json, since they are passed as such to their factories.
+// The parsed input is also written as a compact binary snapshot in output/molet_config.bin, keyed by the hash of the input file,
+// from which the following stages load it without parsing the text again.
+
+class LensConfig {
+public:
+  double redshift;
+  Json::Value mass_model;
+  Json::Value light_profile;
+  Json::Value compact_mass_model;
+};
+
+class SourceConfig {
+public:
+  double redshift;
+  Json::Value light_profile;
+};
+
+class PointSourceConfig {
+public:
+  bool present = false;
+  double x0 = 0.0;
+  double y0 = 0.0;
+  std::string intrinsic_type;
+  std::string extrinsic_type;
+  bool unmicro = false;
+  bool output_cutouts = false;
+};
+
+class InstrumentConfig {
+public:
+  std::string name;
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+  std::vector<double> time; // the observed epochs, in days
+  Json::Value noise;
+};
+
+class OutputConfig {
+public:
+  std::string cut_out_scale = "mag";
+  bool lazy_cutouts = false;
+  bool single_precision = false;
+  int tile_size = 0;        // out-of-core tiles, in observed pixels
+  bool direct = false;      // integration over the observed pixels instead of super-resolution
+  bool mask = false;
+  double mask_smear = 1.0;
+  double mask_threshold = 0.1;
+  bool adaptive = false;    // ray-shoot only where the source is significant (see fproject)
+  double adaptive_threshold = 1.e-6;
+  bool lens_maps = false;   // maps of the lens properties over the field of view (see point_source)
+  int lens_maps_factor = 1; // pixels per observed pixel, along each side
+  bool source_map = false;  // keep the source plane positions of the pixels in output/source_map.bin (see fproject)
+  int threads = 0;          // running the independent tasks of a stage (e.g. the instruments in combine_light), 0 for all the cores
+};
+
+class MoletConfig {
+public:
+  Json::Value root; // the whole input
+  std::vector<LensConfig> lenses;
+  SourceConfig source;
+  PointSourceConfig point_source;
+  std::vector<InstrumentConfig> instruments;
+  OutputConfig output;
+
+  // Loads the input from the snapshot in <out_path>output/ if it matches the input file, otherwise parses the file and writes the snapshot (no snapshot if out_path is empty)
+  MoletConfig(std::string filename,std::string out_path="");
+
+  static Json::Value parseJson(std::string filename); // exits with the parser's errors if the file is not valid json
+  void writeSnapshot(std::string filename);
+  void printShell(FILE* fh); // shell variables for molet_driver.sh
+
+private:
+  std::string text; // the input file
+  uint64_t key;     // and its hash
+
+  bool readSnapshot(std::string filename);
+  void build();
+};
+
+#endif /* MOLET_CONFIG_HPP */
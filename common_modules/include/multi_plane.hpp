@@ -0,0 +1,78 @@
+#ifndef MULTI_PLANE_HPP
+#define MULTI_PLANE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+class RectGrid;
+class CollectionMassModels;
+class DeflectionField;
+
+class LensPlane {
+public:
+  int index; // position of the lens in the input "lenses" list
+  double z;
+  CollectionMassModels* mass = NULL;
+  DeflectionField* field     = NULL;
+
+  LensPlane(int index,double z,CollectionMassModels* mass):index(index),z(z),mass(mass){};
+  ~LensPlane();
+};
+
+// The lens equation, its derivatives and the time delay at one image plane position, see MultiPlaneLens::evaluate
+struct LensPoint {
+  double xdefl;     // source plane position
+  double ydefl;
+  double kappa;
+  double gamma_mag;
+  double gamma_phi;
+  double mag;
+  double time;      // in days, up to a constant
+};
+
+// Ray-tracing through one or more lens planes, sorted by redshift.
+// The deflection of each plane is reduced with respect to the source, and the position on plane j is:
+//   x_j = x - sum_{i<j} beta_ij * alpha_i(x_i),  with beta_ij = (D_ij*D_s)/(D_j*D_is),
+// with the source plane position given by the same sum over all the planes (beta_is = 1).
+// For a single plane every call is forwarded to the mass model collection, unless its deflections have been cached.
+// The time delay is the multi-plane Fermat potential (e.g. Schneider, Ehlers & Falco 1992, McCully et al. 2014):
+//   T(x) = sum_j tau_j * [ 0.5*|x_j - x_{j+1}|^2 - beta_{j,j+1} * psi_j(x_j) ],  with tau_j = (1+z_j)*D_j*D_{j+1}/D_{j,j+1} and beta_{N,N+1} = 1,
+// where x_{N+1} is the source position, and which reduces to the usual single plane expression.
+class MultiPlaneLens {
+public:
+  std::vector<LensPlane*> planes;
+
+  MultiPlaneLens(const Json::Value& lenses,const Json::Value& cosmo,std::string input);
+  MultiPlaneLens(const MultiPlaneLens& other) = delete;
+  ~MultiPlaneLens();
+
+  bool hasPerturbations(){ return this->perturbed; };
+  uint64_t massKey(){ return this->mass_key; };
+  void cacheDeflections(RectGrid* grid,int Nthreads=0,std::string sidecar="");
+  void all_defl(double x,double y,double& xdefl,double& ydefl);
+  double detJacobian(double x,double y);
+  double all_kappa(double x,double y);
+  void all_gamma(double x,double y,double& gamma_mag,double& gamma_phi);
+  void evaluate(double x,double y,double source_x,double source_y,LensPoint& out); // all the above and the time delay from a single exact trace
+
+private:
+  static const int max_planes = 32;
+  std::vector< std::vector<double> > beta;
+  std::vector<double> tau;     // time delay factor of each plane and the next one (or the source), in days/arcsec^2
+  std::vector<double> tau_psi; // tau*beta_{j,j+1}, the factor of the potential of each plane
+  bool perturbed = false;
+  uint64_t mass_key;  // hash of everything that determines the deflections: mass models, perturbation files, distances
+
+  bool readSidecar(std::string sidecar,uint64_t grid_key);
+  void writeSidecar(std::string sidecar,uint64_t grid_key);
+
+  void trace(double x,double y,double& xdefl,double& ydefl,bool use_cache);
+  void jacobian(double x,double y,double& a11,double& a12,double& a21,double& a22);
+};
+
+void scalePerturbations(const Json::Value& jmass,CollectionMassModels* mass_collection);
+
+#endif /* MULTI_PLANE_HPP */
@@ -0,0 +1,45 @@
+#ifndef PIXEL_INTEGRATOR_HPP
+#define PIXEL_INTEGRATOR_HPP
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+class RectGrid;
+
+// Integrates a surface brightness over each pixel of a RectGrid with Gauss-Legendre quadrature, used to render directly at the observed resolution.
+// Each pixel starts with min_nodes x min_nodes nodes, and the number of nodes per dimension is doubled (up to max_nodes) until two successive
+// estimates differ by less than 'tolerance' times the pixel value (or times a thousandth of the brightest pixel, for the faint ones).
+// The result is the integral over the pixel, i.e. the flux it receives, as given by RectGrid::embeddedNewGrid(...,"integrate") from a super-resolved image.
+class PixelIntegrator {
+public:
+  std::string mode;  // "super" (render on a super-resolved grid and bin) or "direct"
+  double tolerance;
+  int min_nodes;
+  int max_nodes;
+  int Nthreads;      // 0 means use all the available cores
+  std::atomic<long> evaluations;
+
+  PixelIntegrator(const Json::Value& options);
+  PixelIntegrator(const PixelIntegrator& other) = delete;
+  ~PixelIntegrator(){};
+
+  bool direct();
+  void render(std::function<double(double,double)> f,RectGrid* grid);
+
+private:
+  std::vector<int> orders;
+  std::vector< std::vector<double> > nodes;
+  std::vector< std::vector<double> > weights;
+  std::atomic<int> next_row;
+  double faint_level;
+
+  double integrate(const std::function<double(double,double)>& f,int k,double xc,double yc,double hx,double hy);
+  void work(int pass,const std::function<double(double,double)>& f,RectGrid* grid);
+  void runThreads(int pass,const std::function<double(double,double)>& f,RectGrid* grid);
+};
+
+#endif /* PIXEL_INTEGRATOR_HPP */
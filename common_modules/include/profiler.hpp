@@ -0,0 +1,63 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Lightweight instrumentation of a MOLET stage: wall-clock time of named code sections and peak resident memory.
+// Timings with the same name are accumulated (number of calls, total and maximum time), so a timer inside a loop gives the cost of the whole loop.
+// Counters record the amount of work of a section (e.g. the number of rays), accumulated in the same way.
+// At the end of the stage the report is written as json, to be collected by molet_driver.sh.
+class Profiler {//This is a singleton class.
+public:
+  Profiler(Profiler const&) = delete;
+  void operator=(Profiler const&) = delete;
+
+  static Profiler* getInstance(){
+    static Profiler dum;//Guaranteed to be destroyed. Instantiated on first call.
+    return &dum;
+  }
+
+  void setStage(std::string stage);
+  void add(std::string name,double seconds);
+  void count(std::string name,long value);
+  void write(std::string filename);
+  static long peakRSS(); // in kB
+
+private:
+  struct Entry {
+    long calls   = 0;
+    double total = 0.0; // in s
+    double max   = 0.0; // in s
+    long peak_rss = 0;  // in kB, at the end of the last call
+  };
+  std::string stage;
+  std::chrono::steady_clock::time_point start;
+  std::vector<std::string> names; // in order of first appearance
+  std::map<std::string,Entry> entries;
+  std::vector<std::string> counter_names; // in order of first appearance
+  std::map<std::string,long> counters;
+  std::mutex mtx;
+
+  Profiler();
+};
+
+// Times the enclosing scope, or until stop() is called, and adds it to the Profiler.
+class ScopedTimer {
+public:
+  ScopedTimer(std::string name);
+  ScopedTimer(const ScopedTimer& other) = delete;
+  ~ScopedTimer();
+
+  void stop();
+
+private:
+  std::string name;
+  std::chrono::steady_clock::time_point start;
+  bool running;
+};
+
+#endif /* PROFILER_HPP */
@@ -0,0 +1,37 @@
+#ifndef SHARED_FRAME_HPP
+#define SHARED_FRAME_HPP
+
+#include <utility>
+#include <vector>
+
+#include "molet_config.hpp"
+
+class RectGrid;
+
+// The super-resolved frame on which fproject and llm ray-shoot and render once for all the instruments.
+// It covers the fields of view of all the instruments with the super-resolved pixels of the finest one (its resolution over 'factor'),
+// and the super-resolved frame of each instrument is resampled from it (see resample).
+// With a single instrument, or instruments with the same resolution and field of view, it is the frame of the first instrument and nothing is resampled.
+class SharedFrame {
+public:
+  int Nx;
+  int Ny;
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+  double resolution; // of the finest instrument
+  bool uniform;      // all the instruments have this super-resolved frame
+
+  SharedFrame(const std::vector<InstrumentConfig>& instruments,const std::vector<double>& resolutions,int factor=10);
+
+  bool isFrame(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax) const;
+  RectGrid* resample(RectGrid* shared,int Nx,int Ny,double xmin,double xmax,double ymin,double ymax) const;
+  void checkMode(bool direct,int tile_size) const; // exits if the instruments differ in a mode that works on the frame of each instrument
+
+private:
+  typedef std::vector< std::vector< std::pair<int,double> > > Weights;
+  static Weights overlapWeights(int N_to,double min_to,double max_to,int N_from,double min_from,double max_from);
+};
+
+#endif /* SHARED_FRAME_HPP */
@@ -0,0 +1,46 @@
+#ifndef SOURCE_MAP_HPP
+#define SOURCE_MAP_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class RectGrid;
+class CollectionProfiles;
+class MultiPlaneLens;
+
+// The source plane position of each pixel of a grid, traced once through the lenses and kept in a binary file (output/source_map.bin, see fproject).
+// Another source light profile is then rendered through the same lenses and grid by evaluating it on the stored positions, without tracing the rays again.
+// The positions are stored in double precision, or in single precision (half the size) if the output images are ("precision": "float" in the output options).
+class SourceMap {
+public:
+  int Nx;
+  int Ny;
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+  bool single_precision;
+
+  SourceMap(MultiPlaneLens* lens,RectGrid* grid,bool single_precision,int Nthreads=0);
+  SourceMap(const SourceMap& other) = delete;
+  ~SourceMap(){};
+
+  static SourceMap* read(std::string filename,MultiPlaneLens* lens,RectGrid* grid,bool single_precision); // NULL if the file does not exist, was written for other lenses or another grid, or is less precise
+  void write(std::string filename);
+  void render(CollectionProfiles* profiles,RectGrid* grid,int Nthreads=0);
+
+private:
+  uint64_t key; // of the lenses and the grid
+  std::vector<double> xs;
+  std::vector<double> ys;
+  std::vector<float> xs_single;
+  std::vector<float> ys_single;
+
+  SourceMap(){};
+  static uint64_t mapKey(MultiPlaneLens* lens,RectGrid* grid);
+  void traceRows(MultiPlaneLens* lens,RectGrid* grid,int i_start,int i_step);
+  void renderRows(CollectionProfiles* profiles,RectGrid* grid,int i_start,int i_step);
+};
+
+#endif /* SOURCE_MAP_HPP */
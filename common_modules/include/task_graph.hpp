@@ -0,0 +1,47 @@
+#ifndef TASK_GRAPH_HPP
+#define TASK_GRAPH_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A graph of tasks, each one run once all the tasks it depends on are done, by a pool of threads.
+// Each thread has its own deque of ready tasks: it runs the most recent one in its deque (e.g. a task made ready by the one it just finished, using the same data),
+// and when its deque is empty it steals the oldest one from the deque of another thread.
+// The tasks must be added before run(), and a task can only depend on tasks added before it, so the graph has no cycles.
+class TaskGraph {
+public:
+  TaskGraph(){};
+  TaskGraph(const TaskGraph& other) = delete;
+
+  int add(std::function<void()> task,std::vector<int> dependencies = std::vector<int>()); // returns the id of the task
+  void run(int Nthreads = 0); // 0: as many threads as cores, but not more than tasks
+
+private:
+  struct Node {
+    std::function<void()> task;
+    std::vector<int> dependents;
+    int Ndependencies;
+  };
+  struct Worker {
+    std::deque<int> ready;
+    std::mutex mtx;
+  };
+  std::vector<Node> nodes;
+  std::vector<std::unique_ptr<Worker> > workers;
+  std::unique_ptr<std::atomic<int>[]> remaining; // dependencies not done yet, for each task
+  std::atomic<int> pending;                      // tasks not done yet
+  std::atomic<int> Nready;                       // tasks in the deques
+  std::mutex wait_mtx;
+  std::condition_variable wait_cv;
+
+  void push(int w,int id);
+  bool take(int w,int& id);
+  void work(int w);
+};
+
+#endif /* TASK_GRAPH_HPP */
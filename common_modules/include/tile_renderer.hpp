@@ -0,0 +1,43 @@
+#ifndef TILE_RENDERER_HPP
+#define TILE_RENDERER_HPP
+
+#include <atomic>
+#include <vector>
+
+#include "json/json.h"
+
+class RectGrid;
+class CollectionProfiles;
+class FitsFrame;
+
+// Renders light profiles on a RectGrid in square tiles that are distributed among a number of threads.
+// Each tile is filled row by row with the sum of all the profile components.
+// Optionally, tiles where the profile is below a fraction of its maximum (flux floor) are skipped and left to zero.
+class TileRenderer {
+public:
+  int tile_size;     // in pixels
+  int Nthreads;      // 0 means use all the available cores
+  double flux_floor; // fraction of the maximum probed value below which a tile is skipped, 0 means render every tile
+  int Ntiles   = 0;
+  int Nskipped = 0;
+
+  TileRenderer(int tile_size,int Nthreads,double flux_floor);
+  TileRenderer(const Json::Value& options);
+  TileRenderer(const TileRenderer& other) = delete;
+  ~TileRenderer(){};
+
+  void render(CollectionProfiles* collection,RectGrid* grid,double factor=1.0);
+  void renderFrame(CollectionProfiles* collection,FitsFrame* frame,int frame_tile,double factor=1.0);
+
+private:
+  int Ntiles_x;
+  std::atomic<int> next_tile;
+  std::vector<double> probe_max;
+  std::vector<bool> active;
+
+  int getNthreads();
+  void runThreads(int pass,CollectionProfiles* collection,RectGrid* grid,double factor);
+  void work(int pass,CollectionProfiles* collection,RectGrid* grid,double factor);
+};
+
+#endif /* TILE_RENDERER_HPP */
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "vkllib.hpp"
+
+#include "deflection_field.hpp"
+
+DeflectionField::DeflectionField(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax):Nx(Nx),Ny(Ny),xmin(xmin),xmax(xmax),ymin(ymin),ymax(ymax){
+  this->dx = (xmax-xmin)/(Nx-1);
+  this->dy = (ymax-ymin)/(Ny-1);
+  this->ax.resize(Nx*Ny);
+  this->ay.resize(Nx*Ny);
+}
+
+void DeflectionField::fill(CollectionMassModels* mass_collection,int Nthreads){
+  if( Nthreads <= 0 ){
+    Nthreads = std::max(1,(int) std::thread::hardware_concurrency());
+  }
+  std::vector<std::thread> threads;
+  for(int k=0;k<Nthreads;k++){
+    threads.push_back( std::thread(&DeflectionField::fillRows,this,mass_collection,k,Nthreads) );
+  }
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+}
+
+void DeflectionField::fillRows(CollectionMassModels* mass_collection,int i_start,int i_step){
+  double xdefl,ydefl;
+  for(int i=i_start;i<this->Ny;i+=i_step){
+    double y = this->ymin + i*this->dy;
+    for(int j=0;j<this->Nx;j++){
+      double x = this->xmin + j*this->dx;
+      mass_collection->all_defl(x,y,xdefl,ydefl);
+      this->ax[i*this->Nx+j] = x - xdefl;
+      this->ay[i*this->Nx+j] = y - ydefl;
+    }
+  }
+}
+
+static inline void cubicWeights(double t,double* w){
+  // Cubic convolution kernel with a = -1/2
+  double t2 = t*t;
+  double t3 = t2*t;
+  w[0] = -0.5*t3 + t2 - 0.5*t;
+  w[1] =  1.5*t3 - 2.5*t2 + 1.0;
+  w[2] = -1.5*t3 + 2.0*t2 + 0.5*t;
+  w[3] =  0.5*t3 - 0.5*t2;
+}
+
+bool DeflectionField::interpolate(double x,double y,double& alpha_x,double& alpha_y){
+  double u = (x - this->xmin)/this->dx;
+  double v = (y - this->ymin)/this->dy;
+  if( u < 0 || v < 0 || u > this->Nx-1 || v > this->Ny-1 ){
+    return false;
+  }
+  int j = std::min((int) floor(u),this->Nx-2);
+  int i = std::min((int) floor(v),this->Ny-2);
+  double wx[4],wy[4];
+  cubicWeights(u - j,wx);
+  cubicWeights(v - i,wy);
+
+  // Bicubic interpolation over the 4x4 neighbouring nodes.
+  // Beyond the borders the missing nodes are extrapolated with the boundary condition of Keys, f(-1) = 3f(0) - 3f(1) + f(2), which keeps the third order accuracy.
+  double vx[4][4],vy[4][4];
+  for(int n=0;n<4;n++){
+    int ii = std::min(std::max(i-1+n,0),this->Ny-1);
+    for(int m=0;m<4;m++){
+      int jj = std::min(std::max(j-1+m,0),this->Nx-1);
+      vx[n][m] = this->ax[ii*this->Nx+jj];
+      vy[n][m] = this->ay[ii*this->Nx+jj];
+    }
+  }
+  if( j == 0 || j+2 > this->Nx-1 ){
+    int m0 = (j == 0)? 0 : 3;
+    int d  = (j == 0)? 1 : -1;
+    if( this->Nx > 2 ){
+      for(int n=0;n<4;n++){
+	vx[n][m0] = 3.0*vx[n][m0+d] - 3.0*vx[n][m0+2*d] + vx[n][m0+3*d];
+	vy[n][m0] = 3.0*vy[n][m0+d] - 3.0*vy[n][m0+2*d] + vy[n][m0+3*d];
+      }
+    }
+  }
+  if( i == 0 || i+2 > this->Ny-1 ){
+    int n0 = (i == 0)? 0 : 3;
+    int d  = (i == 0)? 1 : -1;
+    if( this->Ny > 2 ){
+      for(int m=0;m<4;m++){
+	vx[n0][m] = 3.0*vx[n0+d][m] - 3.0*vx[n0+2*d][m] + vx[n0+3*d][m];
+	vy[n0][m] = 3.0*vy[n0+d][m] - 3.0*vy[n0+2*d][m] + vy[n0+3*d][m];
+      }
+    }
+  }
+
+  alpha_x = 0.0;
+  alpha_y = 0.0;
+  for(int n=0;n<4;n++){
+    double rx = 0.0;
+    double ry = 0.0;
+    for(int m=0;m<4;m++){
+      rx += wx[m]*vx[n][m];
+      ry += wx[m]*vy[n][m];
+    }
+    alpha_x += wy[n]*rx;
+    alpha_y += wy[n]*ry;
+  }
+  return true;
+}
+
+void DeflectionField::write(std::ofstream& out){
+  out.write((char*) &this->Nx,sizeof(int));
+  out.write((char*) &this->Ny,sizeof(int));
+  double limits[4] = {this->xmin,this->xmax,this->ymin,this->ymax};
+  out.write((char*) limits,4*sizeof(double));
+  out.write((char*) this->ax.data(),this->ax.size()*sizeof(double));
+  out.write((char*) this->ay.data(),this->ay.size()*sizeof(double));
+}
+
+DeflectionField* DeflectionField::read(std::ifstream& in){
+  int Nx,Ny;
+  double limits[4];
+  in.read((char*) &Nx,sizeof(int));
+  in.read((char*) &Ny,sizeof(int));
+  in.read((char*) limits,4*sizeof(double));
+  if( !in.good() || Nx < 2 || Ny < 2 ){
+    return NULL;
+  }
+  DeflectionField* field = new DeflectionField(Nx,Ny,limits[0],limits[1],limits[2],limits[3]);
+  in.read((char*) field->ax.data(),field->ax.size()*sizeof(double));
+  in.read((char*) field->ay.data(),field->ay.size()*sizeof(double));
+  if( !in.good() ){
+    delete(field);
+    return NULL;
+  }
+  return field;
+}
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <memory>
+#include <valarray>
+
+#include <CCfits/CCfits>
+
+#include "vkllib.hpp"
+
+#include "fits_output.hpp"
+
+bool singlePrecision(const Json::Value& root){
+  if( root.isMember("output_options") && root["output_options"].isMember("precision") ){
+    return root["output_options"]["precision"].asString() == "float";
+  }
+  return false;
+}
+
+void writeImage(int Nx,int Ny,double* z,std::string filename,bool single_precision){
+  std::vector<std::string> empty;
+  writeImage(Nx,Ny,z,empty,empty,empty,filename,single_precision);
+}
+
+void writeImage(int Nx,int Ny,double* z,std::vector<std::string> keys,std::vector<std::string> values,std::vector<std::string> descriptions,std::string filename,bool single_precision){
+  if( !single_precision ){
+    if( keys.size() == 0 ){
+      FitsInterface::writeFits(Nx,Ny,z,filename);
+    } else {
+      FitsInterface::writeFits(Nx,Ny,z,keys,values,descriptions,filename);
+    }
+    return;
+  }
+
+  long naxis    = 2;
+  long naxes[2] = {Nx,Ny};
+  long Ntot     = (long) Nx*Ny;
+  std::unique_ptr<CCfits::FITS> pFits(new CCfits::FITS("!"+filename,FLOAT_IMG,naxis,naxes));
+
+  // Same row order as FitsInterface::writeFits: the first row of z is the top of the image, i.e. the last row of the FITS array
+  std::valarray<float> array(Ntot);
+  for(int i=0;i<Ny;i++){
+    for(int j=0;j<Nx;j++){
+      array[(Ny-1-i)*Nx+j] = static_cast<float>(z[i*Nx+j]);
+    }
+  }
+
+  CCfits::PHDU& hdu = pFits->pHDU();
+  for(int k=0;k<keys.size();k++){
+    hdu.addKey(keys[k],values[k],descriptions[k]);
+  }
+  hdu.write(1,Ntot,array);
+}
+
+
+void writeImages(int Nx,int Ny,std::vector<double*> images,std::vector<std::string> names,std::vector<std::string> keys,std::vector<std::string> values,std::vector<std::string> descriptions,std::string filename,bool single_precision){
+  long Ntot     = (long) Nx*Ny;
+  int bitpix    = (single_precision)? FLOAT_IMG : DOUBLE_IMG;
+  // The primary HDU has no data (NAXIS = 0), only the keys
+  std::unique_ptr<CCfits::FITS> pFits(new CCfits::FITS("!"+filename,BYTE_IMG,0,NULL));
+  CCfits::PHDU& hdu = pFits->pHDU();
+  for(int k=0;k<keys.size();k++){
+    hdu.addKey(keys[k],values[k],descriptions[k]);
+  }
+
+  // Same row order as writeImage
+  std::vector<long> ext_naxes{Nx,Ny};
+  for(int m=0;m<images.size();m++){
+    CCfits::ExtHDU* ext = pFits->addImage(names[m],bitpix,ext_naxes);
+    if( single_precision ){
+      std::valarray<float> array(Ntot);
+      for(int i=0;i<Ny;i++){
+	for(int j=0;j<Nx;j++){
+	  array[(Ny-1-i)*Nx+j] = static_cast<float>(images[m][i*Nx+j]);
+	}
+      }
+      ext->write(1,Ntot,array);
+    } else {
+      std::valarray<double> array(Ntot);
+      for(int i=0;i<Ny;i++){
+	for(int j=0;j<Nx;j++){
+	  array[(Ny-1-i)*Nx+j] = images[m][i*Nx+j];
+	}
+      }
+      ext->write(1,Ntot,array);
+    }
+  }
+}
+
+
+int outOfCoreTileSize(const Json::Value& root){
+  if( root.isMember("output_options") && root["output_options"].isMember("out_of_core") ){
+    return root["output_options"]["out_of_core"].get("tile_size",0).asInt();
+  }
+  return 0;
+}
+
+FitsFrame::FitsFrame(std::string filename,int Nx,int Ny,double xmin,double xmax,double ymin,double ymax,bool single_precision):filename(filename),Nx(Nx),Ny(Ny),xmin(xmin),xmax(xmax),ymin(ymin),ymax(ymax){
+  this->step_x = (xmax-xmin)/Nx;
+  this->step_y = (ymax-ymin)/Ny;
+  long naxis    = 2;
+  long naxes[2] = {Nx,Ny};
+  int bitpix = (single_precision)? FLOAT_IMG : DOUBLE_IMG;
+  this->fits = new CCfits::FITS("!"+filename,bitpix,naxis,naxes);
+}
+
+FitsFrame::FitsFrame(std::string filename,int Nx,int Ny,double xmin,double xmax,double ymin,double ymax):filename(filename),Nx(Nx),Ny(Ny),xmin(xmin),xmax(xmax),ymin(ymin),ymax(ymax){
+  this->step_x = (xmax-xmin)/Nx;
+  this->step_y = (ymax-ymin)/Ny;
+  this->fits = new CCfits::FITS(filename,CCfits::Read,true);
+}
+
+FitsFrame::~FitsFrame(){
+  delete(this->fits);
+}
+
+void FitsFrame::addKeys(std::vector<std::string> keys,std::vector<std::string> values,std::vector<std::string> descriptions){
+  for(int k=0;k<keys.size();k++){
+    this->fits->pHDU().addKey(keys[k],values[k],descriptions[k]);
+  }
+}
+
+RectGrid* FitsFrame::newTile(int i0,int j0,int ni,int nj){
+  double txmin = this->xmin + j0*this->step_x;
+  double txmax = this->xmin + (j0+nj)*this->step_x;
+  double tymax = this->ymax - i0*this->step_y;
+  double tymin = this->ymax - (i0+ni)*this->step_y;
+  return new RectGrid(nj,ni,txmin,txmax,tymin,tymax);
+}
+
+void FitsFrame::writeTile(int i0,int j0,RectGrid* tile){
+  // The part of the tile inside the frame, rows [ia,ib) and columns [ja,jb)
+  int ia = std::max(i0,0);
+  int ib = std::min(i0+tile->Ny,this->Ny);
+  int ja = std::max(j0,0);
+  int jb = std::min(j0+tile->Nx,this->Nx);
+  if( ia >= ib || ja >= jb ){
+    return;
+  }
+
+  // Row i of the frame is row Ny-i of the FITS array (1-based), as in writeImage
+  int nj = jb - ja;
+  std::valarray<double> array((ib-ia)*nj);
+  for(int i=ia;i<ib;i++){
+    for(int j=ja;j<jb;j++){
+      array[(ib-1-i)*nj+j-ja] = tile->z[(i-i0)*tile->Nx+j-j0];
+    }
+  }
+  std::vector<long> first{ja+1,this->Ny-ib+1};
+  std::vector<long> last{jb,this->Ny-ia};
+  std::vector<long> stride{1,1};
+  this->fits->pHDU().write(first,last,stride,array);
+}
+
+void FitsFrame::readTile(int i0,int j0,RectGrid* tile){
+  for(int i=0;i<tile->Nz;i++){
+    tile->z[i] = 0.0;
+  }
+  int ia = std::max(i0,0);
+  int ib = std::min(i0+tile->Ny,this->Ny);
+  int ja = std::max(j0,0);
+  int jb = std::min(j0+tile->Nx,this->Nx);
+  if( ia >= ib || ja >= jb ){
+    return;
+  }
+
+  int nj = jb - ja;
+  std::valarray<double> array;
+  std::vector<long> first{ja+1,this->Ny-ib+1};
+  std::vector<long> last{jb,this->Ny-ia};
+  std::vector<long> stride{1,1};
+  this->fits->pHDU().read(array,first,last,stride);
+  for(int i=ia;i<ib;i++){
+    for(int j=ja;j<jb;j++){
+      tile->z[(i-i0)*tile->Nx+j-j0] = array[(ib-1-i)*nj+j-ja];
+    }
+  }
+}
@@ -0,0 +1,393 @@
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#include "molet_config.hpp"
+#include "fits_output.hpp"
+#include "hash_bytes.hpp"
+
+static const char snapshot_magic[8] = {'M','O','L','C','F','G','0','1'};
+
+
+// START: Binary json ==================================
+// Each value is a one byte type followed by its payload; strings, arrays and objects are preceded by their size
+enum SnapshotType : unsigned char {S_NULL,S_INT,S_UINT,S_REAL,S_STRING,S_BOOL,S_ARRAY,S_OBJECT};
+
+static void writeString(std::ostream& out,const std::string& str){
+  uint32_t n = str.size();
+  out.write((char*) &n,sizeof(uint32_t));
+  out.write(str.data(),n);
+}
+
+static bool readString(std::istream& in,std::string& str){
+  uint32_t n;
+  if( !in.read((char*) &n,sizeof(uint32_t)) ){
+    return false;
+  }
+  str.resize(n);
+  return (bool) in.read(&str[0],n);
+}
+
+static void writeValue(std::ostream& out,const Json::Value& value){
+  unsigned char type;
+  switch( value.type() ){
+  case Json::intValue:     type = S_INT; break;
+  case Json::uintValue:    type = S_UINT; break;
+  case Json::realValue:    type = S_REAL; break;
+  case Json::stringValue:  type = S_STRING; break;
+  case Json::booleanValue: type = S_BOOL; break;
+  case Json::arrayValue:   type = S_ARRAY; break;
+  case Json::objectValue:  type = S_OBJECT; break;
+  default:                 type = S_NULL;
+  }
+  out.put(type);
+  if( type == S_INT ){
+    int64_t v = value.asInt64();
+    out.write((char*) &v,sizeof(int64_t));
+  } else if( type == S_UINT ){
+    uint64_t v = value.asUInt64();
+    out.write((char*) &v,sizeof(uint64_t));
+  } else if( type == S_REAL ){
+    double v = value.asDouble();
+    out.write((char*) &v,sizeof(double));
+  } else if( type == S_STRING ){
+    writeString(out,value.asString());
+  } else if( type == S_BOOL ){
+    out.put(value.asBool()? 1 : 0);
+  } else if( type == S_ARRAY ){
+    uint32_t n = value.size();
+    out.write((char*) &n,sizeof(uint32_t));
+    for(Json::ArrayIndex i=0;i<n;i++){
+      writeValue(out,value[i]);
+    }
+  } else if( type == S_OBJECT ){
+    Json::Value::Members members = value.getMemberNames();
+    uint32_t n = members.size();
+    out.write((char*) &n,sizeof(uint32_t));
+    for(int i=0;i<members.size();i++){
+      writeString(out,members[i]);
+      writeValue(out,value[members[i]]);
+    }
+  }
+}
+
+static bool readValue(std::istream& in,Json::Value& value){
+  int type = in.get();
+  if( type == S_NULL ){
+    value = Json::Value();
+  } else if( type == S_INT ){
+    int64_t v;
+    in.read((char*) &v,sizeof(int64_t));
+    value = Json::Value((Json::Int64) v);
+  } else if( type == S_UINT ){
+    uint64_t v;
+    in.read((char*) &v,sizeof(uint64_t));
+    value = Json::Value((Json::UInt64) v);
+  } else if( type == S_REAL ){
+    double v;
+    in.read((char*) &v,sizeof(double));
+    value = Json::Value(v);
+  } else if( type == S_STRING ){
+    std::string str;
+    if( !readString(in,str) ){
+      return false;
+    }
+    value = Json::Value(str);
+  } else if( type == S_BOOL ){
+    value = Json::Value(in.get() == 1);
+  } else if( type == S_ARRAY ){
+    uint32_t n;
+    in.read((char*) &n,sizeof(uint32_t));
+    value = Json::Value(Json::arrayValue);
+    for(uint32_t i=0;i<n && in.good();i++){
+      if( !readValue(in,value[i]) ){
+	return false;
+      }
+    }
+  } else if( type == S_OBJECT ){
+    uint32_t n;
+    in.read((char*) &n,sizeof(uint32_t));
+    value = Json::Value(Json::objectValue);
+    for(uint32_t i=0;i<n && in.good();i++){
+      std::string name;
+      if( !readString(in,name) || !readValue(in,value[name]) ){
+	return false;
+      }
+    }
+  } else {
+    return false;
+  }
+  return in.good();
+}
+// END: Binary json ====================================
+
+
+// START: Validation ==================================
+static void invalid(std::string message){
+  fprintf(stderr,"Invalid input: %s\n",message.c_str());
+  exit(1);
+}
+
+static double requireNumber(const Json::Value& parent,std::string name,std::string where){
+  if( !parent.isMember(name) || !parent[name].isNumeric() ){
+    invalid("'"+name+"' in "+where+" must be a number");
+  }
+  return parent[name].asDouble();
+}
+
+static std::string optionalString(const Json::Value& parent,std::string name,std::string where){
+  if( !parent.isMember(name) ){
+    return "";
+  }
+  if( !parent[name].isString() ){
+    invalid("'"+name+"' in "+where+" must be a string");
+  }
+  return parent[name].asString();
+}
+// END: Validation ====================================
+
+
+MoletConfig::MoletConfig(std::string filename,std::string out_path){
+  std::ifstream fin(filename,std::ios::binary);
+  if( !fin.is_open() ){
+    fprintf(stderr,"Could not open the input file '%s'\n",filename.c_str());
+    exit(1);
+  }
+  std::stringstream text;
+  text << fin.rdbuf();
+  this->text = text.str();
+  this->key = hashBytes(hash_seed,this->text.data(),this->text.size());
+
+  std::string snapshot = out_path + "output/molet_config.bin";
+  if( out_path.empty() || !this->readSnapshot(snapshot) ){
+    this->root = MoletConfig::parseJson(filename);
+    if( !out_path.empty() ){
+      this->writeSnapshot(snapshot);
+    }
+  }
+  this->build();
+}
+
+Json::Value MoletConfig::parseJson(std::string filename){
+  std::ifstream fin(filename,std::ifstream::in);
+  Json::CharReaderBuilder builder;
+  builder["allowComments"] = true;
+  builder["collectComments"] = false;
+  Json::Value root;
+  std::string errors;
+  if( !fin.is_open() || !Json::parseFromStream(builder,fin,&root,&errors) ){
+    fprintf(stderr,"Could not parse '%s':\n%s",filename.c_str(),errors.c_str());
+    exit(1);
+  }
+  return root;
+}
+
+bool MoletConfig::readSnapshot(std::string filename){
+  std::ifstream in(filename,std::ios::binary);
+  if( !in.is_open() ){
+    return false;
+  }
+  char magic[8];
+  uint64_t file_key;
+  in.read(magic,8);
+  in.read((char*) &file_key,sizeof(uint64_t));
+  if( !in.good() || memcmp(magic,snapshot_magic,8) != 0 || file_key != this->key ){
+    return false;
+  }
+  Json::Value value;
+  if( !readValue(in,value) ){
+    return false;
+  }
+  this->root = value;
+  return true;
+}
+
+void MoletConfig::writeSnapshot(std::string filename){
+  // Written to a temporary file and renamed, so that stages running at the same time never read a partial snapshot
+  std::string tmp = filename + "." + std::to_string(getpid());
+  std::ofstream out(tmp,std::ios::binary|std::ios::trunc);
+  if( !out.is_open() ){
+    fprintf(stderr,"Could not write the input snapshot '%s'\n",filename.c_str());
+    return;
+  }
+  out.write(snapshot_magic,8);
+  out.write((char*) &this->key,sizeof(uint64_t));
+  writeValue(out,this->root);
+  out.close();
+  rename(tmp.c_str(),filename.c_str());
+}
+
+void MoletConfig::build(){
+  if( !this->root.isObject() ){
+    invalid("the input must be a json object");
+  }
+
+  // Lenses and source
+  const Json::Value& jlenses = this->root["lenses"];
+  if( !jlenses.isArray() || jlenses.size() == 0 ){
+    invalid("'lenses' must be a non-empty list");
+  }
+  for(int k=0;k<jlenses.size();k++){
+    LensConfig lens;
+    lens.redshift           = requireNumber(jlenses[k],"redshift","lens "+std::to_string(k));
+    lens.mass_model         = jlenses[k]["mass_model"];
+    lens.light_profile      = jlenses[k]["light_profile"];
+    lens.compact_mass_model = jlenses[k]["compact_mass_model"];
+    this->lenses.push_back(lens);
+  }
+  if( !this->root["source"].isObject() ){
+    invalid("'source' is missing");
+  }
+  this->source.redshift      = requireNumber(this->root["source"],"redshift","'source'");
+  this->source.light_profile = this->root["source"]["light_profile"];
+
+  // Point source
+  if( this->root.isMember("point_source") ){
+    const Json::Value& jps = this->root["point_source"];
+    this->point_source.present        = true;
+    this->point_source.x0             = requireNumber(jps,"x0","'point_source'");
+    this->point_source.y0             = requireNumber(jps,"y0","'point_source'");
+    this->point_source.intrinsic_type = optionalString(jps["variability"]["intrinsic"],"type","the intrinsic variability");
+    this->point_source.extrinsic_type = optionalString(jps["variability"]["extrinsic"],"type","the extrinsic variability");
+    this->point_source.unmicro        = jps["variability"].isMember("unmicro");
+    this->point_source.output_cutouts = jps.get("output_cutouts",false).asBool();
+  }
+
+  // Instruments and cadence
+  const Json::Value& jinstruments = this->root["instruments"];
+  if( !jinstruments.isArray() || jinstruments.size() == 0 ){
+    invalid("'instruments' must be a non-empty list");
+  }
+  for(int b=0;b<jinstruments.size();b++){
+    const Json::Value& jinst = jinstruments[b];
+    std::string where = "instrument "+std::to_string(b);
+    InstrumentConfig instrument;
+    instrument.name = optionalString(jinst,"name",where);
+    if( instrument.name.empty() ){
+      invalid(where+" has no name");
+    }
+    instrument.xmin = requireNumber(jinst,"field-of-view_xmin",where);
+    instrument.xmax = requireNumber(jinst,"field-of-view_xmax",where);
+    instrument.ymin = requireNumber(jinst,"field-of-view_ymin",where);
+    instrument.ymax = requireNumber(jinst,"field-of-view_ymax",where);
+    if( instrument.xmin >= instrument.xmax || instrument.ymin >= instrument.ymax ){
+      invalid("the field of view of "+where+" is empty");
+    }
+    if( this->point_source.present && !jinst["time"].isArray() ){
+      invalid("'time' in "+where+" must be a list of the observed epochs");
+    }
+    for(int t=0;t<jinst["time"].size();t++){
+      if( !jinst["time"][t].isNumeric() ){
+	invalid("'time' in "+where+" must be a list of numbers");
+      }
+      instrument.time.push_back(jinst["time"][t].asDouble());
+      if( t > 0 && instrument.time[t] < instrument.time[t-1] ){
+	invalid("the epochs in 'time' of "+where+" must be in increasing order");
+      }
+    }
+    instrument.noise = jinst["noise"];
+    this->instruments.push_back(instrument);
+  }
+
+  // Output options
+  if( this->root.isMember("output_options") ){
+    const Json::Value& options = this->root["output_options"];
+    this->output.cut_out_scale = options["cut_outs"]["scale"].asString();
+    this->output.lazy_cutouts  = options["cut_outs"].get("lazy",false).asBool();
+    if( options.isMember("integration") ){
+      this->output.direct = options["integration"].get("mode","super").asString() == "direct";
+    }
+    if( options.isMember("mask") ){
+      this->output.mask           = true;
+      this->output.mask_smear     = options["mask"].get("smear",1.0).asDouble();
+      this->output.mask_threshold = options["mask"].get("threshold",0.1).asDouble();
+    }
+    if( options.isMember("adaptive") ){
+      this->output.adaptive           = true;
+      this->output.adaptive_threshold = options["adaptive"].get("threshold",1.e-6).asDouble();
+      if( this->output.adaptive_threshold < 0.0 || this->output.adaptive_threshold >= 1.0 ){
+	invalid("the 'threshold' of 'adaptive' in 'output_options' must be between 0 and 1");
+      }
+    }
+    if( options.isMember("lens_maps") ){
+      this->output.lens_maps = true;
+      const Json::Value& factor = options["lens_maps"].get("factor",1);
+      if( !factor.isInt() || factor.asInt() < 1 ){
+	invalid("the 'factor' of 'lens_maps' in 'output_options' must be a positive integer");
+      }
+      this->output.lens_maps_factor = factor.asInt();
+    }
+    if( options.isMember("source_map") ){
+      this->output.source_map = options["source_map"].get("keep",false).asBool();
+    }
+    if( options["tasks"].isMember("threads") ){
+      const Json::Value& threads = options["tasks"]["threads"];
+      if( !threads.isInt() || threads.asInt() < 0 ){
+	invalid("'threads' in the 'tasks' of 'output_options' must be a non-negative integer (0 for all the cores)");
+      }
+      this->output.threads = threads.asInt();
+    }
+  }
+  this->output.single_precision = singlePrecision(this->root);
+  this->output.tile_size        = outOfCoreTileSize(this->root);
+}
+
+// The json text without the // and /* */ comments, which are left untouched inside strings
+static std::string stripComments(const std::string& text){
+  std::string stripped;
+  bool in_string = false;
+  for(size_t i=0;i<text.size();i++){
+    char c = text[i];
+    if( in_string ){
+      stripped += c;
+      if( c == '\\' && i+1 < text.size() ){
+	stripped += text[++i];
+      } else if( c == '"' ){
+	in_string = false;
+      }
+    } else if( c == '"' ){
+      in_string = true;
+      stripped += c;
+    } else if( c == '/' && i+1 < text.size() && text[i+1] == '/' ){
+      while( i < text.size() && text[i] != '\n' ){
+	i++;
+      }
+      stripped += '\n';
+    } else if( c == '/' && i+1 < text.size() && text[i+1] == '*' ){
+      size_t end = text.find("*/",i+2);
+      i = (end == std::string::npos)? text.size() : end+1;
+      stripped += ' ';
+    } else {
+      stripped += c;
+    }
+  }
+  return stripped;
+}
+
+static std::string shellQuote(std::string str){
+  std::string quoted = "'";
+  for(int i=0;i<str.size();i++){
+    if( str[i] == '\'' ){
+      quoted += "'\\''";
+    } else {
+      quoted += str[i];
+    }
+  }
+  return quoted + "'";
+}
+
+void MoletConfig::printShell(FILE* fh){
+  // The input as written (without the comments), so that the numbers are hashed by the driver as in the file
+  fprintf(fh,"injson=%s\n",shellQuote(stripComments(this->text)).c_str());
+  fprintf(fh,"Ninstruments=%d\n",(int) this->instruments.size());
+  fprintf(fh,"instruments=(");
+  for(int b=0;b<this->instruments.size();b++){
+    fprintf(fh," %s",shellQuote(this->instruments[b].name).c_str());
+  }
+  fprintf(fh," )\n");
+  fprintf(fh,"has_point_source=%d\n",this->point_source.present);
+  fprintf(fh,"extrinsic=%s\n",shellQuote(this->point_source.extrinsic_type).c_str());
+  fprintf(fh,"frame=%s\n",(this->output.direct)? "obs" : "super");
+}
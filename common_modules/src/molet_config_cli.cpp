@@ -0,0 +1,23 @@
+#include <cstdio>
+#include <string>
+
+#include "molet_config.hpp"
+
+int main(int argc,char* argv[]){
+  /*
+    Usage: molet_config <molet_input.json> [output path]
+    Parses and validates the input, writes its snapshot in <output path>output/ for the following stages,
+    and prints the shell variables used by molet_driver.sh (to be evaluated with eval).
+  */
+  if( argc < 2 ){
+    fprintf(stderr,"Usage: %s <molet_input.json> [output path]\n",argv[0]);
+    return 1;
+  }
+  std::string out_path = "";
+  if( argc > 2 ){
+    out_path = argv[2];
+  }
+  MoletConfig config(argv[1],out_path);
+  config.printShell(stdout);
+  return 0;
+}
@@ -0,0 +1,409 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "json/json.h"
+
+#include "vkllib.hpp"
+
+#include "multi_plane.hpp"
+#include "deflection_field.hpp"
+#include "hash_bytes.hpp"
+
+LensPlane::~LensPlane(){
+  delete(mass);
+  delete(field);
+}
+
+static const char sidecar_magic[8] = {'M','O','L','D','E','F','L','1'};
+
+static bool comparePlanes(const LensPlane* a,const LensPlane* b){
+  return a->z < b->z;
+}
+
+MultiPlaneLens::MultiPlaneLens(const Json::Value& lenses,const Json::Value& cosmo,std::string input){
+  for(int k=0;k<lenses.size();k++){
+    CollectionMassModels* mass_collection = new CollectionMassModels(JsonParsers::parse_mass_model(lenses[k]["mass_model"],input));
+    scalePerturbations(lenses[k]["mass_model"],mass_collection);
+    this->planes.push_back( new LensPlane(k,lenses[k]["redshift"].asDouble(),mass_collection) );
+  }
+  std::stable_sort(this->planes.begin(),this->planes.end(),comparePlanes);
+  if( this->planes.size() > max_planes ){
+    fprintf(stderr,"At most %d lens planes are supported (%d given)!\n",max_planes,(int) this->planes.size());
+    exit(1);
+  }
+
+  // Distance ratios between the planes: cosmo[k] holds the distances of lens k, and cosmo[k]["Dlj"][m] the distance from lens k to lens m
+  int N = this->planes.size();
+  this->beta.resize(N,std::vector<double>(N,0.0));
+  for(int i=0;i<N;i++){
+    int ki = this->planes[i]->index;
+    for(int j=i+1;j<N;j++){
+      int kj = this->planes[j]->index;
+      double D_ij = cosmo[ki]["Dlj"][kj].asDouble();
+      double D_s  = cosmo[kj]["Ds"].asDouble();
+      double D_j  = cosmo[kj]["Dl"].asDouble();
+      double D_is = cosmo[ki]["Dls"].asDouble();
+      this->beta[i][j] = (D_ij*D_s)/(D_j*D_is);
+    }
+  }
+
+  // The factor 0.0281 converts the distances in Mpc and the angles in arcsec^2 to days.
+  // The potential of each plane enters with tau_j*beta_{j,j+1}, which is the single plane factor of that lens, and planes at the same redshift have no geometric term.
+  this->tau.resize(N);
+  this->tau_psi.resize(N);
+  for(int i=0;i<N;i++){
+    int ki = this->planes[i]->index;
+    double D_i = cosmo[ki]["Dl"].asDouble();
+    this->tau_psi[i] = 0.0281*(1.0+this->planes[i]->z)*D_i*cosmo[ki]["Ds"].asDouble()/cosmo[ki]["Dls"].asDouble();
+    if( i == N-1 ){
+      this->tau[i] = this->tau_psi[i];
+    } else {
+      int kn = this->planes[i+1]->index;
+      double D_in = cosmo[ki]["Dlj"][kn].asDouble();
+      this->tau[i] = (D_in > 0.0)?0.0281*(1.0+this->planes[i]->z)*D_i*cosmo[kn]["Dl"].asDouble()/D_in:0.0;
+    }
+  }
+
+  // Key of the sidecar deflection cache
+  Json::FastWriter writer;
+  uint64_t h = hash_seed;
+  for(int i=0;i<N;i++){
+    const Json::Value& jmass = lenses[this->planes[i]->index]["mass_model"];
+    std::string str = writer.write(jmass);
+    h = hashBytes(h,str.data(),str.size());
+    h = hashBytes(h,&this->planes[i]->z,sizeof(double));
+    h = hashBytes(h,this->beta[i].data(),N*sizeof(double));
+    for(int k=0;k<jmass.size();k++){
+      if( jmass[k]["type"].asString() == "pert" || jmass[k]["pars"].isMember("scale_factor") ){
+	this->perturbed = true;
+      }
+      if( jmass[k]["pars"].isMember("filename") ){
+	// Pixelated models are read from a file, which may change while the json stays the same
+	std::ifstream fmodel(input+jmass[k]["pars"]["filename"].asString(),std::ios::binary);
+	std::string content((std::istreambuf_iterator<char>(fmodel)),std::istreambuf_iterator<char>());
+	h = hashBytes(h,content.data(),content.size());
+      }
+    }
+  }
+  this->mass_key = h;
+}
+
+MultiPlaneLens::~MultiPlaneLens(){
+  for(int i=0;i<this->planes.size();i++){
+    delete(this->planes[i]);
+  }
+}
+
+void MultiPlaneLens::cacheDeflections(RectGrid* grid,int Nthreads,std::string sidecar){
+  // The first plane is sampled exactly on the pixel centers of the grid.
+  // Each following plane gets a grid with the same number of nodes, covering the positions that the rays of a coarse sample of the pixels reach on it (plus a margin).
+  // If a sidecar file is given, the fields are read from it when it was written for the same lenses and grid, or written to it after sampling.
+  int Nx = grid->Nx;
+  int Ny = grid->Ny;
+  int N  = this->planes.size();
+
+  double geometry[4] = {grid->xmin,grid->xmax,grid->ymin,grid->ymax};
+  uint64_t grid_key = hash_seed;
+  grid_key = hashBytes(grid_key,&Nx,sizeof(int));
+  grid_key = hashBytes(grid_key,&Ny,sizeof(int));
+  grid_key = hashBytes(grid_key,geometry,4*sizeof(double));
+  if( sidecar != "" && this->readSidecar(sidecar,grid_key) ){
+    return;
+  }
+
+  int step = 10;
+  std::vector<double> xs,ys;
+  for(int i=0;i<Ny;i+=step){
+    for(int j=0;j<Nx;j+=step){
+      xs.push_back(grid->center_x[j]);
+      ys.push_back(grid->center_y[i]);
+    }
+  }
+  for(int i=0;i<Ny;i++){
+    xs.push_back(grid->center_x[Nx-1]);
+    ys.push_back(grid->center_y[i]);
+  }
+  for(int j=0;j<Nx;j++){
+    xs.push_back(grid->center_x[j]);
+    ys.push_back(grid->center_y[Ny-1]);
+  }
+  int Ns = xs.size();
+  std::vector< std::vector<double> > alpha_x(N,std::vector<double>(Ns));
+  std::vector< std::vector<double> > alpha_y(N,std::vector<double>(Ns));
+
+  for(int p=0;p<N;p++){
+    // Positions of the sample on plane p
+    double xmin = 1.e30;
+    double xmax = -1.e30;
+    double ymin = 1.e30;
+    double ymax = -1.e30;
+    std::vector<double> xp(Ns),yp(Ns);
+    for(int s=0;s<Ns;s++){
+      xp[s] = xs[s];
+      yp[s] = ys[s];
+      for(int i=0;i<p;i++){
+	xp[s] -= this->beta[i][p]*alpha_x[i][s];
+	yp[s] -= this->beta[i][p]*alpha_y[i][s];
+      }
+      xmin = std::min(xmin,xp[s]);
+      xmax = std::max(xmax,xp[s]);
+      ymin = std::min(ymin,yp[s]);
+      ymax = std::max(ymax,yp[s]);
+    }
+
+    DeflectionField* field;
+    if( p == 0 ){
+      field = new DeflectionField(Nx,Ny,grid->center_x[0],grid->center_x[Nx-1],std::min(grid->center_y[0],grid->center_y[Ny-1]),std::max(grid->center_y[0],grid->center_y[Ny-1]));
+    } else {
+      double margin_x = 2.0*step*(xmax-xmin)/Nx;
+      double margin_y = 2.0*step*(ymax-ymin)/Ny;
+      field = new DeflectionField(Nx,Ny,xmin-margin_x,xmax+margin_x,ymin-margin_y,ymax+margin_y);
+    }
+    field->fill(this->planes[p]->mass,Nthreads);
+    delete(this->planes[p]->field);
+    this->planes[p]->field = field;
+
+    for(int s=0;s<Ns;s++){
+      if( !field->interpolate(xp[s],yp[s],alpha_x[p][s],alpha_y[p][s]) ){
+	double xdefl,ydefl;
+	this->planes[p]->mass->all_defl(xp[s],yp[s],xdefl,ydefl);
+	alpha_x[p][s] = xp[s] - xdefl;
+	alpha_y[p][s] = yp[s] - ydefl;
+      }
+    }
+  }
+
+  if( sidecar != "" ){
+    this->writeSidecar(sidecar,grid_key);
+  }
+}
+
+bool MultiPlaneLens::readSidecar(std::string sidecar,uint64_t grid_key){
+  std::ifstream in(sidecar,std::ios::binary);
+  if( !in.is_open() ){
+    return false;
+  }
+  char magic[8];
+  uint64_t keys[2];
+  int N;
+  in.read(magic,8);
+  in.read((char*) keys,2*sizeof(uint64_t));
+  in.read((char*) &N,sizeof(int));
+  if( !in.good() || memcmp(magic,sidecar_magic,8) != 0 || keys[0] != this->mass_key || keys[1] != grid_key || N != this->planes.size() ){
+    return false;
+  }
+  std::vector<DeflectionField*> fields;
+  for(int p=0;p<N;p++){
+    DeflectionField* field = DeflectionField::read(in);
+    if( field == NULL ){
+      for(int i=0;i<fields.size();i++){
+	delete(fields[i]);
+      }
+      return false;
+    }
+    fields.push_back(field);
+  }
+  for(int p=0;p<N;p++){
+    delete(this->planes[p]->field);
+    this->planes[p]->field = fields[p];
+  }
+  return true;
+}
+
+void MultiPlaneLens::writeSidecar(std::string sidecar,uint64_t grid_key){
+  // Written to a temporary file and renamed, so that a partial cache is never read
+  std::string tmp = sidecar + "." + std::to_string(getpid());
+  std::ofstream out(tmp,std::ios::binary|std::ios::trunc);
+  if( !out.is_open() ){
+    fprintf(stderr,"Could not write the deflection cache '%s'\n",sidecar.c_str());
+    return;
+  }
+  uint64_t keys[2] = {this->mass_key,grid_key};
+  int N = this->planes.size();
+  out.write(sidecar_magic,8);
+  out.write((char*) keys,2*sizeof(uint64_t));
+  out.write((char*) &N,sizeof(int));
+  for(int p=0;p<N;p++){
+    this->planes[p]->field->write(out);
+  }
+  out.close();
+  rename(tmp.c_str(),sidecar.c_str());
+}
+
+void MultiPlaneLens::all_defl(double x,double y,double& xdefl,double& ydefl){
+  if( this->planes.size() == 1 && this->planes[0]->field == NULL ){
+    this->planes[0]->mass->all_defl(x,y,xdefl,ydefl);
+  } else {
+    this->trace(x,y,xdefl,ydefl,true);
+  }
+}
+
+void MultiPlaneLens::trace(double x,double y,double& xdefl,double& ydefl,bool use_cache){
+  int N = this->planes.size();
+  double alpha_x[max_planes];
+  double alpha_y[max_planes];
+  xdefl = x;
+  ydefl = y;
+  for(int j=0;j<N;j++){
+    double xj = x;
+    double yj = y;
+    for(int i=0;i<j;i++){
+      xj -= this->beta[i][j]*alpha_x[i];
+      yj -= this->beta[i][j]*alpha_y[i];
+    }
+    if( !(use_cache && this->planes[j]->field != NULL && this->planes[j]->field->interpolate(xj,yj,alpha_x[j],alpha_y[j])) ){
+      double xd,yd;
+      this->planes[j]->mass->all_defl(xj,yj,xd,yd);
+      alpha_x[j] = xj - xd;
+      alpha_y[j] = yj - yd;
+    }
+    xdefl -= alpha_x[j];
+    ydefl -= alpha_y[j];
+  }
+}
+
+void MultiPlaneLens::jacobian(double x,double y,double& a11,double& a12,double& a21,double& a22){
+  // Central finite differences of the exact (not cached) lens equation
+  double h = 1.e-5; // in arcsec
+  double xp,yp,xm,ym;
+  this->trace(x+h,y,xp,yp,false);
+  this->trace(x-h,y,xm,ym,false);
+  a11 = (xp-xm)/(2.0*h);
+  a21 = (yp-ym)/(2.0*h);
+  this->trace(x,y+h,xp,yp,false);
+  this->trace(x,y-h,xm,ym,false);
+  a12 = (xp-xm)/(2.0*h);
+  a22 = (yp-ym)/(2.0*h);
+}
+
+double MultiPlaneLens::detJacobian(double x,double y){
+  if( this->planes.size() == 1 ){
+    return this->planes[0]->mass->detJacobian(x,y);
+  }
+  double a11,a12,a21,a22;
+  this->jacobian(x,y,a11,a12,a21,a22);
+  return a11*a22 - a12*a21;
+}
+
+double MultiPlaneLens::all_kappa(double x,double y){
+  if( this->planes.size() == 1 ){
+    return this->planes[0]->mass->all_kappa(x,y);
+  }
+  // Effective convergence from the trace of the full Jacobian
+  double a11,a12,a21,a22;
+  this->jacobian(x,y,a11,a12,a21,a22);
+  return 1.0 - 0.5*(a11+a22);
+}
+
+void MultiPlaneLens::all_gamma(double x,double y,double& gamma_mag,double& gamma_phi){
+  if( this->planes.size() == 1 ){
+    this->planes[0]->mass->all_gamma(x,y,gamma_mag,gamma_phi);
+    return;
+  }
+  // Effective shear from the symmetric traceless part of the full Jacobian
+  double a11,a12,a21,a22;
+  this->jacobian(x,y,a11,a12,a21,a22);
+  double g1 = 0.5*(a22-a11);
+  double g2 = -0.5*(a12+a21);
+  gamma_mag = hypot(g1,g2);
+  gamma_phi = 0.5*atan2(g2,g1);
+}
+
+void MultiPlaneLens::evaluate(double x,double y,double source_x,double source_y,LensPoint& out){
+  // One exact trace through the planes: the position and deflection on each plane give the source plane position and the Fermat potential.
+  // The Jacobian follows along the same trace, A_j = I - sum_{i<j} beta_ij * H_i * A_i, with the Hessian H_i of the potential of plane i
+  // from its convergence and shear at x_i, and A = I - sum_i H_i * A_i on the source plane.
+  int N = this->planes.size();
+  double xp[max_planes+1];
+  double yp[max_planes+1];
+  double alpha_x[max_planes];
+  double alpha_y[max_planes];
+  double m11[max_planes],m12[max_planes],m21[max_planes],m22[max_planes]; // H_j*A_j
+  double kappa,gamma_mag,gamma_phi;
+  double time = 0.0;
+  for(int j=0;j<N;j++){
+    double a11 = 1.0;
+    double a12 = 0.0;
+    double a21 = 0.0;
+    double a22 = 1.0;
+    xp[j] = x;
+    yp[j] = y;
+    for(int i=0;i<j;i++){
+      xp[j] -= this->beta[i][j]*alpha_x[i];
+      yp[j] -= this->beta[i][j]*alpha_y[i];
+      a11 -= this->beta[i][j]*m11[i];
+      a12 -= this->beta[i][j]*m12[i];
+      a21 -= this->beta[i][j]*m21[i];
+      a22 -= this->beta[i][j]*m22[i];
+    }
+    CollectionMassModels* mass = this->planes[j]->mass;
+    double xd,yd;
+    mass->all_defl(xp[j],yp[j],xd,yd);
+    alpha_x[j] = xp[j] - xd;
+    alpha_y[j] = yp[j] - yd;
+    kappa = mass->all_kappa(xp[j],yp[j]);
+    mass->all_gamma(xp[j],yp[j],gamma_mag,gamma_phi);
+    double g1 = gamma_mag*cos(2.0*gamma_phi);
+    double g2 = gamma_mag*sin(2.0*gamma_phi);
+    m11[j] = (kappa+g1)*a11 + g2*a21;
+    m12[j] = (kappa+g1)*a12 + g2*a22;
+    m21[j] = g2*a11 + (kappa-g1)*a21;
+    m22[j] = g2*a12 + (kappa-g1)*a22;
+    time -= this->tau_psi[j]*mass->all_psi(xp[j],yp[j]);
+  }
+  xp[N] = source_x;
+  yp[N] = source_y;
+  for(int j=0;j<N;j++){
+    time += this->tau[j]*0.5*(pow(xp[j]-xp[j+1],2) + pow(yp[j]-yp[j+1],2));
+  }
+
+  out.xdefl = x;
+  out.ydefl = y;
+  double a11 = 1.0;
+  double a12 = 0.0;
+  double a21 = 0.0;
+  double a22 = 1.0;
+  for(int j=0;j<N;j++){
+    out.xdefl -= alpha_x[j];
+    out.ydefl -= alpha_y[j];
+    a11 -= m11[j];
+    a12 -= m12[j];
+    a21 -= m21[j];
+    a22 -= m22[j];
+  }
+  if( N == 1 ){
+    // The values of the mass models as they are
+    out.kappa     = kappa;
+    out.gamma_mag = gamma_mag;
+    out.gamma_phi = gamma_phi;
+  } else {
+    // Effective convergence and shear from the trace and the symmetric traceless part of the full Jacobian
+    double g1 = 0.5*(a22-a11);
+    double g2 = -0.5*(a12+a21);
+    out.kappa     = 1.0 - 0.5*(a11+a22);
+    out.gamma_mag = hypot(g1,g2);
+    out.gamma_phi = 0.5*atan2(g2,g1);
+  }
+  out.mag  = 1.0/(a11*a22 - a12*a21);
+  out.time = time;
+}
+
+void scalePerturbations(const Json::Value& jmass,CollectionMassModels* mass_collection){
+  // Scale dpsi mass models if necessary
+  for(int k=0;k<jmass.size();k++){
+    if( jmass[k]["pars"].isMember("scale_factor") ){
+      double scale_factor = jmass[k]["pars"]["scale_factor"].asDouble();
+      Pert* pert = static_cast<Pert*> (mass_collection->models[k]);
+      for(int m=0;m<pert->Sm;m++){
+	pert->z[m] *= scale_factor;
+      }
+      pert->updateDerivatives();
+    }
+  }
+}
@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "json/json.h"
+
+#include "vkllib.hpp"
+
+#include "pixel_integrator.hpp"
+
+// Nodes and weights of the n-point Gauss-Legendre rule on [-1,1], from the roots of the Legendre polynomial (Newton iterations)
+static void gaussLegendre(int n,std::vector<double>& x,std::vector<double>& w){
+  x.resize(n);
+  w.resize(n);
+  for(int i=0;i<(n+1)/2;i++){
+    double z = cos(M_PI*(i+0.75)/(n+0.5));
+    double z1,pp;
+    do {
+      double p1 = 1.0;
+      double p2 = 0.0;
+      for(int j=0;j<n;j++){
+	double p3 = p2;
+	p2 = p1;
+	p1 = ((2.0*j+1.0)*z*p2 - j*p3)/(j+1);
+      }
+      pp = n*(z*p1 - p2)/(z*z - 1.0);
+      z1 = z;
+      z  = z1 - p1/pp;
+    } while( fabs(z-z1) > 1.e-15 );
+    x[i]     = -z;
+    x[n-1-i] = z;
+    w[i]     = 2.0/((1.0-z*z)*pp*pp);
+    w[n-1-i] = w[i];
+  }
+}
+
+PixelIntegrator::PixelIntegrator(const Json::Value& options){
+  // 'options' is the (optional) "integration" member of "output_options" in the input json
+  this->mode      = options.get("mode","super").asString();
+  this->tolerance = options.get("tolerance",1.e-3).asDouble();
+  this->min_nodes = options.get("min_nodes",2).asInt();
+  this->max_nodes = options.get("max_nodes",16).asInt();
+  this->Nthreads  = options.get("threads",0).asInt();
+  this->evaluations = 0;
+
+  for(int n=std::max(1,this->min_nodes);n<=std::max(this->min_nodes,this->max_nodes);n*=2){
+    this->orders.push_back(n);
+    std::vector<double> x,w;
+    gaussLegendre(n,x,w);
+    this->nodes.push_back(x);
+    this->weights.push_back(w);
+  }
+}
+
+bool PixelIntegrator::direct(){
+  return this->mode == "direct";
+}
+
+double PixelIntegrator::integrate(const std::function<double(double,double)>& f,int k,double xc,double yc,double hx,double hy){
+  // hx,hy are the half sides of the pixel
+  const std::vector<double>& x = this->nodes[k];
+  const std::vector<double>& w = this->weights[k];
+  double sum = 0.0;
+  for(int i=0;i<x.size();i++){
+    double y = yc + hy*x[i];
+    for(int j=0;j<x.size();j++){
+      sum += w[i]*w[j]*f(xc + hx*x[j],y);
+    }
+  }
+  this->evaluations += x.size()*x.size();
+  return hx*hy*sum;
+}
+
+void PixelIntegrator::render(std::function<double(double,double)> f,RectGrid* grid){
+  // First pass with the lowest order everywhere, to set the absolute tolerance of the faint pixels, then refine each pixel
+  this->evaluations = 0;
+  this->runThreads(0,f,grid);
+  double vmax = 0.0;
+  for(int i=0;i<grid->Nz;i++){
+    vmax = std::max(vmax,fabs(grid->z[i]));
+  }
+  this->faint_level = 1.e-3*vmax;
+  if( this->orders.size() > 1 ){
+    this->runThreads(1,f,grid);
+  }
+}
+
+void PixelIntegrator::runThreads(int pass,const std::function<double(double,double)>& f,RectGrid* grid){
+  int N = this->Nthreads;
+  if( N <= 0 ){
+    N = std::thread::hardware_concurrency();
+  }
+  N = std::max(1,std::min(N,grid->Ny));
+  this->next_row = 0;
+  std::vector<std::thread> threads;
+  for(int k=0;k<N;k++){
+    threads.push_back( std::thread(&PixelIntegrator::work,this,pass,std::cref(f),grid) );
+  }
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+}
+
+void PixelIntegrator::work(int pass,const std::function<double(double,double)>& f,RectGrid* grid){
+  double hx = grid->step_x/2.0;
+  double hy = grid->step_y/2.0;
+  while( true ){
+    int i = this->next_row++;
+    if( i >= grid->Ny ){
+      break;
+    }
+    double* row = grid->z + i*grid->Nx;
+    double yc = grid->center_y[i];
+    for(int j=0;j<grid->Nx;j++){
+      if( pass == 0 ){
+	row[j] = this->integrate(f,0,grid->center_x[j],yc,hx,hy);
+      } else {
+	double previous = row[j];
+	for(int k=1;k<this->orders.size();k++){
+	  double current = this->integrate(f,k,grid->center_x[j],yc,hx,hy);
+	  bool converged = fabs(current-previous) <= this->tolerance*std::max(fabs(current),this->faint_level);
+	  previous = current;
+	  if( converged ){
+	    break;
+	  }
+	}
+	row[j] = previous;
+      }
+    }
+  }
+}
@@ -0,0 +1,100 @@
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <sys/resource.h>
+
+#include "json/json.h"
+
+#include "profiler.hpp"
+
+Profiler::Profiler(){
+  this->stage = "";
+  this->start = std::chrono::steady_clock::now();
+}
+
+void Profiler::setStage(std::string stage){
+  this->stage = stage;
+  this->start = std::chrono::steady_clock::now();
+}
+
+void Profiler::add(std::string name,double seconds){
+  long rss = peakRSS();
+  std::lock_guard<std::mutex> lock(this->mtx);
+  if( this->entries.find(name) == this->entries.end() ){
+    this->names.push_back(name);
+  }
+  Entry& entry = this->entries[name];
+  entry.calls++;
+  entry.total += seconds;
+  if( seconds > entry.max ){
+    entry.max = seconds;
+  }
+  entry.peak_rss = rss;
+}
+
+void Profiler::count(std::string name,long value){
+  std::lock_guard<std::mutex> lock(this->mtx);
+  if( this->counters.find(name) == this->counters.end() ){
+    this->counter_names.push_back(name);
+  }
+  this->counters[name] += value;
+}
+
+long Profiler::peakRSS(){
+  struct rusage usage;
+  getrusage(RUSAGE_SELF,&usage);
+  return usage.ru_maxrss; // kB on Linux
+}
+
+void Profiler::write(std::string filename){
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+
+  Json::Value json;
+  json["stage"]       = this->stage;
+  json["wall_s"]      = wall;
+  json["peak_rss_kb"] = (Json::Int64) peakRSS();
+  Json::Value timers = Json::Value(Json::arrayValue);
+  std::lock_guard<std::mutex> lock(this->mtx);
+  for(int i=0;i<this->names.size();i++){
+    const Entry& entry = this->entries[this->names[i]];
+    Json::Value timer;
+    timer["name"]        = this->names[i];
+    timer["calls"]       = (Json::Int64) entry.calls;
+    timer["total_s"]     = entry.total;
+    timer["max_s"]       = entry.max;
+    timer["peak_rss_kb"] = (Json::Int64) entry.peak_rss;
+    timers.append(timer);
+  }
+  json["timers"] = timers;
+  Json::Value counters = Json::Value(Json::arrayValue);
+  for(int i=0;i<this->counter_names.size();i++){
+    Json::Value counter;
+    counter["name"]  = this->counter_names[i];
+    counter["value"] = (Json::Int64) this->counters[this->counter_names[i]];
+    counters.append(counter);
+  }
+  json["counters"] = counters;
+
+  std::ofstream file(filename,std::ofstream::out);
+  file << json;
+  file.close();
+}
+
+
+ScopedTimer::ScopedTimer(std::string name):name(name){
+  this->start   = std::chrono::steady_clock::now();
+  this->running = true;
+}
+
+ScopedTimer::~ScopedTimer(){
+  this->stop();
+}
+
+void ScopedTimer::stop(){
+  if( this->running ){
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+    Profiler::getInstance()->add(this->name,seconds);
+    this->running = false;
+  }
+}
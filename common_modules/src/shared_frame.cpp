@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "vkllib.hpp"
+
+#include "shared_frame.hpp"
+
+SharedFrame::SharedFrame(const std::vector<InstrumentConfig>& instruments,const std::vector<double>& resolutions,int factor){
+  // The same number of pixels as an instrument would get on its own, i.e. a multiple of 'factor', so that the frame can also be binned to the finest resolution
+  this->xmin = instruments[0].xmin;
+  this->xmax = instruments[0].xmax;
+  this->ymin = instruments[0].ymin;
+  this->ymax = instruments[0].ymax;
+  this->resolution = resolutions[0];
+  for(int b=1;b<instruments.size();b++){
+    this->xmin = std::min(this->xmin,instruments[b].xmin);
+    this->xmax = std::max(this->xmax,instruments[b].xmax);
+    this->ymin = std::min(this->ymin,instruments[b].ymin);
+    this->ymax = std::max(this->ymax,instruments[b].ymax);
+    this->resolution = std::min(this->resolution,resolutions[b]);
+  }
+  this->Nx = factor*( static_cast<int>(ceil((this->xmax-this->xmin)/this->resolution)) );
+  this->Ny = factor*( static_cast<int>(ceil((this->ymax-this->ymin)/this->resolution)) );
+
+  this->uniform = true;
+  for(int b=0;b<instruments.size();b++){
+    int nx = factor*( static_cast<int>(ceil((instruments[b].xmax-instruments[b].xmin)/resolutions[b])) );
+    int ny = factor*( static_cast<int>(ceil((instruments[b].ymax-instruments[b].ymin)/resolutions[b])) );
+    if( !this->isFrame(nx,ny,instruments[b].xmin,instruments[b].xmax,instruments[b].ymin,instruments[b].ymax) ){
+      this->uniform = false;
+    }
+  }
+}
+
+bool SharedFrame::isFrame(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax) const {
+  return Nx == this->Nx && Ny == this->Ny && xmin == this->xmin && xmax == this->xmax && ymin == this->ymin && ymax == this->ymax;
+}
+
+void SharedFrame::checkMode(bool direct,int tile_size) const {
+  // The direct integration and the out-of-core tiles work on the observed pixels, or the tiles, of a single frame
+  if( !this->uniform && (direct || tile_size > 0) ){
+    fprintf(stderr,"Instruments with different resolutions or fields of view are only supported in the super-resolved mode without out-of-core tiles!\n");
+    exit(1);
+  }
+}
+
+RectGrid* SharedFrame::resample(RectGrid* shared,int Nx,int Ny,double xmin,double xmax,double ymin,double ymax) const {
+  // Each new pixel is the mean of the shared pixels weighted by their overlap with it, which is exact for pixels of uniform brightness and conserves the flux.
+  // The weights are separable, so they are computed once for the columns and once for the rows (counted from the top, as in RectGrid).
+  RectGrid* grid = new RectGrid(Nx,Ny,xmin,xmax,ymin,ymax);
+  Weights wx = overlapWeights(Nx,xmin,xmax,shared->Nx,shared->xmin,shared->xmax);
+  Weights wy = overlapWeights(Ny,-ymax,-ymin,shared->Ny,-shared->ymax,-shared->ymin);
+  for(int i=0;i<Ny;i++){
+    for(int j=0;j<Nx;j++){
+      double sum = 0.0;
+      for(int p=0;p<wy[i].size();p++){
+	double* row = shared->z + (long) wy[i][p].first*shared->Nx;
+	double partial = 0.0;
+	for(int q=0;q<wx[j].size();q++){
+	  partial += wx[j][q].second*row[wx[j][q].first];
+	}
+	sum += wy[i][p].second*partial;
+      }
+      grid->z[i*Nx+j] = sum;
+    }
+  }
+  return grid;
+}
+
+SharedFrame::Weights SharedFrame::overlapWeights(int N_to,double min_to,double max_to,int N_from,double min_from,double max_from){
+  // For each new pixel, the old pixels that overlap it and the fraction of the new pixel that they cover (the parts outside the old frame are zero)
+  Weights weights(N_to);
+  double step_to   = (max_to - min_to)/N_to;
+  double step_from = (max_from - min_from)/N_from;
+  for(int j=0;j<N_to;j++){
+    double lo = min_to + j*step_to;
+    double hi = lo + step_to;
+    int k_start = std::max(0,static_cast<int>(floor((lo - min_from)/step_from)));
+    int k_end   = std::min(N_from-1,static_cast<int>(floor((hi - min_from)/step_from)));
+    for(int k=k_start;k<=k_end;k++){
+      double overlap = std::min(hi,min_from+(k+1)*step_from) - std::max(lo,min_from+k*step_from);
+      if( overlap > 0.0 ){
+	weights[j].push_back(std::make_pair(k,overlap/step_to));
+      }
+    }
+  }
+  return weights;
+}
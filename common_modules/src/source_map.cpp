@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+#include "vkllib.hpp"
+
+#include "source_map.hpp"
+#include "multi_plane.hpp"
+#include "hash_bytes.hpp"
+
+static const char source_map_magic[8] = {'M','O','L','S','M','A','P','1'};
+
+uint64_t SourceMap::mapKey(MultiPlaneLens* lens,RectGrid* grid){
+  uint64_t mass_key = lens->massKey();
+  double geometry[4] = {grid->xmin,grid->xmax,grid->ymin,grid->ymax};
+  uint64_t h = hash_seed;
+  h = hashBytes(h,&mass_key,sizeof(uint64_t));
+  h = hashBytes(h,&grid->Nx,sizeof(int));
+  h = hashBytes(h,&grid->Ny,sizeof(int));
+  h = hashBytes(h,geometry,4*sizeof(double));
+  return h;
+}
+
+SourceMap::SourceMap(MultiPlaneLens* lens,RectGrid* grid,bool single_precision,int Nthreads){
+  this->Nx   = grid->Nx;
+  this->Ny   = grid->Ny;
+  this->xmin = grid->xmin;
+  this->xmax = grid->xmax;
+  this->ymin = grid->ymin;
+  this->ymax = grid->ymax;
+  this->single_precision = single_precision;
+  this->key  = mapKey(lens,grid);
+  long N = (long) this->Nx*this->Ny;
+  if( single_precision ){
+    this->xs_single.resize(N);
+    this->ys_single.resize(N);
+  } else {
+    this->xs.resize(N);
+    this->ys.resize(N);
+  }
+
+  if( Nthreads <= 0 ){
+    Nthreads = std::max(1,(int) std::thread::hardware_concurrency());
+  }
+  std::vector<std::thread> threads;
+  for(int k=0;k<Nthreads;k++){
+    threads.push_back( std::thread(&SourceMap::traceRows,this,lens,grid,k,Nthreads) );
+  }
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+}
+
+void SourceMap::traceRows(MultiPlaneLens* lens,RectGrid* grid,int i_start,int i_step){
+  double xdefl,ydefl;
+  for(int i=i_start;i<this->Ny;i+=i_step){
+    for(int j=0;j<this->Nx;j++){
+      lens->all_defl(grid->center_x[j],grid->center_y[i],xdefl,ydefl);
+      long k = (long) i*this->Nx + j;
+      if( this->single_precision ){
+	this->xs_single[k] = static_cast<float>(xdefl);
+	this->ys_single[k] = static_cast<float>(ydefl);
+      } else {
+	this->xs[k] = xdefl;
+	this->ys[k] = ydefl;
+      }
+    }
+  }
+}
+
+void SourceMap::render(CollectionProfiles* profiles,RectGrid* grid,int Nthreads){
+  if( grid->Nx != this->Nx || grid->Ny != this->Ny ){
+    fprintf(stderr,"The source map (%dx%d) and the grid (%dx%d) have different sizes!\n",this->Nx,this->Ny,grid->Nx,grid->Ny);
+    exit(1);
+  }
+  if( Nthreads <= 0 ){
+    Nthreads = std::max(1,(int) std::thread::hardware_concurrency());
+  }
+  std::vector<std::thread> threads;
+  for(int k=0;k<Nthreads;k++){
+    threads.push_back( std::thread(&SourceMap::renderRows,this,profiles,grid,k,Nthreads) );
+  }
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+}
+
+void SourceMap::renderRows(CollectionProfiles* profiles,RectGrid* grid,int i_start,int i_step){
+  for(int i=i_start;i<this->Ny;i+=i_step){
+    long k0 = (long) i*this->Nx;
+    if( this->single_precision ){
+      for(long k=k0;k<k0+this->Nx;k++){
+	grid->z[k] = profiles->all_values(this->xs_single[k],this->ys_single[k]);
+      }
+    } else {
+      for(long k=k0;k<k0+this->Nx;k++){
+	grid->z[k] = profiles->all_values(this->xs[k],this->ys[k]);
+      }
+    }
+  }
+}
+
+void SourceMap::write(std::string filename){
+  // Written to a temporary file and renamed, so that a partial map is never read
+  std::string tmp = filename + ".tmp";
+  std::ofstream out(tmp,std::ios::binary|std::ios::trunc);
+  if( !out.is_open() ){
+    fprintf(stderr,"Could not write the source map '%s'\n",filename.c_str());
+    return;
+  }
+  int dims[3] = {this->Nx,this->Ny,this->single_precision};
+  double limits[4] = {this->xmin,this->xmax,this->ymin,this->ymax};
+  out.write(source_map_magic,8);
+  out.write((char*) &this->key,sizeof(uint64_t));
+  out.write((char*) dims,3*sizeof(int));
+  out.write((char*) limits,4*sizeof(double));
+  if( this->single_precision ){
+    out.write((char*) this->xs_single.data(),this->xs_single.size()*sizeof(float));
+    out.write((char*) this->ys_single.data(),this->ys_single.size()*sizeof(float));
+  } else {
+    out.write((char*) this->xs.data(),this->xs.size()*sizeof(double));
+    out.write((char*) this->ys.data(),this->ys.size()*sizeof(double));
+  }
+  out.close();
+  rename(tmp.c_str(),filename.c_str());
+}
+
+SourceMap* SourceMap::read(std::string filename,MultiPlaneLens* lens,RectGrid* grid,bool single_precision){
+  std::ifstream in(filename,std::ios::binary);
+  if( !in.is_open() ){
+    return NULL;
+  }
+  char magic[8];
+  uint64_t key;
+  int dims[3];
+  double limits[4];
+  in.read(magic,8);
+  in.read((char*) &key,sizeof(uint64_t));
+  in.read((char*) dims,3*sizeof(int));
+  in.read((char*) limits,4*sizeof(double));
+  if( !in.good() || memcmp(magic,source_map_magic,8) != 0 || key != mapKey(lens,grid) || dims[0] != grid->Nx || dims[1] != grid->Ny || (dims[2] && !single_precision) ){
+    return NULL;
+  }
+
+  SourceMap* map = new SourceMap();
+  map->Nx   = dims[0];
+  map->Ny   = dims[1];
+  map->xmin = limits[0];
+  map->xmax = limits[1];
+  map->ymin = limits[2];
+  map->ymax = limits[3];
+  map->single_precision = dims[2];
+  map->key  = key;
+  long N = (long) map->Nx*map->Ny;
+  if( map->single_precision ){
+    map->xs_single.resize(N);
+    map->ys_single.resize(N);
+    in.read((char*) map->xs_single.data(),N*sizeof(float));
+    in.read((char*) map->ys_single.data(),N*sizeof(float));
+  } else {
+    map->xs.resize(N);
+    map->ys.resize(N);
+    in.read((char*) map->xs.data(),N*sizeof(double));
+    in.read((char*) map->ys.data(),N*sizeof(double));
+  }
+  if( !in.good() ){
+    delete(map);
+    return NULL;
+  }
+  return map;
+}
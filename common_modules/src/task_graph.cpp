@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "task_graph.hpp"
+
+int TaskGraph::add(std::function<void()> task,std::vector<int> dependencies){
+  int id = this->nodes.size();
+  Node node;
+  node.task = task;
+  node.Ndependencies = dependencies.size();
+  this->nodes.push_back(node);
+  for(int k=0;k<dependencies.size();k++){
+    if( dependencies[k] < 0 || dependencies[k] >= id ){
+      fprintf(stderr,"Task %d can only depend on tasks added before it, not on %d!\n",id,dependencies[k]);
+      exit(1);
+    }
+    this->nodes[dependencies[k]].dependents.push_back(id);
+  }
+  return id;
+}
+
+void TaskGraph::run(int Nthreads){
+  int N = this->nodes.size();
+  if( N == 0 ){
+    return;
+  }
+  if( Nthreads <= 0 ){
+    Nthreads = std::max(1,(int) std::thread::hardware_concurrency());
+  }
+  Nthreads = std::min(Nthreads,N);
+
+  this->workers.clear();
+  for(int w=0;w<Nthreads;w++){
+    this->workers.push_back(std::unique_ptr<Worker>(new Worker()));
+  }
+  this->remaining.reset(new std::atomic<int>[N]);
+  this->pending = N;
+  this->Nready  = 0;
+  // The tasks without dependencies are dealt to the threads in turn
+  int w = 0;
+  for(int i=0;i<N;i++){
+    this->remaining[i] = this->nodes[i].Ndependencies;
+    if( this->nodes[i].Ndependencies == 0 ){
+      this->push(w,i);
+      w = (w+1) % Nthreads;
+    }
+  }
+
+  std::vector<std::thread> threads;
+  for(int w=1;w<Nthreads;w++){
+    threads.push_back( std::thread(&TaskGraph::work,this,w) );
+  }
+  this->work(0);
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+}
+
+void TaskGraph::push(int w,int id){
+  {
+    std::lock_guard<std::mutex> lock(this->workers[w]->mtx);
+    this->workers[w]->ready.push_back(id);
+  }
+  std::lock_guard<std::mutex> lock(this->wait_mtx);
+  this->Nready++;
+  this->wait_cv.notify_one();
+}
+
+bool TaskGraph::take(int w,int& id){
+  int Nthreads = this->workers.size();
+  for(int k=0;k<Nthreads;k++){
+    int v = (w+k) % Nthreads;
+    std::lock_guard<std::mutex> lock(this->workers[v]->mtx);
+    std::deque<int>& ready = this->workers[v]->ready;
+    if( !ready.empty() ){
+      if( v == w ){
+	id = ready.back();
+	ready.pop_back();
+      } else {
+	id = ready.front();
+	ready.pop_front();
+      }
+      this->Nready--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskGraph::work(int w){
+  while( true ){
+    int id;
+    if( !this->take(w,id) ){
+      std::unique_lock<std::mutex> lock(this->wait_mtx);
+      this->wait_cv.wait(lock,[this]{ return this->Nready > 0 || this->pending == 0; });
+      if( this->pending == 0 ){
+	return;
+      }
+      continue;
+    }
+
+    this->nodes[id].task();
+
+    const std::vector<int>& dependents = this->nodes[id].dependents;
+    for(int k=0;k<dependents.size();k++){
+      if( --this->remaining[dependents[k]] == 0 ){
+	this->push(w,dependents[k]);
+      }
+    }
+    if( --this->pending == 0 ){
+      std::lock_guard<std::mutex> lock(this->wait_mtx);
+      this->wait_cv.notify_all();
+      return;
+    }
+  }
+}
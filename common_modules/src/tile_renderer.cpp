@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "json/json.h"
+
+#include "vkllib.hpp"
+
+#include "tile_renderer.hpp"
+#include "fits_output.hpp"
+
+TileRenderer::TileRenderer(int tile_size,int Nthreads,double flux_floor):tile_size(tile_size),Nthreads(Nthreads),flux_floor(flux_floor){}
+
+TileRenderer::TileRenderer(const Json::Value& options){
+  // 'options' is the (optional) "render" member of "output_options" in the input json
+  this->tile_size  = options.get("tile_size",64).asInt();
+  this->Nthreads   = options.get("threads",0).asInt();
+  this->flux_floor = options.get("flux_floor",0.0).asDouble();
+}
+
+int TileRenderer::getNthreads(){
+  int N = this->Nthreads;
+  if( N <= 0 ){
+    N = std::thread::hardware_concurrency();
+  }
+  return std::max(1,std::min(N,this->Ntiles));
+}
+
+void TileRenderer::render(CollectionProfiles* collection,RectGrid* grid,double factor){
+  this->Ntiles_x = (grid->Nx + this->tile_size - 1)/this->tile_size;
+  int Ntiles_y   = (grid->Ny + this->tile_size - 1)/this->tile_size;
+  this->Ntiles   = this->Ntiles_x*Ntiles_y;
+  this->Nskipped = 0;
+  this->active.assign(this->Ntiles,true);
+
+  if( this->flux_floor > 0.0 ){
+    // Probe each tile on its corners, edge midpoints, and center
+    this->probe_max.assign(this->Ntiles,0.0);
+    this->runThreads(0,collection,grid,factor);
+
+    double global_max = *std::max_element(this->probe_max.begin(),this->probe_max.end());
+    for(int t=0;t<this->Ntiles;t++){
+      if( this->probe_max[t] < this->flux_floor*global_max ){
+	this->active[t] = false;
+	this->Nskipped++;
+      }
+    }
+  }
+
+  this->runThreads(1,collection,grid,factor);
+}
+
+void TileRenderer::renderFrame(CollectionProfiles* collection,FitsFrame* frame,int frame_tile,double factor){
+  // Out-of-core rendering: the frame is split in square tiles of 'frame_tile' pixels, each one rendered in memory (in parallel, as above) and written to the file
+  for(int i0=0;i0<frame->Ny;i0+=frame_tile){
+    for(int j0=0;j0<frame->Nx;j0+=frame_tile){
+      RectGrid* tile = frame->newTile(i0,j0,std::min(frame_tile,frame->Ny-i0),std::min(frame_tile,frame->Nx-j0));
+      this->render(collection,tile,factor);
+      frame->writeTile(i0,j0,tile);
+      delete(tile);
+    }
+  }
+}
+
+void TileRenderer::runThreads(int pass,CollectionProfiles* collection,RectGrid* grid,double factor){
+  this->next_tile = 0;
+  std::vector<std::thread> threads;
+  for(int k=0;k<this->getNthreads();k++){
+    threads.push_back( std::thread(&TileRenderer::work,this,pass,collection,grid,factor) );
+  }
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+}
+
+void TileRenderer::work(int pass,CollectionProfiles* collection,RectGrid* grid,double factor){
+  while( true ){
+    int t = this->next_tile++;
+    if( t >= this->Ntiles ){
+      break;
+    }
+    int i0 = (t/this->Ntiles_x)*this->tile_size;
+    int j0 = (t%this->Ntiles_x)*this->tile_size;
+    int i1 = std::min(i0+this->tile_size,grid->Ny);
+    int j1 = std::min(j0+this->tile_size,grid->Nx);
+
+    if( pass == 0 ){
+      int pi[3] = {i0,(i0+i1-1)/2,i1-1};
+      int pj[3] = {j0,(j0+j1-1)/2,j1-1};
+      double vmax = 0.0;
+      for(int a=0;a<3;a++){
+	for(int b=0;b<3;b++){
+	  vmax = std::max(vmax,collection->all_values(grid->center_x[pj[b]],grid->center_y[pi[a]]));
+	}
+      }
+      this->probe_max[t] = vmax;
+    } else {
+      if( this->active[t] ){
+	for(int i=i0;i<i1;i++){
+	  double* row = grid->z + i*grid->Nx;
+	  double y = grid->center_y[i];
+	  for(int j=j0;j<j1;j++){
+	    row[j] = factor*collection->all_values(grid->center_x[j],y);
+	  }
+	}
+      } else {
+	for(int i=i0;i<i1;i++){
+	  std::fill(grid->z+i*grid->Nx+j0,grid->z+i*grid->Nx+j1,0.0);
+	}
+      }
+    }
+  }
+}
@@ -1,6 +1,6 @@
 #ifndef AUX_HPP
 #define AUX_HPP
 
-double transverse_comoving_distance(double Wm,double Wr,double Wk,double Wv,double z);
+double transverse_comoving_distance(double Wk,double DCMR);
 
 #endif /* AUX_HPP */
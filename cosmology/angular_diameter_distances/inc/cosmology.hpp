@@ -0,0 +1,47 @@
+#ifndef COSMOLOGY_HPP
+#define COSMOLOGY_HPP
+
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// A flat-ish FLRW cosmology with a cached table of the radial comoving distance.
+// The table is built once per (H0,Wm) with adaptive Gauss-Kronrod integration and is then read with cubic Hermite interpolation,
+// using the exact derivative dDc/dz = 1/E(z), so that distances for any number of redshift pairs cost a table lookup each.
+class Cosmology {
+public:
+  double H0; // in km/s/Mpc
+  double Wm; // Omega matter at t=t0 (now)
+  double Wv; // Omega vacuum, or Lambda
+  double Wr; // Omega radiation, includes 3 massless neutrino species, T0 = 2.72528
+  double Wk; // Omega curvature
+  double DH; // Hubble distance c/H0, in Mpc
+
+  Cosmology(double H0,double Wm);
+  Cosmology(const Cosmology& other) = delete;
+  ~Cosmology(){};
+
+  static Cosmology* get(double H0,double Wm);
+
+  double E(double z);
+  double radialComoving(double z);     // in units of DH
+  double transverseComoving(double z); // in units of DH
+  void distances(double zl,double zs,double& Dl,double& Ds,double& Dls);
+  void distances(int N,const double* zl,const double* zs,double* Dl,double* Ds,double* Dls);
+
+private:
+  const double dz   = 0.01; // table step in redshift
+  const double zmax = 20.0; // table extent, higher redshifts are integrated directly
+  const double tol  = 1.e-12; // relative tolerance of the adaptive integration
+  std::vector<double> table_D;  // radial comoving distance at z=k*dz
+  std::vector<double> table_dD; // its derivative, 1/E(z)
+
+  static std::map<std::pair<double,double>,Cosmology*> cache;
+  static std::mutex cache_mutex;
+
+  double integrate(double za,double zb,double abs_tol,int depth);
+  double gaussKronrod(double za,double zb,double& error);
+};
+
+#endif /* COSMOLOGY_HPP */
@@ -0,0 +1,146 @@
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "cosmology.hpp"
+#include "auxiliary_functions.hpp"
+
+// Based on the python version of Ned Wright's javascript cosmology calculator by James Schombert,
+// which can be found here: http://www.astro.ucla.edu/~wright/CC.python
+
+// Nodes and weights of the 15-point Kronrod rule and the embedded 7-point Gauss rule (from QUADPACK)
+static const double xgk[8] = {
+  0.991455371120812639206854697526329,
+  0.949107912342758524526189684047851,
+  0.864864423359769072789712788640926,
+  0.741531185599394439863864773280788,
+  0.586087235467691130294144845693013,
+  0.405845151377397166906606412076961,
+  0.207784955007898467600689403773245,
+  0.000000000000000000000000000000000
+};
+static const double wgk[8] = {
+  0.022935322010529224963732008058970,
+  0.063092092629978553290700663189204,
+  0.104790010322250183839876322541518,
+  0.140653259715525918745189590510238,
+  0.169004726639267902826583426598550,
+  0.190350578064785409913256402421014,
+  0.204432940075298892414161999234649,
+  0.209482141084727828012999174891714
+};
+static const double wg[4] = {
+  0.129484966168869693270611432679082,
+  0.279705391489276667901467771423780,
+  0.381830050505118944950369775488975,
+  0.417959183673469387755102040816327
+};
+
+std::map<std::pair<double,double>,Cosmology*> Cosmology::cache;
+std::mutex Cosmology::cache_mutex;
+
+Cosmology::Cosmology(double H0,double Wm):H0(H0),Wm(Wm){
+  double c = 299792.458; // velocity of light in km/sec
+  double h = H0/100.0;
+  this->Wv = 1.0 - Wm - 0.4165/(H0*H0);
+  this->Wr = 4.165E-5/(h*h);
+  this->Wk = 1.0 - Wm - this->Wr - this->Wv;
+  this->DH = c/H0;
+
+  int N = static_cast<int>(ceil(this->zmax/this->dz)) + 1;
+  this->table_D.resize(N);
+  this->table_dD.resize(N);
+  this->table_D[0]  = 0.0;
+  this->table_dD[0] = 1.0/this->E(0.0);
+  for(int k=1;k<N;k++){
+    double za = (k-1)*this->dz;
+    double zb = k*this->dz;
+    this->table_D[k]  = this->table_D[k-1] + this->integrate(za,zb,this->tol*this->dz,0);
+    this->table_dD[k] = 1.0/this->E(zb);
+  }
+}
+
+Cosmology* Cosmology::get(double H0,double Wm){
+  // One table per cosmology, created on first request and kept for the lifetime of the process
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  std::pair<double,double> key(H0,Wm);
+  std::map<std::pair<double,double>,Cosmology*>::iterator it = cache.find(key);
+  if( it != cache.end() ){
+    return it->second;
+  }
+  Cosmology* cosmo = new Cosmology(H0,Wm);
+  cache[key] = cosmo;
+  return cosmo;
+}
+
+double Cosmology::E(double z){
+  double a = 1.0 + z;
+  return sqrt( this->Wk*a*a + this->Wm*a*a*a + this->Wr*a*a*a*a + this->Wv );
+}
+
+double Cosmology::radialComoving(double z){
+  int N = this->table_D.size();
+  int k = static_cast<int>(floor(z/this->dz));
+  if( k >= N-1 ){
+    return this->table_D[N-1] + this->integrate((N-1)*this->dz,z,this->tol*(z-(N-1)*this->dz),0);
+  }
+
+  // Cubic Hermite interpolation between the table nodes
+  double t  = z/this->dz - k;
+  double t2 = t*t;
+  double t3 = t2*t;
+  double h00 = 2.0*t3 - 3.0*t2 + 1.0;
+  double h10 = t3 - 2.0*t2 + t;
+  double h01 = -2.0*t3 + 3.0*t2;
+  double h11 = t3 - t2;
+  return h00*this->table_D[k] + h10*this->dz*this->table_dD[k] + h01*this->table_D[k+1] + h11*this->dz*this->table_dD[k+1];
+}
+
+double Cosmology::transverseComoving(double z){
+  return transverse_comoving_distance(this->Wk,this->radialComoving(z));
+}
+
+void Cosmology::distances(double zl,double zs,double& Dl,double& Ds,double& Dls){
+  double DCMT_l = this->transverseComoving(zl);
+  double DCMT_s = this->transverseComoving(zs);
+  Dl  = this->DH*DCMT_l/(1.0+zl); // in Mpc
+  Ds  = this->DH*DCMT_s/(1.0+zs); // in Mpc
+  Dls = this->DH*(DCMT_s*sqrt(1.0 + this->Wk*DCMT_l*DCMT_l) - DCMT_l*sqrt(1.0 + this->Wk*DCMT_s*DCMT_s))/(1.0+zs); // in Mpc
+}
+
+void Cosmology::distances(int N,const double* zl,const double* zs,double* Dl,double* Ds,double* Dls){
+  for(int i=0;i<N;i++){
+    this->distances(zl[i],zs[i],Dl[i],Ds[i],Dls[i]);
+  }
+}
+
+double Cosmology::gaussKronrod(double za,double zb,double& error){
+  double center = 0.5*(za+zb);
+  double half   = 0.5*(zb-za);
+  double fc = 1.0/this->E(center);
+  double result_k = wgk[7]*fc;
+  double result_g = wg[3]*fc;
+  for(int j=0;j<7;j++){
+    double dx = half*xgk[j];
+    double f  = 1.0/this->E(center-dx) + 1.0/this->E(center+dx);
+    result_k += wgk[j]*f;
+    if( j%2 == 1 ){
+      result_g += wg[j/2]*f;
+    }
+  }
+  error = fabs((result_k-result_g)*half);
+  return result_k*half;
+}
+
+double Cosmology::integrate(double za,double zb,double abs_tol,int depth){
+  // Adaptive bisection of the interval until the Gauss-Kronrod error estimate is below the tolerance
+  double error;
+  double result = this->gaussKronrod(za,zb,error);
+  if( error <= abs_tol || depth >= 30 ){
+    return result;
+  }
+  double zm = 0.5*(za+zb);
+  return this->integrate(za,zm,0.5*abs_tol,depth+1) + this->integrate(zm,zb,0.5*abs_tol,depth+1);
+}
@@ -1,7 +1,11 @@
 #ifndef INSTRUMENT_HPP
 #define INSTRUMENT_HPP
 
+#include <cstdint>
+#include <map>
+#include <mutex>
 #include <string>
+#include <vector>
 #include "json/json.h"
 
 class RectGrid;
@@ -28,19 +32,62 @@ public:
   RectGrid* original_psf = NULL;
   RectGrid* scaled_psf   = NULL;
   RectGrid* cropped_psf  = NULL;
-  double* kernel           = NULL;
+  // Field-dependent PSF: psf(x,y) = psf + sum_k c_k(x,y)*basis_k, with the basis at the same stages as the PSF above
+  std::vector<RectGrid*> original_basis;
+  std::vector<RectGrid*> scaled_basis;
+  std::vector<RectGrid*> cropped_basis;
   BaseNoise* noise         = NULL;
+  bool single_precision    = false; // convolve in float instead of double
   
   Instrument(std::string name,Json::Value noise_pars);
   ~Instrument();
 
   static double getResolution(std::string name);
+  static Json::Value getSpecs(std::string name);
   std::string getName();
+  bool varyingPSF();
+  double basisCoefficient(int k,double x,double y);
+  RectGrid* psfAtPosition(double x,double y);
   void interpolatePSF(RectGrid* grid);
   void cropPSF(double threshold);
+  void integratePSF(int factor);
+  void copyPSF(Instrument* other);
+  void blurPSF(double fwhm);
   void createKernel(int Nx,int Ny);
   void convolve(RectGrid* grid);
+  bool readPSFCache(std::string filename,std::string recipe);
+  void writePSFCache(std::string filename,std::string recipe);
   offsetPSF offsetPSFtoPosition(double x,double y,RectGrid* grid);
+  offsetPSF offsetPSFtoPosition(double x,double y,int Nx_img,int Ny_img,double w_img,double h_img);
+
+private:
+  // Each cached value is kept with the stamp (modification time and size) of its files, and read again when they change, e.g. in a long-running server (see molet_server)
+  static std::map<std::string,std::pair<std::string,Json::Value> > specs_cache;
+  static std::map<std::string,std::pair<std::string,std::vector<double> > > image_cache; // the PSF and basis images
+  static std::map<std::string,std::pair<std::string,uint64_t> > files_hash_cache;        // the hash of the files of each instrument, see psfKey
+  static std::mutex specs_mutex;
+  std::vector<std::vector<double> > basis_coefficients; // polynomial coefficients of each c_k(x,y): 1, x, y, x^2, xy, y^2, ...
+  int basis_degree = 0;
+  std::vector<double*> kernels;  // one for the PSF and one for each basis component
+  std::vector<void*> kernel_fft; // transforms of the kernels, in the precision of the convolution
+  bool kernel_fft_single = false;
+  int kernel_Nx = 0;
+  int kernel_Ny = 0;
+  void* plan_r2c = NULL; // the FFTW plans of the convolution, in the precision of plan_single
+  void* plan_c2r = NULL;
+  int plan_Nx = 0;
+  int plan_Ny = 0;
+  bool plan_single = false;
+
+  static RectGrid* readImage(std::string filename,int Nx,int Ny,double width,double height);
+  template<typename T> void convolveFFT(RectGrid* grid);
+  template<typename T> void convolveBuffer(T* image,int Nx,int Ny,void* f_kernel);
+  template<typename T> void transformKernel();
+  template<typename T> void preparePlans(int Nx,int Ny);
+  void freePlans();
+  void freeKernels();
+  void freeKernelFFT();
+  uint64_t psfKey(std::string recipe);
 };
 
 #endif /* INSTRUMENT_HPP */
@@ -14,13 +14,18 @@ public:
   int seed = 123;
   BaseNoise(){};
   ~BaseNoise(){};
-  virtual void addNoise(RectGrid* mydata) = 0;
+  void addNoise(RectGrid* mydata);
+  double generateNoise(double* z,long N,double zmax);
+  // Adds the noise to the N values of z, whose maximum is zmax, and returns the offset (e.g. to keep the values positive) that remains to be added to all of them.
+  // This lets the caller fuse the offset with another pass over the image.
+  // The random numbers depend only on the given seed (no global state), so any image can be reproduced independently of the others.
+  virtual double seededNoise(double* z,long N,double zmax,long seed) = 0;
 };
 
 class NoNoise: public BaseNoise {
 public:
   NoNoise();
-  void addNoise(RectGrid* mydata);
+  double seededNoise(double* z,long N,double zmax,long seed);
 };
 
 class UniformGaussian: public BaseNoise {
@@ -28,7 +33,7 @@ public:
   const double two_pi = 2.0*M_PI;
   double sn; // signal to noise ratio
   UniformGaussian(double sn);
-  void addNoise(RectGrid* mydata);
+  double seededNoise(double* z,long N,double zmax,long seed);
 };
 
 class FactoryNoiseModel{//This is a singleton class.
@@ -1,7 +1,14 @@
 #include <fftw3.h>
 #include <algorithm>
+#include <cstring>
 #include <string>
 #include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "vkllib.hpp"
 #include "json/json.h"
@@ -10,6 +17,172 @@
 #include "noise.hpp"
 
 std::string Instrument::path = INSTRUMENT_PATH;
+std::map<std::string,std::pair<std::string,Json::Value> > Instrument::specs_cache;
+std::map<std::string,std::pair<std::string,std::vector<double> > > Instrument::image_cache;
+std::map<std::string,std::pair<std::string,uint64_t> > Instrument::files_hash_cache;
+std::mutex Instrument::specs_mutex;
+
+// 64-bit FNV-1a, stable across runs and platforms (unlike std::hash)
+static uint64_t hashBytes(uint64_t h,const void* data,size_t size){
+  const unsigned char* p = (const unsigned char*) data;
+  for(size_t i=0;i<size;i++){
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// The modification time (to the nanosecond) and size of a file, empty if it does not exist
+static std::string fileStamp(std::string filename){
+  struct stat st;
+  if( stat(filename.c_str(),&st) != 0 ){
+    return "";
+  }
+  return std::to_string((long long) st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + ":" + std::to_string((long long) st.st_size);
+}
+
+static const char psf_cache_magic[8] = {'M','O','L','P','S','F','C','2'};
+
+// Bilinear interpolation of a PSF on a Nx x Ny grid of the given pixel size, starting at the given offset from the corner of the PSF
+static RectGrid* resamplePSF(RectGrid* psf,int newNx,int newNy,double newPixSize,double xoffset,double yoffset){
+  double origPixSize = psf->width/psf->Nx;
+  RectGrid* scaled = new RectGrid(newNx,newNy,0,newNx*newPixSize,0,newNy*newPixSize);
+  double x,y,xp,yp,dx,dy,ddx,ddy,w00,w10,w01,w11,f00,f10,f01,f11;
+  int ii,jj;
+  
+  for(int i=0;i<scaled->Ny;i++){
+    y  = yoffset+i*newPixSize;
+    ii = floor( y/origPixSize );
+    yp = ii*origPixSize;
+    dy = (y - yp)/origPixSize;
+    ddy = (1.0 - dy);
+    
+    for(int j=0;j<scaled->Nx;j++){
+      x  = xoffset+j*newPixSize;
+      jj = floor( x/origPixSize );
+      xp = jj*origPixSize;
+      dx = (x - xp)/origPixSize;
+      ddx = (1.0 - dx);
+      
+      // first index: i (y direction) second index: j (x direction)
+      w00 = ddx*ddy;
+      w01 = dx*ddy;
+      w10 = dy*ddx;
+      w11 = dx*dy;
+      
+      f00 = psf->z[ii*psf->Nx+jj];
+      f01 = psf->z[ii*psf->Nx+jj+1];
+      f10 = psf->z[(ii+1)*psf->Nx+jj];
+      f11 = psf->z[(ii+1)*psf->Nx+jj+1];
+      
+      scaled->z[i*scaled->Nx+j] = f00*w00 + f10*w10 + f01*w01 + f11*w11;
+    }
+  }
+  return scaled;
+}
+
+// The centered Ncrop x Ncrop window of a PSF
+static RectGrid* cropCenter(RectGrid* psf,int Ncrop){
+  int i0 = psf->Ny/2 - Ncrop/2;
+  int j0 = psf->Nx/2 - Ncrop/2;
+  double psf_pix_size_x = psf->width/psf->Nx;
+  double psf_pix_size_y = psf->height/psf->Ny;
+  RectGrid* cropped = new RectGrid(Ncrop,Ncrop,0,Ncrop*psf_pix_size_x,0,Ncrop*psf_pix_size_y);
+  for(int i=0;i<Ncrop;i++){
+    for(int j=0;j<Ncrop;j++){
+      cropped->z[i*Ncrop+j] = psf->z[(i0+i)*psf->Nx+j0+j];
+    }
+  }
+  return cropped;
+}
+
+// A copy of a PSF, with the same pixels
+static RectGrid* copyPSFGrid(RectGrid* psf){
+  RectGrid* copy = new RectGrid(psf->Nx,psf->Ny,0,psf->width,0,psf->height);
+  for(int i=0;i<psf->Nz;i++){
+    copy->z[i] = psf->z[i];
+  }
+  return copy;
+}
+
+// The integral of a PSF over pixels 'factor' times larger, centered on the same pixel
+static RectGrid* integrateBlocks(RectGrid* psf,int factor){
+  int bNx = psf->Nx/2;
+  int bNy = psf->Ny/2;
+  int Kx  = (bNx + factor/2 + factor - 1)/factor;
+  int Ky  = (bNy + factor/2 + factor - 1)/factor;
+  double dx = psf->width/psf->Nx;
+  double dy = psf->height/psf->Ny;
+
+  RectGrid* integrated = new RectGrid(2*Kx,2*Ky,0,2*Kx*factor*dx,0,2*Ky*factor*dy);
+  for(int i=0;i<integrated->Nz;i++){
+    integrated->z[i] = 0.0;
+  }
+  for(int i=0;i<psf->Ny;i++){
+    int ii = Ky + (int) floor( (i - bNy + factor/2)/(double) factor );
+    for(int j=0;j<psf->Nx;j++){
+      int jj = Kx + (int) floor( (j - bNx + factor/2)/(double) factor );
+      integrated->z[ii*integrated->Nx+jj] += psf->z[i*psf->Nx+j];
+    }
+  }
+  return integrated;
+}
+
+// A PSF convolved with a circular Gaussian of the given standard deviation (in pixels), extended by 'pad' pixels on each side
+static RectGrid* blurGaussian(RectGrid* psf,double sigma,int pad){
+  std::vector<double> g(2*pad+1);
+  double sum = 0.0;
+  for(int k=-pad;k<=pad;k++){
+    g[k+pad] = exp(-0.5*k*k/(sigma*sigma));
+    sum += g[k+pad];
+  }
+  for(int k=0;k<g.size();k++){
+    g[k] /= sum;
+  }
+
+  int Nx = psf->Nx + 2*pad;
+  int Ny = psf->Ny + 2*pad;
+  double dx = psf->width/psf->Nx;
+  double dy = psf->height/psf->Ny;
+  // Separable: along the rows into a buffer, and then along the columns
+  std::vector<double> rows(psf->Ny*Nx,0.0);
+  for(int i=0;i<psf->Ny;i++){
+    for(int j=0;j<psf->Nx;j++){
+      double f = psf->z[i*psf->Nx+j];
+      for(int k=0;k<g.size();k++){
+	rows[i*Nx+j+k] += f*g[k];
+      }
+    }
+  }
+  RectGrid* blurred = new RectGrid(Nx,Ny,0,Nx*dx,0,Ny*dy);
+  for(int i=0;i<blurred->Nz;i++){
+    blurred->z[i] = 0.0;
+  }
+  for(int i=0;i<psf->Ny;i++){
+    for(int k=0;k<g.size();k++){
+      for(int j=0;j<Nx;j++){
+	blurred->z[(i+k)*Nx+j] += rows[i*Nx+j]*g[k];
+      }
+    }
+  }
+  return blurred;
+}
+
+// The PSF wrapped around the corners of a Nx x Ny image, i.e. centered on the first pixel of a circular convolution
+static double* wrapKernel(RectGrid* psf,int Nx,int Ny){
+  int bNx = psf->Nx/2.0;
+  int bNy = psf->Ny/2.0;
+  double* kernel = (double*) calloc(Nx*Ny,sizeof(double));
+  for(int j=0;j<bNy;j++){
+    for(int i=0;i<bNx;i++){
+      kernel[j*Ny+i]                    = psf->z[bNy*2*bNx+bNx+j*2*bNx+i];
+      kernel[Ny-bNx+j*Ny+i]             = psf->z[bNy*2*bNx+j*2*bNx+i];
+      kernel[Ny*(Nx-bNy)+j*Ny+i]        = psf->z[bNx+2*bNx*j+i];
+      kernel[Ny*(Nx-bNy)+Ny-bNx+j*Ny+i] = psf->z[2*bNx*j+i];
+    }
+  }
+  return kernel;
+}
 
 // START:OFFSETPSF =================================================================================================
 void offsetPSF::print(){
@@ -45,11 +218,7 @@ void offsetPSF::printFrame(FILE* fh,int Nx,int Ny,double w,double h){
 // START:INSTRUMENT =================================================================================================
 Instrument::Instrument(std::string name,Json::Value noise_pars):name(name){
   std::string full_path = this->path + this->name + "/";
-
-  Json::Value specs;
-  std::ifstream fin(full_path+"specs.json",std::ifstream::in);
-  fin >> specs;
-  fin.close();
+  Json::Value specs = getSpecs(name);
 
   this->lambda_min = specs["lambda_min"].asDouble();
   this->lambda_max = specs["lambda_max"].asDouble();
@@ -59,7 +228,31 @@ Instrument::Instrument(std::string name,Json::Value noise_pars):name(name){
   int pix_y  = specs["psf"]["pix_y"].asInt();
   int width  = specs["psf"]["width"].asDouble();
   int height = specs["psf"]["height"].asDouble();
-  this->original_psf = new RectGrid(pix_x,pix_y,0,width,0,height,full_path+"psf.fits");
+  this->original_psf = readImage(full_path+"psf.fits",pix_x,pix_y,width,height);
+
+  // Optional field-dependent part of the PSF: a basis (e.g. the principal components of the PSF across the field), with the same pixels as psf.fits,
+  // and the coefficient of each component as a polynomial of the position in the field of view (in arcsec)
+  if( specs["psf"].isMember("variation") ){
+    const Json::Value variation = specs["psf"]["variation"];
+    this->basis_degree = variation["degree"].asInt();
+    int Ncoeffs = (this->basis_degree+1)*(this->basis_degree+2)/2;
+    if( variation["basis"].size() != variation["coefficients"].size() ){
+      fprintf(stderr,"The PSF variation of instrument '%s' has %d basis components but %d sets of coefficients!\n",name.c_str(),variation["basis"].size(),variation["coefficients"].size());
+      exit(1);
+    }
+    for(int k=0;k<variation["basis"].size();k++){
+      if( variation["coefficients"][k].size() != Ncoeffs ){
+	fprintf(stderr,"The PSF basis component %d of instrument '%s' needs %d polynomial coefficients (degree %d), not %d!\n",k,name.c_str(),Ncoeffs,this->basis_degree,variation["coefficients"][k].size());
+	exit(1);
+      }
+      this->original_basis.push_back( readImage(full_path+variation["basis"][k].asString(),pix_x,pix_y,width,height) );
+      std::vector<double> coeffs(Ncoeffs);
+      for(int c=0;c<Ncoeffs;c++){
+	coeffs[c] = variation["coefficients"][k][c].asDouble();
+      }
+      this->basis_coefficients.push_back(coeffs);
+    }
+  }
 
   this->noise = FactoryNoiseModel::getInstance()->createNoiseModel(noise_pars);
 }
@@ -68,18 +261,55 @@ Instrument::~Instrument(){
   delete(original_psf);
   delete(scaled_psf);
   delete(cropped_psf);
-  free(kernel);
+  for(int k=0;k<this->original_basis.size();k++){
+    delete(this->original_basis[k]);
+  }
+  for(int k=0;k<this->scaled_basis.size();k++){
+    delete(this->scaled_basis[k]);
+  }
+  for(int k=0;k<this->cropped_basis.size();k++){
+    delete(this->cropped_basis[k]);
+  }
+  this->freeKernels();
+  this->freeKernelFFT();
+  this->freePlans();
   delete(noise);
 }
 
-double Instrument::getResolution(std::string name){
+Json::Value Instrument::getSpecs(std::string name){
+  // The specs.json file of each instrument is read only once per process, unless it changes
+  std::string filename = path + name + "/specs.json";
+  std::string stamp = fileStamp(filename);
+  std::lock_guard<std::mutex> lock(specs_mutex);
+  std::map<std::string,std::pair<std::string,Json::Value> >::iterator it = specs_cache.find(name);
+  if( it != specs_cache.end() && it->second.first == stamp ){
+    return it->second.second;
+  }
   Json::Value specs;
-  
-  std::ifstream fin(path + name + "/specs.json",std::ifstream::in);
+  std::ifstream fin(filename,std::ifstream::in);
   fin >> specs;
   fin.close();
+  specs_cache[name] = std::make_pair(stamp,specs);
+  return specs;
+}
 
-  double res = specs["resolution"].asDouble();
+RectGrid* Instrument::readImage(std::string filename,int Nx,int Ny,double width,double height){
+  // Like specs.json, the PSF images are read only once per process unless they change, e.g. a server running many simulations (see molet_server)
+  std::string stamp = fileStamp(filename);
+  std::lock_guard<std::mutex> lock(specs_mutex);
+  std::map<std::string,std::pair<std::string,std::vector<double> > >::iterator it = image_cache.find(filename);
+  if( it != image_cache.end() && it->second.first == stamp && it->second.second.size() == Nx*Ny ){
+    RectGrid* image = new RectGrid(Nx,Ny,0,width,0,height);
+    std::copy(it->second.second.begin(),it->second.second.end(),image->z);
+    return image;
+  }
+  RectGrid* image = new RectGrid(Nx,Ny,0,width,0,height,filename);
+  image_cache[filename] = std::make_pair(stamp,std::vector<double>(image->z,image->z+image->Nz));
+  return image;
+}
+
+double Instrument::getResolution(std::string name){
+  double res = getSpecs(name)["resolution"].asDouble();
   return res;
 }
 
@@ -87,10 +317,47 @@ std::string Instrument::getName(){
   return this->name;
 }
 
+bool Instrument::varyingPSF(){
+  return !this->original_basis.empty();
+}
+
+double Instrument::basisCoefficient(int k,double x,double y){
+  // The terms are ordered by degree: 1, x, y, x^2, xy, y^2, x^3, ...
+  std::vector<double> xp(this->basis_degree+1,1.0);
+  std::vector<double> yp(this->basis_degree+1,1.0);
+  for(int d=1;d<=this->basis_degree;d++){
+    xp[d] = xp[d-1]*x;
+    yp[d] = yp[d-1]*y;
+  }
+  const std::vector<double>& c = this->basis_coefficients[k];
+  double value = 0.0;
+  int n = 0;
+  for(int d=0;d<=this->basis_degree;d++){
+    for(int j=0;j<=d;j++){
+      value += c[n++]*xp[d-j]*yp[j];
+    }
+  }
+  return value;
+}
+
+RectGrid* Instrument::psfAtPosition(double x,double y){
+  // The cropped PSF at the given position in the field of view, with the same pixels as cropped_psf
+  RectGrid* psf = new RectGrid(this->cropped_psf->Nx,this->cropped_psf->Ny,0,this->cropped_psf->width,0,this->cropped_psf->height);
+  for(int i=0;i<psf->Nz;i++){
+    psf->z[i] = this->cropped_psf->z[i];
+  }
+  for(int k=0;k<this->cropped_basis.size();k++){
+    double c = this->basisCoefficient(k,x,y);
+    for(int i=0;i<psf->Nz;i++){
+      psf->z[i] += c*this->cropped_basis[k]->z[i];
+    }
+  }
+  return psf;
+}
+
 void Instrument::interpolatePSF(RectGrid* grid){
   //    double newPixSize  = (mydata->xmax - mydata->xmin)/mydata->Nj;
   double newPixSize  = (grid->width)/(grid->Nx);
-  double origPixSize = this->original_psf->width/this->original_psf->Nx;
   
   // Decide on the profile width and height in pixels based on the input profile
   int newNx,newNy;
@@ -107,153 +374,506 @@ void Instrument::interpolatePSF(RectGrid* grid){
   double newh    = newNy*newPixSize;
   double yoffset = (this->original_psf->height - newh)/2.0;
   
-  this->scaled_psf = new RectGrid(newNx,newNy,0,neww,0,newh);
- 
+  delete(this->scaled_psf);
+  this->scaled_psf = resamplePSF(this->original_psf,newNx,newNy,newPixSize,xoffset,yoffset);
+  for(int k=0;k<this->scaled_basis.size();k++){
+    delete(this->scaled_basis[k]);
+  }
+  this->scaled_basis.resize(this->original_basis.size());
+  for(int k=0;k<this->original_basis.size();k++){
+    this->scaled_basis[k] = resamplePSF(this->original_basis[k],newNx,newNy,newPixSize,xoffset,yoffset);
+  }
+
+  // The basis components are scaled together with the PSF, so that the PSF at any position remains normalized
   double sum = 0.0;
-  double x,y,xp,yp,dx,dy,ddx,ddy,w00,w10,w01,w11,f00,f10,f01,f11;
-  int ii,jj;
-  
-  for(int i=0;i<this->scaled_psf->Ny;i++){
-    y  = yoffset+i*newPixSize;
-    ii = floor( y/origPixSize );
-    yp = ii*origPixSize;
-    dy = (y - yp)/origPixSize;
-    ddy = (1.0 - dy);
-    
-    for(int j=0;j<this->scaled_psf->Nx;j++){
-      x  = xoffset+j*newPixSize;
-      jj = floor( x/origPixSize );
-      xp = jj*origPixSize;
-      dx = (x - xp)/origPixSize;
-      ddx = (1.0 - dx);
-      
-      // first index: i (y direction) second index: j (x direction)
-      w00 = ddx*ddy;
-      w01 = dx*ddy;
-      w10 = dy*ddx;
-      w11 = dx*dy;
-      
-      f00 = this->original_psf->z[ii*this->original_psf->Nx+jj];
-      f01 = this->original_psf->z[ii*this->original_psf->Nx+jj+1];
-      f10 = this->original_psf->z[(ii+1)*this->original_psf->Nx+jj];
-      f11 = this->original_psf->z[(ii+1)*this->original_psf->Nx+jj+1];
-      
-      this->scaled_psf->z[i*this->scaled_psf->Nx+j] = f00*w00 + f10*w10 + f01*w01 + f11*w11;
-      sum += this->scaled_psf->z[i*this->scaled_psf->Nx+j];
-    }
+  for(int i=0;i<this->scaled_psf->Nz;i++){
+    sum += this->scaled_psf->z[i];
   }
-  
   for(int i=0;i<this->scaled_psf->Nz;i++){
     this->scaled_psf->z[i] /= sum;
   }
-  
+  for(int k=0;k<this->scaled_basis.size();k++){
+    for(int i=0;i<this->scaled_basis[k]->Nz;i++){
+      this->scaled_basis[k]->z[i] /= sum;
+    }
+  }
 }
 
 
 void Instrument::cropPSF(double threshold){
-  int Ncropx = 50;
-  int Ncropy = 50;
-
-  double* blur = NULL;
-  while( true ){
-    int loffx = floor(Ncropx/2.0);
-    int toffy = floor(Ncropy/2.0);
-    double sum = 0.0;
-    blur = (double*) calloc(Ncropx*Ncropy,sizeof(double));
-    int offset = (floor(this->scaled_psf->Ny/2.0)-toffy)*this->scaled_psf->Ny + (floor(this->scaled_psf->Nx/2.0)-loffx);
-    for(int i=0;i<Ncropy;i++){
-      for(int j=0;j<Ncropx;j++){
-	blur[i*Ncropx+j] = this->scaled_psf->z[offset+i*this->scaled_psf->Ny+j];
-	sum += blur[i*Ncropx+j];
-      }
+  // The smallest centered window, starting from 50x50 pixels and growing by 2, that contains at least 'threshold' of the PSF.
+  // The window sums are read from a summed-area table, so each size costs the same whatever the window.
+  // The sizes are scanned in increasing order: a PSF with negative pixels (e.g. drizzled or deconvolved) does not enclose more flux in every larger window.
+  int Nx = this->scaled_psf->Nx;
+  int Ny = this->scaled_psf->Ny;
+  double* z = this->scaled_psf->z;
+  std::vector<double> table((Nx+1)*(Ny+1),0.0);
+  for(int i=0;i<Ny;i++){
+    for(int j=0;j<Nx;j++){
+      table[(i+1)*(Nx+1)+j+1] = z[i*Nx+j] + table[i*(Nx+1)+j+1] + table[(i+1)*(Nx+1)+j] - table[i*(Nx+1)+j];
     }
+  }
+  auto windowSum = [&](int N){
+    int i0 = Ny/2 - N/2;
+    int j0 = Nx/2 - N/2;
+    return table[(i0+N)*(Nx+1)+j0+N] - table[i0*(Nx+1)+j0+N] - table[(i0+N)*(Nx+1)+j0] + table[i0*(Nx+1)+j0];
+  };
+
+  // Window sizes 50+2k, for k in [0,kmax], that fit in the scaled PSF
+  int Nmax = 2*std::min(Nx/2,Ny/2);
+  int kmax = std::max(0,(Nmax-50)/2);
+  int Nmin = std::min(50,Nmax);
+  int Ncrop = Nmin;
+  while( Ncrop < Nmin+2*kmax && windowSum(Ncrop) < threshold ){
+    Ncrop += 2;
+  }
 
-    //std::cout << sum << std::endl;
-    if( sum < threshold ){
-      Ncropx += 2;
-      Ncropy += 2;
-      free(blur);
-    } else {
-      break;
-    }
+  // The basis components are cropped to the same window as the PSF
+  delete(this->cropped_psf);
+  this->cropped_psf = cropCenter(this->scaled_psf,Ncrop);
+  for(int k=0;k<this->cropped_basis.size();k++){
+    delete(this->cropped_basis[k]);
+  }
+  this->cropped_basis.resize(this->scaled_basis.size());
+  for(int k=0;k<this->scaled_basis.size();k++){
+    this->cropped_basis[k] = cropCenter(this->scaled_basis[k],Ncrop);
+  }
+}
+
+
+void Instrument::integratePSF(int factor){
+  // Replace the cropped PSF (at super-resolution) by its integral over pixels 'factor' times larger, centered on the same pixel.
+  // Convolving an image integrated over the observed pixels with this PSF approximates convolving in super-resolution and binning:
+  // it is exact only if the flux within each observed pixel is at its center, and the error grows with the gradients of the image and of the PSF across a pixel.
+  RectGrid* integrated = integrateBlocks(this->cropped_psf,factor);
+  delete(this->cropped_psf);
+  this->cropped_psf = integrated;
+  for(int k=0;k<this->cropped_basis.size();k++){
+    integrated = integrateBlocks(this->cropped_basis[k],factor);
+    delete(this->cropped_basis[k]);
+    this->cropped_basis[k] = integrated;
   }
+}
 
+void Instrument::copyPSF(Instrument* other){
+  // The cropped PSF (and its basis) of another instance of the same instrument, as prepared there, e.g. to be blurred differently without preparing it again.
+  // The kernels need to be created again.
+  delete(this->cropped_psf);
+  this->cropped_psf = copyPSFGrid(other->cropped_psf);
+  for(int k=0;k<this->cropped_basis.size();k++){
+    delete(this->cropped_basis[k]);
+  }
+  this->cropped_basis.clear();
+  for(int k=0;k<other->cropped_basis.size();k++){
+    this->cropped_basis.push_back( copyPSFGrid(other->cropped_basis[k]) );
+  }
+  this->freeKernels();
+  this->freeKernelFFT();
+}
 
-  double psf_pix_size_x = this->scaled_psf->width/this->scaled_psf->Nx;
-  double psf_pix_size_y = this->scaled_psf->height/this->scaled_psf->Ny;
-  this->cropped_psf = new RectGrid(Ncropx,Ncropy,0,Ncropx*psf_pix_size_x,0,Ncropy*psf_pix_size_y);
-  for(int i=0;i<this->cropped_psf->Nz;i++){
-    this->cropped_psf->z[i] = blur[i];
+void Instrument::blurPSF(double fwhm){
+  // Convolve the cropped PSF (and its basis) with the Gaussian blur of the atmosphere, of the given FWHM in arcsec.
+  // The PSF is extended by 3 sigma on each side, and the kernels need to be created again.
+  if( fwhm <= 0.0 ){
+    return;
   }
-  free(blur);
+  double sigma = fwhm/(2.0*sqrt(2.0*log(2.0)))/(this->cropped_psf->width/this->cropped_psf->Nx);
+  int pad = static_cast<int>(ceil(3.0*sigma));
+  RectGrid* blurred = blurGaussian(this->cropped_psf,sigma,pad);
+  delete(this->cropped_psf);
+  this->cropped_psf = blurred;
+  for(int k=0;k<this->cropped_basis.size();k++){
+    blurred = blurGaussian(this->cropped_basis[k],sigma,pad);
+    delete(this->cropped_basis[k]);
+    this->cropped_basis[k] = blurred;
+  }
+  this->freeKernels();
+  this->freeKernelFFT();
 }
 
 void Instrument::createKernel(int Nx,int Ny){
-  int bNx = this->cropped_psf->Nx/2.0;
-  int bNy = this->cropped_psf->Ny/2.0;
-  this->kernel = (double*) calloc(Nx*Ny,sizeof(double));
-  for(int j=0;j<bNy;j++){
-    for(int i=0;i<bNx;i++){
-      this->kernel[j*Ny+i]                    = this->cropped_psf->z[bNy*2*bNx+bNx+j*2*bNx+i];
-      this->kernel[Ny-bNx+j*Ny+i]             = this->cropped_psf->z[bNy*2*bNx+j*2*bNx+i];
-      this->kernel[Ny*(Nx-bNy)+j*Ny+i]        = this->cropped_psf->z[bNx+2*bNx*j+i];
-      this->kernel[Ny*(Nx-bNy)+Ny-bNx+j*Ny+i] = this->cropped_psf->z[2*bNx*j+i];
-    }
+  this->freeKernels();
+  this->freeKernelFFT();
+  this->kernel_Nx = Nx;
+  this->kernel_Ny = Ny;
+  this->kernels.push_back( wrapKernel(this->cropped_psf,Nx,Ny) );
+  for(int k=0;k<this->cropped_basis.size();k++){
+    this->kernels.push_back( wrapKernel(this->cropped_basis[k],Nx,Ny) );
+  }
+}
+
+void Instrument::freeKernels(){
+  for(int k=0;k<this->kernels.size();k++){
+    free(this->kernels[k]);
   }
+  this->kernels.clear();
 }
 
 
+// The FFTW interface for each precision: fftw_* for double and fftwf_* for float
+// Only the execution of plans is thread-safe in FFTW, so their creation and destruction are serialized (several instruments can be processed at the same time, see combine_light)
+// The plans are made once per instrument and size (see Instrument::preparePlans) and executed on the arrays of each call, which need not be aligned as the ones they were made for
+static std::mutex fftw_planner_mutex;
+template<typename T> struct FFTW;
+template<> struct FFTW<double> {
+  typedef fftw_complex complex;
+  typedef fftw_plan plan;
+  static void* malloc(size_t n){ return fftw_malloc(n); }
+  static void free(void* p){ fftw_free(p); }
+  static plan r2c(int n0,int n1,double* in,complex* out){ std::lock_guard<std::mutex> lock(fftw_planner_mutex); return fftw_plan_dft_r2c_2d(n0,n1,in,out,FFTW_ESTIMATE|FFTW_UNALIGNED); }
+  static plan c2r(int n0,int n1,complex* in,double* out){ std::lock_guard<std::mutex> lock(fftw_planner_mutex); return fftw_plan_dft_c2r_2d(n0,n1,in,out,FFTW_ESTIMATE|FFTW_UNALIGNED); }
+  static void execute(plan p,double* in,complex* out){ fftw_execute_dft_r2c(p,in,out); }
+  static void execute(plan p,complex* in,double* out){ fftw_execute_dft_c2r(p,in,out); }
+  static void destroy(plan p){ std::lock_guard<std::mutex> lock(fftw_planner_mutex); fftw_destroy_plan(p); }
+};
+template<> struct FFTW<float> {
+  typedef fftwf_complex complex;
+  typedef fftwf_plan plan;
+  static void* malloc(size_t n){ return fftwf_malloc(n); }
+  static void free(void* p){ fftwf_free(p); }
+  static plan r2c(int n0,int n1,float* in,complex* out){ std::lock_guard<std::mutex> lock(fftw_planner_mutex); return fftwf_plan_dft_r2c_2d(n0,n1,in,out,FFTW_ESTIMATE|FFTW_UNALIGNED); }
+  static plan c2r(int n0,int n1,complex* in,float* out){ std::lock_guard<std::mutex> lock(fftw_planner_mutex); return fftwf_plan_dft_c2r_2d(n0,n1,in,out,FFTW_ESTIMATE|FFTW_UNALIGNED); }
+  static void execute(plan p,float* in,complex* out){ fftwf_execute_dft_r2c(p,in,out); }
+  static void execute(plan p,complex* in,float* out){ fftwf_execute_dft_c2r(p,in,out); }
+  static void destroy(plan p){ std::lock_guard<std::mutex> lock(fftw_planner_mutex); fftwf_destroy_plan(p); }
+};
+
+template<typename T>
+void Instrument::preparePlans(int Nx,int Ny){
+  // The pair of plans of a Nx x Ny convolution, made on temporary arrays the first time and kept for all the following ones (e.g. the tiles of the out-of-core mode)
+  typedef FFTW<T> fft;
+  bool single = (sizeof(T) == sizeof(float));
+  if( this->plan_r2c != NULL && this->plan_Nx == Nx && this->plan_Ny == Ny && this->plan_single == single ){
+    return;
+  }
+  this->freePlans();
+  long N  = (long) Nx*Ny;
+  long Nc = (long) Nx*(Ny/2+1);
+  T* real = (T*) fft::malloc(N*sizeof(T));
+  typename fft::complex* complex = (typename fft::complex*) fft::malloc(Nc*sizeof(typename fft::complex));
+  this->plan_r2c = (void*) fft::r2c(Nx,Ny,real,complex);
+  this->plan_c2r = (void*) fft::c2r(Nx,Ny,complex,real);
+  fft::free(real);
+  fft::free(complex);
+  this->plan_Nx = Nx;
+  this->plan_Ny = Ny;
+  this->plan_single = single;
+}
+
+void Instrument::freePlans(){
+  if( this->plan_r2c == NULL ){
+    return;
+  }
+  if( this->plan_single ){
+    FFTW<float>::destroy((fftwf_plan) this->plan_r2c);
+    FFTW<float>::destroy((fftwf_plan) this->plan_c2r);
+  } else {
+    FFTW<double>::destroy((fftw_plan) this->plan_r2c);
+    FFTW<double>::destroy((fftw_plan) this->plan_c2r);
+  }
+  this->plan_r2c = NULL;
+  this->plan_c2r = NULL;
+}
+
 void Instrument::convolve(RectGrid* grid){
-  int Nx = grid->Nx;
-  int Ny = grid->Ny;
+  if( this->single_precision ){
+    this->convolveFFT<float>(grid);
+  } else {
+    this->convolveFFT<double>(grid);
+  }
+}
+
+void Instrument::freeKernelFFT(){
+  for(int k=0;k<this->kernel_fft.size();k++){
+    if( this->kernel_fft_single ){
+      fftwf_free(this->kernel_fft[k]);
+    } else {
+      fftw_free(this->kernel_fft[k]);
+    }
+  }
+  this->kernel_fft.clear();
+}
+
+template<typename T>
+void Instrument::transformKernel(){
+  // The kernels are transformed once, on the first convolution, and only their transforms are kept
+  typedef FFTW<T> fft;
+  int Nx = this->kernel_Nx;
+  int Ny = this->kernel_Ny;
+  long N  = (long) Nx*Ny;
+  long Nc = (long) Nx*(Ny/2+1);
+  if( this->kernels.empty() ){
+    fprintf(stderr,"The convolution kernel of instrument '%s' has not been created (or was transformed in another precision)!\n",this->name.c_str());
+    exit(1);
+  }
+
+  this->freeKernelFFT();
+  this->preparePlans<T>(Nx,Ny);
+  T* kernel = (T*) fft::malloc(N*sizeof(T));
+  for(int k=0;k<this->kernels.size();k++){
+    for(long i=0;i<N;i++){
+      kernel[i] = static_cast<T>(this->kernels[k][i]);
+    }
+    typename fft::complex* f_kernel = (typename fft::complex*) fft::malloc(Nc*sizeof(typename fft::complex));
+    fft::execute((typename fft::plan) this->plan_r2c,kernel,f_kernel);
+    this->kernel_fft.push_back(f_kernel);
+  }
+  fft::free(kernel);
+
+  this->freeKernels();
+  this->kernel_fft_single = this->single_precision;
+}
 
-  fftw_complex* f_image  = (fftw_complex*) fftw_malloc(Nx*Ny*sizeof(fftw_complex));
-  fftw_complex* f_kernel = (fftw_complex*) fftw_malloc(Nx*Ny*sizeof(fftw_complex));
+template<typename T>
+void Instrument::convolveBuffer(T* image,int Nx,int Ny,void* kernel){
+  // In-place circular convolution of a real buffer with a transformed kernel, without the 1/N normalization
+  typedef FFTW<T> fft;
+  long Nc = (long) Nx*(Ny/2+1); // the r2c transform keeps only the non-redundant half of the last dimension
+  typename fft::complex* f_kernel = (typename fft::complex*) kernel;
+  typename fft::complex* f_image  = (typename fft::complex*) fft::malloc(Nc*sizeof(typename fft::complex));
   
-  fftw_plan p1;
-  p1 = fftw_plan_dft_r2c_2d(Nx,Ny,this->kernel,f_kernel,FFTW_ESTIMATE);
-  fftw_execute(p1);
-  fftw_destroy_plan(p1);
+  this->preparePlans<T>(Nx,Ny);
+  fft::execute((typename fft::plan) this->plan_r2c,image,f_image);
   
-  p1 = fftw_plan_dft_r2c_2d(Nx,Ny,grid->z,f_image,FFTW_ESTIMATE);
-  fftw_execute(p1);
-  fftw_destroy_plan(p1);
+  T dum1,dum2;
+  for(long i=0;i<Nc;i++){
+    dum1 = f_image[i][0]*f_kernel[i][0] - f_image[i][1]*f_kernel[i][1];
+    dum2 = f_image[i][0]*f_kernel[i][1] + f_image[i][1]*f_kernel[i][0];
+    f_image[i][0] = dum1;
+    f_image[i][1] = dum2;
+  }
   
-  double dum1,dum2;
-  for(int i=0;i<Ny;i++) {
-    for(int j=0;j<Nx;j++) {
-      dum1 = f_image[i*Nx+j][0]*f_kernel[i*Nx+j][0] - f_image[i*Nx+j][1]*f_kernel[i*Nx+j][1];
-      dum2 = f_image[i*Nx+j][0]*f_kernel[i*Nx+j][1] + f_image[i*Nx+j][1]*f_kernel[i*Nx+j][0];
-      f_image[i*Nx+j][0] = dum1;
-      f_image[i*Nx+j][1] = dum2;
+  fft::execute((typename fft::plan) this->plan_c2r,f_image,image);
+  fft::free(f_image);
+}
+
+template<typename T>
+void Instrument::convolveFFT(RectGrid* grid){
+  typedef FFTW<T> fft;
+  int Nx = grid->Nx;
+  int Ny = grid->Ny;
+  long N  = (long) Nx*Ny;
+
+  if( this->kernel_fft.empty() || this->kernel_fft_single != this->single_precision ){
+    this->transformKernel<T>();
+  }
+  if( Nx != this->kernel_Nx || Ny != this->kernel_Ny ){
+    fprintf(stderr,"The convolution kernel of instrument '%s' is for %dx%d images, not %dx%d!\n",this->name.c_str(),this->kernel_Nx,this->kernel_Ny,Nx,Ny);
+    exit(1);
+  }
+
+  // The field-dependent part is convolved as sum_k basis_k*(c_k*image), with c_k evaluated at each pixel of the image, i.e. one more FFT pair per component
+  std::vector<double> source;
+  if( this->kernel_fft.size() > 1 ){
+    source.assign(grid->z,grid->z+N);
+  }
+
+  // Real buffer: for double this is the image itself, for float it is a single precision copy
+  T* image  = reinterpret_cast<T*>(grid->z);
+  if( this->single_precision ){
+    image  = (T*) fft::malloc(N*sizeof(T));
+    for(long i=0;i<N;i++){
+      image[i]  = static_cast<T>(grid->z[i]);
     }
   }
-  
-  p1 = fftw_plan_dft_c2r_2d(Nx,Ny,f_image,grid->z,FFTW_ESTIMATE);
-  fftw_execute(p1);
-  fftw_destroy_plan(p1);
-  
-  fftw_free(f_image);
-  fftw_free(f_kernel);
+  this->convolveBuffer<T>(image,Nx,Ny,this->kernel_fft[0]);
   
   // Normalize output
-  for(int i=0;i<Nx*Ny;i++){
-    grid->z[i] /= (Nx*Ny);
+  if( this->single_precision ){
+    for(long i=0;i<N;i++){
+      grid->z[i] = image[i]/N;
+    }
+    fft::free(image);
+  } else {
+    for(long i=0;i<N;i++){
+      grid->z[i] /= N;
+    }
+  }
+
+  if( this->kernel_fft.size() > 1 ){
+    // The powers of x at the pixel centers are tabulated once, and on each row the polynomial c_k(x,y) (see basisCoefficient) reduces to one in x alone
+    int D = this->basis_degree;
+    std::vector<double> x_powers((D+1)*Nx);
+    for(int j=0;j<Nx;j++){
+      double xp = 1.0;
+      for(int d=0;d<=D;d++){
+	x_powers[d*Nx+j] = xp;
+	xp *= grid->center_x[j];
+      }
+    }
+    std::vector<double> row(D+1);
+    T* term = (T*) fft::malloc(N*sizeof(T));
+    for(int k=1;k<this->kernel_fft.size();k++){
+      const std::vector<double>& c = this->basis_coefficients[k-1];
+      for(int i=0;i<Ny;i++){
+	// row[p] is the coefficient of x^p on this row, from the terms x^(d-m)*y^m ordered by degree
+	std::fill(row.begin(),row.end(),0.0);
+	int n = 0;
+	for(int d=0;d<=D;d++){
+	  double yp = 1.0;
+	  for(int m=0;m<=d;m++){
+	    row[d-m] += c[n++]*yp;
+	    yp *= grid->center_y[i];
+	  }
+	}
+	for(int j=0;j<Nx;j++){
+	  double value = 0.0;
+	  for(int d=0;d<=D;d++){
+	    value += row[d]*x_powers[d*Nx+j];
+	  }
+	  term[i*Nx+j] = static_cast<T>(value*source[i*Nx+j]);
+	}
+      }
+      this->convolveBuffer<T>(term,Nx,Ny,this->kernel_fft[k]);
+      for(long i=0;i<N;i++){
+	grid->z[i] += term[i]/N;
+      }
+    }
+    fft::free(term);
+  }
+}
+
+uint64_t Instrument::psfKey(std::string recipe){
+  // The prepared PSF depends on the instrument files, on how it was prepared (e.g. the grid), and on the precision of the convolution
+  // The hash of the instrument files is computed once per process, unless they change
+  uint64_t h;
+  Json::Value specs = getSpecs(this->name);
+  std::vector<std::string> files = {"specs.json","psf.fits"};
+  for(int k=0;k<specs["psf"]["variation"]["basis"].size();k++){
+    files.push_back(specs["psf"]["variation"]["basis"][k].asString());
+  }
+  std::string stamp;
+  for(int f=0;f<files.size();f++){
+    stamp += fileStamp(this->path + this->name + "/" + files[f]) + " ";
+  }
+  std::unique_lock<std::mutex> lock(specs_mutex);
+  std::map<std::string,std::pair<std::string,uint64_t> >::iterator it = files_hash_cache.find(this->name);
+  if( it != files_hash_cache.end() && it->second.first == stamp ){
+    h = it->second.second;
+  } else {
+    h = 14695981039346656037ULL;
+    for(int f=0;f<files.size();f++){
+      std::ifstream in(this->path + this->name + "/" + files[f],std::ios::binary);
+      std::stringstream buffer;
+      buffer << in.rdbuf();
+      std::string content = buffer.str();
+      h = hashBytes(h,content.data(),content.size());
+    }
+    files_hash_cache[this->name] = std::make_pair(stamp,h);
+  }
+  lock.unlock();
+  h = hashBytes(h,this->name.data(),this->name.size());
+  h = hashBytes(h,recipe.data(),recipe.size());
+  h = hashBytes(h,&this->single_precision,sizeof(bool));
+  return h;
+}
+
+bool Instrument::readPSFCache(std::string filename,std::string recipe){
+  // Read the cropped PSF, its basis, and the transforms of the kernels, if the file was written for the same instrument, recipe, and precision
+  std::ifstream in(filename,std::ios::binary);
+  if( !in.is_open() ){
+    return false;
+  }
+  char magic[8];
+  uint64_t key;
+  int dims[5];
+  double size[2];
+  in.read(magic,8);
+  in.read((char*) &key,sizeof(uint64_t));
+  in.read((char*) dims,5*sizeof(int));
+  in.read((char*) size,2*sizeof(double));
+  if( !in.good() || memcmp(magic,psf_cache_magic,8) != 0 || key != this->psfKey(recipe) || dims[4] != this->original_basis.size() ){
+    return false;
+  }
+
+  int Nk = 1 + dims[4];
+  std::vector<RectGrid*> cropped(Nk);
+  for(int k=0;k<Nk;k++){
+    cropped[k] = new RectGrid(dims[0],dims[1],0,size[0],0,size[1]);
+    in.read((char*) cropped[k]->z,cropped[k]->Nz*sizeof(double));
+  }
+  long Nc = (long) dims[2]*(dims[3]/2+1);
+  size_t bytes = Nc*((this->single_precision)? sizeof(fftwf_complex) : sizeof(fftw_complex));
+  std::vector<void*> f_kernels(Nk);
+  for(int k=0;k<Nk;k++){
+    f_kernels[k] = (this->single_precision)? fftwf_malloc(bytes) : fftw_malloc(bytes);
+    in.read((char*) f_kernels[k],bytes);
+  }
+  if( !in.good() ){
+    for(int k=0;k<Nk;k++){
+      delete(cropped[k]);
+      if( this->single_precision ){
+	fftwf_free(f_kernels[k]);
+      } else {
+	fftw_free(f_kernels[k]);
+      }
+    }
+    return false;
+  }
+
+  delete(this->cropped_psf);
+  this->cropped_psf = cropped[0];
+  for(int k=0;k<this->cropped_basis.size();k++){
+    delete(this->cropped_basis[k]);
+  }
+  this->cropped_basis.assign(cropped.begin()+1,cropped.end());
+  this->freeKernels();
+  this->freeKernelFFT();
+  this->kernel_fft = f_kernels;
+  this->kernel_fft_single = this->single_precision;
+  this->kernel_Nx = dims[2];
+  this->kernel_Ny = dims[3];
+  return true;
+}
+
+void Instrument::writePSFCache(std::string filename,std::string recipe){
+  if( this->kernel_fft.empty() || this->kernel_fft_single != this->single_precision ){
+    if( this->single_precision ){
+      this->transformKernel<float>();
+    } else {
+      this->transformKernel<double>();
+    }
+  }
+  // Written to a temporary file (of this process and thread) and renamed, so that another job reading the same (shared) cache never reads a partial file
+  std::string tmp = filename + "." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  std::ofstream out(tmp,std::ios::binary|std::ios::trunc);
+  if( !out.is_open() ){
+    fprintf(stderr,"Could not write the PSF cache '%s'\n",filename.c_str());
+    return;
+  }
+  uint64_t key = this->psfKey(recipe);
+  int dims[5] = {this->cropped_psf->Nx,this->cropped_psf->Ny,this->kernel_Nx,this->kernel_Ny,static_cast<int>(this->cropped_basis.size())};
+  double size[2] = {this->cropped_psf->width,this->cropped_psf->height};
+  long Nc = (long) this->kernel_Nx*(this->kernel_Ny/2+1);
+  size_t bytes = Nc*((this->single_precision)? sizeof(fftwf_complex) : sizeof(fftw_complex));
+  out.write(psf_cache_magic,8);
+  out.write((char*) &key,sizeof(uint64_t));
+  out.write((char*) dims,5*sizeof(int));
+  out.write((char*) size,2*sizeof(double));
+  out.write((char*) this->cropped_psf->z,this->cropped_psf->Nz*sizeof(double));
+  for(int k=0;k<this->cropped_basis.size();k++){
+    out.write((char*) this->cropped_basis[k]->z,this->cropped_basis[k]->Nz*sizeof(double));
   }
+  for(int k=0;k<this->kernel_fft.size();k++){
+    out.write((char*) this->kernel_fft[k],bytes);
+  }
+  out.close();
+  rename(tmp.c_str(),filename.c_str());
 }
 
 offsetPSF Instrument::offsetPSFtoPosition(double x,double y,RectGrid* grid){
-  int Nx_img   = grid->Nx;
-  int Ny_img   = grid->Ny;
-  double w_img = grid->width;
-  double h_img = grid->height;
+  return this->offsetPSFtoPosition(x,y,grid->Nx,grid->Ny,grid->width,grid->height);
+}
+
+offsetPSF Instrument::offsetPSFtoPosition(double x,double y,int Nx_img,int Ny_img,double w_img,double h_img){
+  // Only the geometry of the image is needed, so that this works also for frames that are not held in memory
   int Nx_psf   = this->cropped_psf->Nx;
   int Ny_psf   = this->cropped_psf->Ny;
   double w_psf = this->cropped_psf->width;
   double h_psf = this->cropped_psf->height;
 
-  double dx = grid->step_x;
-  double dy = grid->step_y;
+  double dx = w_img/Nx_img;
+  double dy = h_img/Ny_img;
 
   // Everything below is calculated in the reference frame centered on the multiple image position
   // The top left corner of the image
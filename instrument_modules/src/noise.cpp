@@ -5,41 +5,56 @@
 
 #include "noise.hpp"
 
+// START: BaseNoise ==================================
+void BaseNoise::addNoise(RectGrid* mydata){
+  double maxdata = *std::max_element(mydata->z,mydata->z+mydata->Nz);
+  double offset = this->generateNoise(mydata->z,mydata->Nz,maxdata);
+  if( offset != 0.0 ){
+    for(int i=0;i<mydata->Nz;i++){
+      mydata->z[i] += offset;
+    }
+  }
+}
+
+double BaseNoise::generateNoise(double* z,long N,double zmax){
+  this->seed += 2; // increment seed at each call
+  return this->seededNoise(z,N,zmax,this->seed);
+}
+// END: BaseNoise ====================================
+
 // START: NoNoise ====================================
 NoNoise::NoNoise(){}
-void NoNoise::addNoise(RectGrid* mydata){}
+double NoNoise::seededNoise(double* z,long N,double zmax,long seed){
+  return 0.0;
+}
 // END: NoNoise ======================================
 
 // START: UniformGaussian ============================
 UniformGaussian::UniformGaussian(double sn){
   this->sn = sn;
 }
-void UniformGaussian::addNoise(RectGrid* mydata){
-  this->seed += 2; // increment seed at each call
-
-  double maxdata = *std::max_element(mydata->z,mydata->z+mydata->Nz);
-  double sigma = maxdata/this->sn;
-  srand48(seed);
+double UniformGaussian::seededNoise(double* z,long N,double zmax,long seed){
+  double sigma = zmax/this->sn;
+  // The same sequence as drand48 after srand48(seed), but with a local state
+  unsigned short state[3] = {0x330E,static_cast<unsigned short>(seed & 0xFFFF),static_cast<unsigned short>((seed >> 16) & 0xFFFF)};
 
   double min_noise = sigma; // just a starting value
   double z1,z2,u1,u2,noise;
   //Applying the Box-Muller transformation
-  for(int i=0;i<mydata->Nz;i++){
-    u1 = drand48();
-    u2 = drand48();
+  for(long i=0;i<N;i++){
+    u1 = erand48(state);
+    u2 = erand48(state);
     z1 = sqrt(-2.0 * log(u1)) * cos(this->two_pi * u2);
     //    z2 = sqrt(-2.0 * log(u1)) * sin(two_pi * u2);    
 
     noise = z1*sigma;
-    mydata->z[i] += noise;
+    z[i] += noise;
     if( noise < min_noise ){
       min_noise = noise;
     }
   }
 
   // renormalize by adding the minimum (negative) noise value
-  for(int i=0;i<mydata->Nz;i++){
-    mydata->z[i] += abs(min_noise);
-  }
+  return abs(min_noise);
 }
 // END: UniformGaussian ==============================
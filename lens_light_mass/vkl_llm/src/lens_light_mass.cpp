@@ -7,6 +7,12 @@
 
 #include "vkllib.hpp"
 #include "instruments.hpp"
+#include "tile_renderer.hpp"
+#include "profiler.hpp"
+#include "molet_config.hpp"
+#include "fits_output.hpp"
+#include "pixel_integrator.hpp"
+#include "shared_frame.hpp"
 
 int main(int argc,char* argv[]){
 
@@ -17,20 +23,20 @@ int main(int argc,char* argv[]){
   */
   
   //=============== BEGIN:PARSE INPUT =======================
+  Profiler::getInstance()->setStage("llm");
   std::ifstream fin;
   Json::Value::Members jmembers;
 
-  // Read the main parameters
-  Json::Value root;
-  fin.open(argv[1],std::ifstream::in);
-  fin >> root;
-  fin.close();
 
   std::string in_path = argv[2];
   std::string input   = in_path+"input_files/";
 
   std::string out_path = argv[3];
   std::string output = out_path+"output/";
+
+  // Read the main parameters
+  MoletConfig config(argv[1],out_path);
+  const Json::Value& root = config.root;
   
   // Read the cosmological parameters
   Json::Value cosmo;
@@ -38,14 +44,41 @@ int main(int argc,char* argv[]){
   fin >> cosmo;
   fin.close();
 
-  // Initialize image plane
-  double xmin = root["instruments"][0]["field-of-view_xmin"].asDouble();
-  double xmax = root["instruments"][0]["field-of-view_xmax"].asDouble();
-  double ymin = root["instruments"][0]["field-of-view_ymin"].asDouble();
-  double ymax = root["instruments"][0]["field-of-view_ymax"].asDouble();
-  double res  = Instrument::getResolution(root["instruments"][0]["name"].asString());
-  int super_res_x = 10*( static_cast<int>(ceil((xmax-xmin)/res)) );
-  int super_res_y = 10*( static_cast<int>(ceil((ymax-ymin)/res)) );
+  // Initialize image plane: the frame shared by all the instruments, rendered once and resampled to each instrument by combine_light
+  std::vector<double> resolutions;
+  for(int b=0;b<config.instruments.size();b++){
+    resolutions.push_back(Instrument::getResolution(config.instruments[b].name));
+  }
+  SharedFrame shared(config.instruments,resolutions);
+  double xmin = shared.xmin;
+  double xmax = shared.xmax;
+  double ymin = shared.ymin;
+  double ymax = shared.ymax;
+  int super_res_x = shared.Nx;
+  int super_res_y = shared.Ny;
+
+  // Options for the parallel tile renderer
+  Json::Value render_options;
+  if( root.isMember("output_options") ){
+    render_options = root["output_options"]["render"];
+  }
+  TileRenderer renderer(render_options);
+
+  // Options for the direct integration over the observed pixels
+  Json::Value integration_options;
+  if( root.isMember("output_options") ){
+    integration_options = root["output_options"]["integration"];
+  }
+  PixelIntegrator integrator(integration_options);
+
+  // In the out-of-core mode the super-resolved images are rendered and written tile by tile
+  int tile_size = config.output.tile_size;
+  if( tile_size > 0 && renderer.flux_floor > 0.0 ){
+    // The flux floor is relative to the maximum of the image being rendered, which would be the one of each tile
+    std::cout << "The flux floor of the renderer is not used in the out-of-core mode" << std::endl;
+    renderer.flux_floor = 0.0;
+  }
+  shared.checkMode(integrator.direct(),tile_size);
   //================= END:PARSE INPUT =======================
 
 
@@ -56,22 +89,28 @@ int main(int argc,char* argv[]){
 
   //=============== BEGIN:CREATE LENS LIGHT =======================
   Json::Value all_lenses;
-  for(int k=0;k<root["lenses"].size();k++){
-    for(int m=0;m<root["lenses"][k]["light_profile"].size();m++){
-      all_lenses.append(root["lenses"][k]["light_profile"][m]);
+  for(int k=0;k<config.lenses.size();k++){
+    for(int m=0;m<config.lenses[k].light_profile.size();m++){
+      all_lenses.append(config.lenses[k].light_profile[m]);
     }
   }
   CollectionProfiles light_collection = JsonParsers::parse_profile(all_lenses,input);
 
-  RectGrid mylight(super_res_x,super_res_y,xmin,xmax,ymin,ymax);
-  for(int i=0;i<mylight.Ny;i++){
-    for(int j=0;j<mylight.Nx;j++){
-      mylight.z[i*mylight.Nx+j] = light_collection.all_values(mylight.center_x[j],mylight.center_y[i]);
-    }
+  // Lens light profile image, integrated over the observed pixels or super-resolved
+  ScopedTimer timer_light("render lens light");
+  if( integrator.direct() ){
+    RectGrid obs_light(super_res_x/10,super_res_y/10,xmin,xmax,ymin,ymax);
+    integrator.render([&](double x,double y){ return light_collection.all_values(x,y); },&obs_light);
+    writeImage(obs_light.Nx,obs_light.Ny,obs_light.z,output + "lens_light_obs.fits",config.output.single_precision);
+  } else if( tile_size == 0 ){
+    RectGrid mylight(super_res_x,super_res_y,xmin,xmax,ymin,ymax);
+    renderer.render(&light_collection,&mylight);
+    writeImage(mylight.Nx,mylight.Ny,mylight.z,output + "lens_light_super.fits",config.output.single_precision);
+  } else {
+    FitsFrame frame(output + "lens_light_super.fits",super_res_x,super_res_y,xmin,xmax,ymin,ymax,config.output.single_precision);
+    renderer.renderFrame(&light_collection,&frame,10*tile_size);
   }
-
-  // Super-resolved lens light profile image
-  FitsInterface::writeFits(mylight.Nx,mylight.Ny,mylight.z,output + "lens_light_super.fits");
+  timer_light.stop();
 
 
   // Confirm that the total brightness is conserved (by numerical integration)
@@ -92,7 +131,7 @@ int main(int argc,char* argv[]){
 
 
   //=============== BEGIN:CREATE LENS COMPACT MASS ================
-  if( root.isMember("point_source") ){
+  if( config.point_source.present ){
     // Factor to convert surface mass density to kappa
     double Dl  = cosmo[0]["Dl"].asDouble();
     double Ds  = cosmo[0]["Ds"].asDouble();
@@ -100,22 +139,25 @@ int main(int argc,char* argv[]){
     double sigma_crit = 3472.8*Ds/(Dl*Dls); // the critical density: c^2/(4pi G)  Ds/(Dl*Dls), in units of kg/m^2
     
     Json::Value all_compact;
-    for(int k=0;k<root["lenses"].size();k++){
-      for(int m=0;m<root["lenses"][k]["compact_mass_model"].size();m++){
-	all_compact.append(root["lenses"][k]["compact_mass_model"][m]);
+    for(int k=0;k<config.lenses.size();k++){
+      for(int m=0;m<config.lenses[k].compact_mass_model.size();m++){
+	all_compact.append(config.lenses[k].compact_mass_model[m]);
       }
     }
     CollectionProfiles compact_collection = JsonParsers::parse_profile(all_compact);
 
     // Write overall kappa_star field
-    RectGrid kappa_star(super_res_x,super_res_y,xmin,xmax,ymin,ymax);
-    for(int i=0;i<kappa_star.Ny;i++){
-      for(int j=0;j<kappa_star.Nx;j++){
-	kappa_star.z[i*kappa_star.Nx+j] = compact_collection.all_values(kappa_star.center_x[j],kappa_star.center_y[i])/sigma_crit;
-      }
-    }
     // Super-resolved lens compact mass profile image
-    FitsInterface::writeFits(kappa_star.Nx,kappa_star.Ny,kappa_star.z,output + "lens_kappa_star_super.fits");
+    ScopedTimer timer_kappa("render kappa_star");
+    if( tile_size == 0 ){
+      RectGrid kappa_star(super_res_x,super_res_y,xmin,xmax,ymin,ymax);
+      renderer.render(&compact_collection,&kappa_star,1.0/sigma_crit);
+      FitsInterface::writeFits(kappa_star.Nx,kappa_star.Ny,kappa_star.z,output + "lens_kappa_star_super.fits");
+    } else {
+      FitsFrame frame(output + "lens_kappa_star_super.fits",super_res_x,super_res_y,xmin,xmax,ymin,ymax,false);
+      renderer.renderFrame(&compact_collection,&frame,10*tile_size,1.0/sigma_crit);
+    }
+    timer_kappa.stop();
 
     
     // Read the image parameters
@@ -140,5 +182,6 @@ int main(int argc,char* argv[]){
   //================= END:CREATE LENS COMPACT MASS ================
 
 
+  Profiler::getInstance()->write(output+"timing_llm.json");
   return 0;
 }
@@ -0,0 +1,18 @@
+#ifndef ADAPTIVE_HPP
+#define ADAPTIVE_HPP
+
+class RectGrid;
+class MultiPlaneLens;
+class CollectionProfiles;
+
+// Ray-shoots only the pixels of a super-resolved grid that can receive light from the flux-significant region of the source, and sets the others to zero,
+// so that for a compact source the cost scales with the area of the arcs instead of the field of view.
+// The grid is divided in cells, the pixels of the coarse grid 'detA' (with the sign of detA, as used for the critical lines), each one a block of super-resolved pixels:
+// - The corners of the cells are traced to the source plane, and the source is sampled on a grid of nodes covering them.
+//   The nodes brighter than 'threshold' times the brightest one, and their neighbours, make the significant region.
+// - A cell is ray-shot if the box of its traced corners, enlarged by half its size, overlaps the significant region,
+//   or if it is next to a critical line (a change of sign of detA), where the mapping folds and the corners do not bound the image of the cell.
+// If the source is not resolved by the nodes (zero everywhere) all the cells are ray-shot. Returns the number of ray-shot pixels.
+long renderAdaptive(MultiPlaneLens* lens,CollectionProfiles* source,RectGrid* detA,RectGrid* grid,double threshold,int Nthreads=0);
+
+#endif /* ADAPTIVE_HPP */
@@ -6,6 +6,7 @@
 #include <vector>
 
 class RectGrid;
+class MultiPlaneLens;
 
 class Contour {
 public:
@@ -20,6 +21,8 @@ public:
 void outputContours(std::vector<Contour> contours,std::string filepath);
 std::vector<Contour> mooreNeighborTracing(RectGrid* image);
 void padImage(RectGrid* image,RectGrid* paddedImage,double paddingColor);
+std::vector<Contour> marchingSquaresCriticals(MultiPlaneLens* mylens,RectGrid* coarse,double tolerance);
+std::vector<Contour> deflectContours(const std::vector<Contour>& contours,MultiPlaneLens* mylens);
 
 
 #endif /* CAUSTICS_HPP */
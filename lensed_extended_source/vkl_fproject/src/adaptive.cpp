@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "vkllib.hpp"
+
+#include "adaptive.hpp"
+#include "multi_plane.hpp"
+
+long renderAdaptive(MultiPlaneLens* lens,CollectionProfiles* source,RectGrid* detA,RectGrid* grid,double threshold,int Nthreads){
+  int Cx = detA->Nx;
+  int Cy = detA->Ny;
+  if( grid->Nx % Cx != 0 || grid->Ny % Cy != 0 ){
+    fprintf(stderr,"The super-resolved grid (%dx%d) is not made of blocks of the coarse grid (%dx%d)!\n",grid->Nx,grid->Ny,Cx,Cy);
+    exit(1);
+  }
+  int fx = grid->Nx/Cx;
+  int fy = grid->Ny/Cy;
+  double cell_w = (grid->xmax - grid->xmin)/Cx;
+  double cell_h = (grid->ymax - grid->ymin)/Cy;
+  if( Nthreads <= 0 ){
+    Nthreads = std::max(1,(int) std::thread::hardware_concurrency());
+  }
+
+  // Source plane positions of the cell corners, row 0 at the top as in RectGrid
+  int Kx = Cx + 1;
+  int Ky = Cy + 1;
+  std::vector<double> sx(Kx*Ky),sy(Kx*Ky);
+  for(int i=0;i<Ky;i++){
+    for(int j=0;j<Kx;j++){
+      lens->all_defl(grid->xmin + j*cell_w,grid->ymax - i*cell_h,sx[i*Kx+j],sy[i*Kx+j]);
+    }
+  }
+
+  // The source sampled on nodes covering the traced corners, twice as dense as the cells
+  double sxmin = *std::min_element(sx.begin(),sx.end());
+  double sxmax = *std::max_element(sx.begin(),sx.end());
+  double symin = *std::min_element(sy.begin(),sy.end());
+  double symax = *std::max_element(sy.begin(),sy.end());
+  int Ns = 2*std::max(Cx,Cy);
+  double ds_x = (sxmax - sxmin)/(Ns-1);
+  double ds_y = (symax - symin)/(Ns-1);
+  std::vector<double> values(Ns*Ns);
+  double vmax = 0.0;
+  for(int i=0;i<Ns;i++){
+    for(int j=0;j<Ns;j++){
+      values[i*Ns+j] = source->all_values(sxmin + j*ds_x,symin + i*ds_y);
+      vmax = std::max(vmax,values[i*Ns+j]);
+    }
+  }
+
+  // Significant nodes and their neighbours, counted in a summed-area table so that any box of nodes is checked at once
+  std::vector<char> significant(Ns*Ns,0);
+  for(int i=0;i<Ns;i++){
+    for(int j=0;j<Ns;j++){
+      if( vmax <= 0.0 || values[i*Ns+j] > threshold*vmax ){
+	for(int ii=std::max(0,i-1);ii<=std::min(Ns-1,i+1);ii++){
+	  for(int jj=std::max(0,j-1);jj<=std::min(Ns-1,j+1);jj++){
+	    significant[ii*Ns+jj] = 1;
+	  }
+	}
+      }
+    }
+  }
+  std::vector<long> table((Ns+1)*(Ns+1),0);
+  for(int i=0;i<Ns;i++){
+    for(int j=0;j<Ns;j++){
+      table[(i+1)*(Ns+1)+j+1] = significant[i*Ns+j] + table[i*(Ns+1)+j+1] + table[(i+1)*(Ns+1)+j] - table[i*(Ns+1)+j];
+    }
+  }
+
+  // Cells to ray-shoot
+  std::vector<char> active(Cx*Cy,0);
+  for(int i=0;i<Cy;i++){
+    for(int j=0;j<Cx;j++){
+      bool critical = false;
+      for(int ii=std::max(0,i-1);ii<=std::min(Cy-1,i+1);ii++){
+	for(int jj=std::max(0,j-1);jj<=std::min(Cx-1,j+1);jj++){
+	  if( detA->z[ii*Cx+jj] != detA->z[i*Cx+j] ){
+	    critical = true;
+	  }
+	}
+      }
+      if( critical ){
+	active[i*Cx+j] = 1;
+	continue;
+      }
+
+      int corners[4] = {i*Kx+j,i*Kx+j+1,(i+1)*Kx+j,(i+1)*Kx+j+1};
+      double bxmin = sx[corners[0]];
+      double bxmax = sx[corners[0]];
+      double bymin = sy[corners[0]];
+      double bymax = sy[corners[0]];
+      for(int c=1;c<4;c++){
+	bxmin = std::min(bxmin,sx[corners[c]]);
+	bxmax = std::max(bxmax,sx[corners[c]]);
+	bymin = std::min(bymin,sy[corners[c]]);
+	bymax = std::max(bymax,sy[corners[c]]);
+      }
+      double mx = 0.5*(bxmax - bxmin);
+      double my = 0.5*(bymax - bymin);
+      int j0 = std::max(0,(int) floor((bxmin - mx - sxmin)/ds_x));
+      int j1 = std::min(Ns-1,(int) ceil((bxmax + mx - sxmin)/ds_x));
+      int i0 = std::max(0,(int) floor((bymin - my - symin)/ds_y));
+      int i1 = std::min(Ns-1,(int) ceil((bymax + my - symin)/ds_y));
+      if( j0 <= j1 && i0 <= i1 ){
+	long count = table[(i1+1)*(Ns+1)+j1+1] - table[i0*(Ns+1)+j1+1] - table[(i1+1)*(Ns+1)+j0] + table[i0*(Ns+1)+j0];
+	if( count > 0 ){
+	  active[i*Cx+j] = 1;
+	}
+      }
+    }
+  }
+
+  // Ray-shoot the pixels of the active cells, by rows of cells
+  std::fill(grid->z,grid->z+grid->Nz,0.0);
+  std::atomic<long> rays(0);
+  auto shootRows = [&](int i_start){
+    double xdefl,ydefl;
+    long n = 0;
+    for(int i=i_start;i<Cy;i+=Nthreads){
+      for(int j=0;j<Cx;j++){
+	if( !active[i*Cx+j] ){
+	  continue;
+	}
+	for(int si=i*fy;si<(i+1)*fy;si++){
+	  for(int sj=j*fx;sj<(j+1)*fx;sj++){
+	    lens->all_defl(grid->center_x[sj],grid->center_y[si],xdefl,ydefl);
+	    grid->z[si*grid->Nx+sj] = source->all_values(xdefl,ydefl);
+	  }
+	}
+	n += fx*fy;
+      }
+    }
+    rays += n;
+  };
+  std::vector<std::thread> threads;
+  for(int k=0;k<Nthreads;k++){
+    threads.push_back( std::thread(shootRows,k) );
+  }
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+  return rays;
+}
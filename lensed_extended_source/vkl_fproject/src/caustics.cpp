@@ -1,12 +1,15 @@
 #include <fstream>
 #include <cstdlib>
+#include <cmath>
 #include <string>
 #include <vector>
+#include <map>
 
 #include "json/json.h"
 
 #include "caustics.hpp"
 #include "vkllib.hpp"
+#include "multi_plane.hpp"
 
 Contour::Contour(const Contour& other){
   this->x = other.x;
@@ -164,3 +167,185 @@ void padImage(RectGrid* image,RectGrid* paddedImage,double paddingColor){
     }
   }
 }
+
+
+
+/**
+ * Finds the critical lines (detA=0) of a (multi-plane) lens using marching squares.
+ * The Jacobian determinant is evaluated only on the coarse grid nodes (pixel centers) and stored in coarse->z.
+ * Each cell edge with a sign change is then bisected until the crossing point is located within 'tolerance' (in arcsec).
+ * Returns ordered contours, where closed loops have their first point repeated at the end.
+ */
+std::vector<Contour> marchingSquaresCriticals(MultiPlaneLens* mylens,RectGrid* coarse,double tolerance){
+  int Nx = coarse->Nx;
+  int Ny = coarse->Ny;
+
+  for(int i=0;i<Ny;i++){
+    for(int j=0;j<Nx;j++){
+      coarse->z[i*Nx+j] = mylens->detJacobian(coarse->center_x[j],coarse->center_y[i]);
+    }
+  }
+
+  // Horizontal edges, between nodes (i,j) and (i,j+1), are indexed first and vertical edges, between nodes (i,j) and (i+1,j), follow
+  int Nh = Ny*(Nx-1);
+  std::map<int,int> edge_points;            // edge index -> index of the crossing point in px,py
+  std::map<int,std::vector<int> > links;    // edge index -> edges connected to it through a contour segment
+  std::vector<double> px;
+  std::vector<double> py;
+
+  for(int i=0;i<Ny-1;i++){
+    for(int j=0;j<Nx-1;j++){
+      // Cell corners a=(i,j), b=(i,j+1), c=(i+1,j+1), d=(i+1,j)
+      double za = coarse->z[i*Nx+j];
+      double zb = coarse->z[i*Nx+j+1];
+      double zc = coarse->z[(i+1)*Nx+j+1];
+      double zd = coarse->z[(i+1)*Nx+j];
+      bool sa = (za <= 0);
+      bool sb = (zb <= 0);
+      bool sc = (zc <= 0);
+      bool sd = (zd <= 0);
+      if( sa == sb && sb == sc && sc == sd ){
+	continue;
+      }
+
+      int e_ab = i*(Nx-1) + j;
+      int e_dc = (i+1)*(Nx-1) + j;
+      int e_ad = Nh + i*Nx + j;
+      int e_bc = Nh + i*Nx + j + 1;
+
+      std::vector<int> segments; // pairs of edges to connect
+      if( sa != sb && sb != sc && sc != sd && sd != sa ){
+	// Saddle: resolve the ambiguity using the average value at the cell center, the corners with a different sign are isolated
+	bool scen = (0.25*(za+zb+zc+zd) <= 0);
+	if( sa != scen ){
+	  segments.push_back(e_ab);
+	  segments.push_back(e_ad);
+	}
+	if( sb != scen ){
+	  segments.push_back(e_ab);
+	  segments.push_back(e_bc);
+	}
+	if( sc != scen ){
+	  segments.push_back(e_bc);
+	  segments.push_back(e_dc);
+	}
+	if( sd != scen ){
+	  segments.push_back(e_dc);
+	  segments.push_back(e_ad);
+	}
+      } else {
+	if( sa != sb ){
+	  segments.push_back(e_ab);
+	}
+	if( sb != sc ){
+	  segments.push_back(e_bc);
+	}
+	if( sd != sc ){
+	  segments.push_back(e_dc);
+	}
+	if( sa != sd ){
+	  segments.push_back(e_ad);
+	}
+      }
+
+      for(int k=0;k<segments.size();k++){
+	int e = segments[k];
+	if( edge_points.find(e) == edge_points.end() ){
+	  int i0,j0,i1,j1;
+	  if( e < Nh ){
+	    i0 = e/(Nx-1);
+	    j0 = e%(Nx-1);
+	    i1 = i0;
+	    j1 = j0 + 1;
+	  } else {
+	    i0 = (e-Nh)/Nx;
+	    j0 = (e-Nh)%Nx;
+	    i1 = i0 + 1;
+	    j1 = j0;
+	  }
+	  double x0 = coarse->center_x[j0];
+	  double y0 = coarse->center_y[i0];
+	  double dx = coarse->center_x[j1] - x0;
+	  double dy = coarse->center_y[i1] - y0;
+	  double length = hypot(dx,dy);
+
+	  // Bisection along the edge, keeping the sign of the first node at ta
+	  bool s0 = (coarse->z[i0*Nx+j0] <= 0);
+	  double ta = 0.0;
+	  double tb = 1.0;
+	  while( (tb-ta)*length > tolerance ){
+	    double tm = 0.5*(ta+tb);
+	    if( (mylens->detJacobian(x0+tm*dx,y0+tm*dy) <= 0) == s0 ){
+	      ta = tm;
+	    } else {
+	      tb = tm;
+	    }
+	  }
+	  double t = 0.5*(ta+tb);
+	  edge_points[e] = px.size();
+	  px.push_back(x0+t*dx);
+	  py.push_back(y0+t*dy);
+	}
+      }
+      for(int k=0;k<segments.size();k+=2){
+	links[segments[k]].push_back(segments[k+1]);
+	links[segments[k+1]].push_back(segments[k]);
+      }
+    }
+  }
+
+  // Link the segments into contours: open contours start and end on the grid border (edges with a single link), the remaining ones are closed loops
+  std::vector<Contour> contours;
+  std::map<int,bool> visited;
+  for(int pass=0;pass<2;pass++){
+    for(std::map<int,std::vector<int> >::iterator it=links.begin();it!=links.end();it++){
+      int start = it->first;
+      if( visited[start] || (pass == 0 && it->second.size() != 1) ){
+	continue;
+      }
+
+      Contour mycontour;
+      int current = start;
+      while( true ){
+	visited[current] = true;
+	mycontour.x.push_back( px[edge_points[current]] );
+	mycontour.y.push_back( py[edge_points[current]] );
+
+	int next = -1;
+	for(int k=0;k<links[current].size();k++){
+	  if( !visited[links[current][k]] ){
+	    next = links[current][k];
+	    break;
+	  }
+	}
+	if( next == -1 ){
+	  if( pass == 1 && mycontour.x.size() > 2 ){
+	    mycontour.x.push_back( mycontour.x[0] );
+	    mycontour.y.push_back( mycontour.y[0] );
+	  }
+	  break;
+	}
+	current = next;
+      }
+      contours.push_back( mycontour );
+    }
+  }
+
+  return contours;
+}
+
+/**
+ * Maps contours from the image to the source plane in a single pass over all their points.
+ */
+std::vector<Contour> deflectContours(const std::vector<Contour>& contours,MultiPlaneLens* mylens){
+  std::vector<Contour> deflected(contours.size());
+  for(int k=0;k<contours.size();k++){
+    int N = contours[k].x.size();
+    deflected[k].x.resize(N);
+    deflected[k].y.resize(N);
+    for(int i=0;i<N;i++){
+      mylens->all_defl(contours[k].x[i],contours[k].y[i],deflected[k].x[i],deflected[k].y[i]);
+    }
+  }
+  return deflected;
+}
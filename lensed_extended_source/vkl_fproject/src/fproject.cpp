@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <string>
@@ -9,6 +10,14 @@
 #include "vkllib.hpp"
 #include "instruments.hpp"
 #include "caustics.hpp"
+#include "adaptive.hpp"
+#include "multi_plane.hpp"
+#include "profiler.hpp"
+#include "molet_config.hpp"
+#include "fits_output.hpp"
+#include "pixel_integrator.hpp"
+#include "shared_frame.hpp"
+#include "source_map.hpp"
 
 int main(int argc,char* argv[]){
   /*
@@ -19,20 +28,20 @@ int main(int argc,char* argv[]){
 
   
   //=============== BEGIN:PARSE INPUT =======================
+  Profiler::getInstance()->setStage("fproject");
   std::ifstream fin;
   Json::Value::Members jmembers;
 
-  // Read the main projection parameters
-  Json::Value root;
-  fin.open(argv[1],std::ifstream::in);
-  fin >> root;
-  fin.close();
 
   std::string in_path = argv[2];
   std::string input   = in_path+"input_files/";
   
   std::string out_path = argv[3];
   std::string output   = out_path+"output/";
+
+  // Read the main projection parameters
+  MoletConfig config(argv[1],out_path);
+  const Json::Value& root = config.root;
   
   // Read the cosmological parameters
   Json::Value cosmo;
@@ -40,101 +49,151 @@ int main(int argc,char* argv[]){
   fin >> cosmo;
   fin.close();
 
-  // Initialize image plane
-  double xmin = root["instruments"][0]["field-of-view_xmin"].asDouble();
-  double xmax = root["instruments"][0]["field-of-view_xmax"].asDouble();
-  double ymin = root["instruments"][0]["field-of-view_ymin"].asDouble();
-  double ymax = root["instruments"][0]["field-of-view_ymax"].asDouble();
-  double resolution = Instrument::getResolution(root["instruments"][0]["name"].asString());
-  int super_res_x = 10*( static_cast<int>(ceil((xmax-xmin)/resolution)) );
-  int super_res_y = 10*( static_cast<int>(ceil((ymax-ymin)/resolution)) );
-  RectGrid mysim(super_res_x,super_res_y,xmin,xmax,ymin,ymax);
+  // Initialize image plane: the frame shared by all the instruments, ray-shot once and resampled to each instrument by combine_light
+  std::vector<double> resolutions;
+  for(int b=0;b<config.instruments.size();b++){
+    resolutions.push_back(Instrument::getResolution(config.instruments[b].name));
+  }
+  SharedFrame shared(config.instruments,resolutions);
+  double xmin = shared.xmin;
+  double xmax = shared.xmax;
+  double ymin = shared.ymin;
+  double ymax = shared.ymax;
+  double resolution = shared.resolution;
+  int super_res_x = shared.Nx;
+  int super_res_y = shared.Ny;
   double xdefl,ydefl;
+
+  // The lensed image is either integrated directly over the observed pixels, or ray-shot on a super-resolved grid.
+  // In the out-of-core mode the super-resolved image is ray-shot and written tile by tile, otherwise it is held in memory as a whole.
+  Json::Value integration_options;
+  if( root.isMember("output_options") ){
+    integration_options = root["output_options"]["integration"];
+  }
+  PixelIntegrator integrator(integration_options);
+  int tile_size = config.output.tile_size;
+  shared.checkMode(integrator.direct(),tile_size);
+  RectGrid* mysim = NULL;
+  if( !integrator.direct() && tile_size == 0 ){
+    mysim = new RectGrid(super_res_x,super_res_y,xmin,xmax,ymin,ymax);
+  }
   //================= END:PARSE INPUT =======================
 
 
   
   //=============== BEGIN:CREATE THE LENSES ====================
-  Json::Value jlens = root["lenses"][0];
-
-  // Initialize mass model collection
-  CollectionMassModels mass_collection = JsonParsers::parse_mass_model(jlens["mass_model"],input);
-  
-  // Scale dpsi mass models if necessary
-  for(int k=0;k<jlens["mass_model"].size();k++){
-    if( jlens["mass_model"][k]["pars"].isMember("scale_factor") ){
-      double scale_factor = jlens["mass_model"][k]["pars"]["scale_factor"].asDouble();
-      Pert* pert = static_cast<Pert*> (mass_collection.models[k]);
-      for(int m=0;m<pert->Sm;m++){
-	pert->z[m] *= scale_factor;
-      }
-      pert->updateDerivatives();
-    }
+  // All the lens planes, each one with the mass models given in its 'mass_model' field
+  ScopedTimer timer_lenses("create lenses");
+  MultiPlaneLens mylens(root["lenses"],cosmo,input);
+
+  // Multiple planes or pixelated perturbations: sample the deflection field of each plane once, rays are then traced through the cached fields.
+  // The fields are kept in a sidecar file in the output directory, reused by later runs of fproject with the same lenses and frame.
+  // The point source stage does not read them: it refines the image positions below the interpolation error of the cached fields.
+  // The cached fields cover the whole super-resolved frame, so in the out-of-core and direct integration modes the rays are traced through the planes directly.
+  if( mysim != NULL && (mylens.planes.size() > 1 || mylens.hasPerturbations()) ){
+    mylens.cacheDeflections(mysim,0,output+"deflections.bin");
   }
+  timer_lenses.stop();
   //================= END:CREATE THE LENSES ====================
 
 
 
   //=============== BEGIN:GET CRITICAL LINES AND CAUSTICS =======================
-  RectGrid detA(super_res_x,super_res_y,xmin,xmax,xmin,xmax);
-
-  for(int i=0;i<detA.Ny;i++){
-    for(int j=0;j<detA.Nx;j++){
-      double mydet = mass_collection.detJacobian(detA.center_x[j],detA.center_y[i]);
-      if( mydet > 0 ){
-	detA.z[i*detA.Nx+j] = 0;
-      } else {
-	detA.z[i*detA.Nx+j] = 1;
-      }
+  // detA is evaluated on a coarse grid at the observed resolution and the critical lines are refined along the cell edges
+  ScopedTimer timer_criticals("critical lines and caustics");
+  RectGrid detA(super_res_x/10,super_res_y/10,xmin,xmax,ymin,ymax);
+  std::vector<Contour> contours = marchingSquaresCriticals(&mylens,&detA,resolution/100.0);
+
+  // Keep only the sign of detA for the output (0:positive, 1:negative)
+  for(int i=0;i<detA.Nz;i++){
+    if( detA.z[i] > 0 ){
+      detA.z[i] = 0;
+    } else {
+      detA.z[i] = 1;
     }
   }
 
-  // Get detA contours on the image plane
-  std::vector<Contour> contours = mooreNeighborTracing(&detA);
-
-  // Add first point as last and close the polygon
-  for(int i=0;i<contours.size();i++){
-    contours[i].x.push_back( contours[i].x[0] );
-    contours[i].y.push_back( contours[i].y[0] );
-  }
-
-  // Create caustic contours, and deflect the contours to fill them
-  std::vector<Contour> caustics(contours.size());
-  for(int k=0;k<contours.size();k++){
-    caustics[k] = contours[k];
-    for(int i=0;i<contours[k].x.size();i++){
-      mass_collection.all_defl(contours[k].x[i],contours[k].y[i],xdefl,ydefl);
-      caustics[k].x[i] = xdefl;
-      caustics[k].y[i] = ydefl;
-    }
-  } 
+  // Create caustic contours by deflecting the critical lines
+  std::vector<Contour> caustics = deflectContours(contours,&mylens);
+  timer_criticals.stop();
   //================= END:GET CRITICAL LINES AND CAUSTICS =======================
 
   
 
   //=============== BEGIN:CREATE THE SOURCES =======================
-  CollectionProfiles profile_collection = JsonParsers::parse_profile(root["source"]["light_profile"],input);
+  CollectionProfiles profile_collection = JsonParsers::parse_profile(config.source.light_profile,input);
   //================= END:CREATE THE SOURCES =======================
 
 
 
   //=============== BEGIN:PRODUCE IMAGE USING RAY-SHOOTING =======================
-  for(int i=0;i<mysim.Ny;i++){
-    for(int j=0;j<mysim.Nx;j++){
-      mass_collection.all_defl(mysim.center_x[j],mysim.center_y[i],xdefl,ydefl);
-      mysim.z[i*mysim.Nx+j] = profile_collection.all_values(xdefl,ydefl);
+  ScopedTimer timer_rays("ray shooting");
+  std::vector<std::string> keys{"xmin","xmax","ymin","ymax"};
+  std::vector<std::string> values{std::to_string(xmin),std::to_string(xmax),std::to_string(ymin),std::to_string(ymax)};
+  std::vector<std::string> descriptions{"left limit of the frame","right limit of the frame","bottom limit of the frame","top limit of the frame"};
+  if( integrator.direct() ){
+    // Lensed image integrated over the observed pixels
+    RectGrid obs(super_res_x/10,super_res_y/10,xmin,xmax,ymin,ymax);
+    integrator.render([&](double x,double y){
+	double xs,ys;
+	mylens.all_defl(x,y,xs,ys);
+	return profile_collection.all_values(xs,ys);
+      },&obs);
+    writeImage(obs.Nx,obs.Ny,obs.z,keys,values,descriptions,output + "lensed_image_obs.fits",config.output.single_precision);
+  } else if( mysim != NULL && config.output.adaptive ){
+    // Only the cells that can receive light from the significant region of the source are ray-shot (on the cells of detA, i.e. the observed pixels)
+    long rays = renderAdaptive(&mylens,&profile_collection,&detA,mysim,config.output.adaptive_threshold);
+    Profiler::getInstance()->count("adaptive rays",rays);
+    Profiler::getInstance()->count("adaptive pixels",mysim->Nz);
+  } else if( mysim != NULL && config.output.source_map ){
+    // The source plane positions of the pixels are traced once and kept in output/source_map.bin.
+    // With the same lenses and frame (e.g. many sources through the same lens) only the source is evaluated on them: the source-only mode.
+    SourceMap* source_map = SourceMap::read(output+"source_map.bin",&mylens,mysim,config.output.single_precision);
+    if( source_map == NULL ){
+      source_map = new SourceMap(&mylens,mysim,config.output.single_precision);
+      source_map->write(output+"source_map.bin");
+    }
+    ScopedTimer timer_source("render source");
+    source_map->render(&profile_collection,mysim);
+    delete(source_map);
+  } else if( mysim != NULL ){
+    for(int i=0;i<mysim->Ny;i++){
+      for(int j=0;j<mysim->Nx;j++){
+	mylens.all_defl(mysim->center_x[j],mysim->center_y[i],xdefl,ydefl);
+	mysim->z[i*mysim->Nx+j] = profile_collection.all_values(xdefl,ydefl);
+      }
+    }
+  } else {
+    // Super-resolved lensed image, written tile by tile
+    FitsFrame frame(output + "lensed_image_super.fits",super_res_x,super_res_y,xmin,xmax,ymin,ymax,config.output.single_precision);
+    frame.addKeys(keys,values,descriptions);
+    int T = 10*tile_size;
+    for(int i0=0;i0<super_res_y;i0+=T){
+      for(int j0=0;j0<super_res_x;j0+=T){
+	RectGrid* tile = frame.newTile(i0,j0,std::min(T,super_res_y-i0),std::min(T,super_res_x-j0));
+	for(int i=0;i<tile->Ny;i++){
+	  for(int j=0;j<tile->Nx;j++){
+	    mylens.all_defl(tile->center_x[j],tile->center_y[i],xdefl,ydefl);
+	    tile->z[i*tile->Nx+j] = profile_collection.all_values(xdefl,ydefl);
+	  }
+	}
+	frame.writeTile(i0,j0,tile);
+	delete(tile);
+      }
     }
   }
+  timer_rays.stop();
   //================= END:PRODUCE IMAGE USING RAY-SHOOTING =======================
 
 
   
   //=============== BEGIN:OUTPUT =======================
+  ScopedTimer timer_output("output");
   // Super-resolved lensed image
-  std::vector<std::string> keys{"xmin","xmax","ymin","ymax"};
-  std::vector<std::string> values{std::to_string(mysim.xmin),std::to_string(mysim.xmax),std::to_string(mysim.ymin),std::to_string(mysim.ymax)};
-  std::vector<std::string> descriptions{"left limit of the frame","right limit of the frame","bottom limit of the frame","top limit of the frame"};
-  FitsInterface::writeFits(mysim.Nx,mysim.Ny,mysim.z,keys,values,descriptions,output + "lensed_image_super.fits");
+  if( mysim != NULL ){
+    writeImage(mysim->Nx,mysim->Ny,mysim->z,keys,values,descriptions,output + "lensed_image_super.fits",config.output.single_precision);
+    delete(mysim);
+  }
   
   // Super-resolved source image
   profile_collection.write_all_profiles(output + "source_super.fits");
@@ -145,6 +204,9 @@ int main(int argc,char* argv[]){
   // Caustics and critical curves
   outputContours(contours,output+"criticals.json");
   outputContours(caustics,output+"caustics.json");
+  timer_output.stop();
+
+  Profiler::getInstance()->write(output+"timing_fproject.json");
   //================= END:OUTPUT =======================
   
 
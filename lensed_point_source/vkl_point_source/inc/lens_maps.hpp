@@ -0,0 +1,40 @@
+#ifndef LENS_MAPS_HPP
+#define LENS_MAPS_HPP
+
+#include <string>
+#include <vector>
+
+class MultiPlaneLens;
+
+// Maps of the lens over the field of view, for time-delay cosmography: potential, time delay (Fermat) surface, deflection, convergence, shear and magnification.
+// They are computed in one parallel pass over the pixels, each map evaluated at the pixel center from a single trace of its ray through the planes (see MultiPlaneLens::evaluate):
+// the second derivatives are the analytic ones of the mass models, carried along the trace for several planes.
+// The time delay is the multi-plane Fermat potential, and the potential map is the effective one that gives the same time delay surface with the factor of the main lens
+// (for a single plane, the potential of the lens).
+class LensMaps {
+public:
+  int Nx;
+  int Ny;
+  double xmin;
+  double xmax;
+  double ymin;
+  double ymax;
+  std::vector<double> psi;
+  std::vector<double> time_delay; // in days, relative to the first arriving image
+  std::vector<double> alpha_x;
+  std::vector<double> alpha_y;
+  std::vector<double> kappa;
+  std::vector<double> gamma;
+  std::vector<double> gamma_phi;  // in degrees east-of-north, as for the images
+  std::vector<double> mag;
+
+  LensMaps(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax);
+  LensMaps(const LensMaps& other) = delete;
+  ~LensMaps(){};
+
+  // The time delay surface is relative to delay_min, the value at the first arriving image, and psi = 0.5*|x-source|^2 - time/factor
+  void compute(MultiPlaneLens* lens,double source_x,double source_y,double delay_min,double factor,int Nthreads=0);
+  void write(std::string filename,bool single_precision);
+};
+
+#endif /* LENS_MAPS_HPP */
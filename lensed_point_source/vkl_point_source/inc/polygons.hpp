@@ -5,6 +5,7 @@
 
 class RectGrid;
 class CollectionMassModels;
+class MultiPlaneLens;
 
 struct point {
   double x;
@@ -33,5 +34,6 @@ void deflectTriangles(const std::vector<triangle>& triangles_in,std::vector<tria
 bool pointInTriangle(point p0,point p1,point p2,point p3);
 double determinant3x3(std::vector<double> row1,std::vector<double> row2,std::vector<double> row3);
 void circumcircle(point A,point B,point C,double& xc,double& xy,double& r);
+void findImagePositions(MultiPlaneLens* mylens,point point_source,double xmin,double xmax,double ymin,double ymax,double final_scale,std::vector<double>& xc,std::vector<double>& yc,std::vector<double>& rc);
 
 #endif /* TRIANGLES_HPP */
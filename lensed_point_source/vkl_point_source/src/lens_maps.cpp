@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include "vkllib.hpp"
+
+#include "lens_maps.hpp"
+#include "multi_plane.hpp"
+#include "fits_output.hpp"
+
+LensMaps::LensMaps(int Nx,int Ny,double xmin,double xmax,double ymin,double ymax):Nx(Nx),Ny(Ny),xmin(xmin),xmax(xmax),ymin(ymin),ymax(ymax){
+  long N = (long) Nx*Ny;
+  this->psi.resize(N);
+  this->time_delay.resize(N);
+  this->alpha_x.resize(N);
+  this->alpha_y.resize(N);
+  this->kappa.resize(N);
+  this->gamma.resize(N);
+  this->gamma_phi.resize(N);
+  this->mag.resize(N);
+}
+
+void LensMaps::compute(MultiPlaneLens* lens,double source_x,double source_y,double delay_min,double factor,int Nthreads){
+  if( Nthreads <= 0 ){
+    Nthreads = std::max(1,(int) std::thread::hardware_concurrency());
+  }
+  double step_x = (this->xmax - this->xmin)/this->Nx;
+  double step_y = (this->ymax - this->ymin)/this->Ny;
+
+  // All the maps at each pixel center, row 0 at the top as in RectGrid
+  auto fillRows = [&](int i_start){
+    for(int i=i_start;i<this->Ny;i+=Nthreads){
+      double y = this->ymax - (i+0.5)*step_y;
+      for(int j=0;j<this->Nx;j++){
+	double x = this->xmin + (j+0.5)*step_x;
+	long k = (long) i*this->Nx + j;
+	LensPoint point;
+	lens->evaluate(x,y,source_x,source_y,point);
+	this->psi[k]        = 0.5*(pow(source_x-x,2) + pow(source_y-y,2)) - point.time/factor;
+	this->time_delay[k] = point.time - delay_min;
+	this->alpha_x[k]    = x - point.xdefl;
+	this->alpha_y[k]    = y - point.ydefl;
+	this->kappa[k]      = point.kappa;
+	this->gamma[k]      = point.gamma_mag;
+	this->gamma_phi[k]  = point.gamma_phi/0.01745329251 - 90.0;
+	this->mag[k]        = point.mag;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(int k=0;k<Nthreads;k++){
+    threads.push_back( std::thread(fillRows,k) );
+  }
+  for(int k=0;k<threads.size();k++){
+    threads[k].join();
+  }
+}
+
+void LensMaps::write(std::string filename,bool single_precision){
+  std::vector<double*> images{this->psi.data(),this->time_delay.data(),this->alpha_x.data(),this->alpha_y.data(),this->kappa.data(),this->gamma.data(),this->gamma_phi.data(),this->mag.data()};
+  std::vector<std::string> names{"PSI","TIME_DELAY","ALPHA_X","ALPHA_Y","KAPPA","GAMMA","GAMMA_PHI","MAGNIFICATION"};
+  std::vector<std::string> keys{"xmin","xmax","ymin","ymax"};
+  std::vector<std::string> values{std::to_string(this->xmin),std::to_string(this->xmax),std::to_string(this->ymin),std::to_string(this->ymax)};
+  std::vector<std::string> descriptions{"left limit of the frame","right limit of the frame","bottom limit of the frame","top limit of the frame"};
+  writeImages(this->Nx,this->Ny,images,names,keys,values,descriptions,filename,single_precision);
+}
@@ -7,9 +7,14 @@
 
 #include "polygons.hpp"
 #include "pointImage.hpp"
+#include "lens_maps.hpp"
 
 #include "vkllib.hpp"
 #include "instruments.hpp"
+#include "multi_plane.hpp"
+#include "profiler.hpp"
+#include "molet_config.hpp"
+#include "shared_frame.hpp"
 
 
 
@@ -21,21 +26,21 @@ int main(int argc,char* argv[]){
   */
   
   //=============== BEGIN:PARSE INPUT =======================
+  Profiler::getInstance()->setStage("point_source");
   std::ifstream fin;
   Json::Value::Members jmembers;
 
-  // Read the main projection parameters
-  Json::Value root;
-  fin.open(argv[1],std::ifstream::in);
-  fin >> root;
-  fin.close();
 
-  std::string in_path = argv[1];
+  std::string in_path = argv[2];
   std::string input   = in_path+"input_files/";
 
-  std::string out_path = argv[2];
+  std::string out_path = argv[3];
   std::string output = out_path+"output/";
 
+  // Read the main projection parameters
+  MoletConfig config(argv[1],out_path);
+  const Json::Value& root = config.root;
+
   // Read the cosmological parameters
   Json::Value cosmo;
   fin.open(output+"angular_diameter_distances.json",std::ifstream::in);
@@ -43,11 +48,11 @@ int main(int argc,char* argv[]){
   fin.close();
 
   // Initialize image plane
-  double xmin  = root["instruments"][0]["field-of-view_xmin"].asDouble();
-  double xmax  = root["instruments"][0]["field-of-view_xmax"].asDouble();
-  double ymin  = root["instruments"][0]["field-of-view_ymin"].asDouble();
-  double ymax  = root["instruments"][0]["field-of-view_ymax"].asDouble();
-  double res    = Instrument::getResolution(root["instruments"][0]["name"].asString());
+  double xmin  = config.instruments[0].xmin;
+  double xmax  = config.instruments[0].xmax;
+  double ymin  = config.instruments[0].ymin;
+  double ymax  = config.instruments[0].ymax;
+  double res    = Instrument::getResolution(config.instruments[0].name);
   //================= END:PARSE INPUT =======================
 
 
@@ -57,20 +62,9 @@ int main(int argc,char* argv[]){
   //=============== BEGIN:CREATE THE LENSES ====================
   const Json::Value jlens = root["lenses"][0];
 
-  // Initialize mass model collection
-  CollectionMassModels mass_collection = JsonParsers::parse_mass_model(jlens["mass_model"],input);
-
-  // Scale dpsi mass models if necessary
-  for(int k=0;k<jlens["mass_model"].size();k++){
-    if( jlens["mass_model"][k]["pars"].isMember("scale_factor") ){
-      double scale_factor = jlens["mass_model"][k]["pars"]["scale_factor"].asDouble();
-      Pert* pert = static_cast<Pert*> (mass_collection.models[k]);
-      for(int m=0;m<pert->Sm;m++){
-	pert->z[m] *= scale_factor;
-      }
-      pert->updateDerivatives();
-    }
-  }
+  // All the lens planes, the time delays are computed from the multi-plane Fermat potential
+  MultiPlaneLens mylens(root["lenses"],cosmo,input);
+  // The deflections are evaluated directly: the image positions are refined down to res/100, below the error of the interpolated fields cached by fproject
   //================= END:CREATE THE LENSES ====================
 
 
@@ -79,100 +73,15 @@ int main(int argc,char* argv[]){
 
 
   //=============== BEGIN:FIND NUMBER OF IMAGES AND LOCATION =======================
-  point point_source = {root["point_source"]["x0"].asDouble(),root["point_source"]["y0"].asDouble()};
+  point point_source = {config.point_source.x0,config.point_source.y0};
 
-  // Create and deflect image plane
-  std::vector<RectGrid*> planes;
-  RectGrid* img = new RectGrid(10,10,xmin,xmax,ymin,ymax);
-  planes.push_back(img);
   std::vector<double> xc;
   std::vector<double> yc;
   std::vector<double> rc;
   double final_scale = res/100.0;
-  bool condition = true;
-
-  while( condition ){
-    std::vector<double> xc_tmp;
-    std::vector<double> yc_tmp;
-    std::vector<double> rc_tmp;
-
-    for(int p=0;p<planes.size();p++){
-      // Deflect image plane
-      double* tmp_defl_x = (double*) malloc(planes[p]->Nz*sizeof(double));
-      double* tmp_defl_y = (double*) malloc(planes[p]->Nz*sizeof(double));
-      
-      for(int i=0;i<planes[p]->Ny;i++){
-	for(int j=0;j<planes[p]->Nx;j++){
-	  mass_collection.all_defl(planes[p]->center_x[j],planes[p]->center_y[i],tmp_defl_x[i*planes[p]->Nx+j],tmp_defl_y[i*planes[p]->Nx+j]);
-	}
-      }
-      
-      // Create triangle indices based on the image plane pixel indices
-      std::vector<itriangle> triangles = imagePlaneToTriangleIndices(planes[p]);
-      
-      // Find which deflected triangles contain the point source
-      std::vector<int> match;
-      for(int k=0;k<triangles.size();k++){
-	int indA = triangles[k].ya*planes[p]->Nx+triangles[k].xa;
-	int indB = triangles[k].yb*planes[p]->Nx+triangles[k].xb;
-	int indC = triangles[k].yc*planes[p]->Nx+triangles[k].xc;
-	point p1 = {tmp_defl_x[indA],tmp_defl_y[indA]};
-	point p2 = {tmp_defl_x[indB],tmp_defl_y[indB]};
-	point p3 = {tmp_defl_x[indC],tmp_defl_y[indC]};
-	
-	if( pointInTriangle(point_source,p1,p2,p3) ){
-	  match.push_back(k);
-	}
-      }
-      free(tmp_defl_x);
-      free(tmp_defl_y);
-      
-      // Get the center and radius of the circumcircle of each image triangle
-      double xdum,ydum,rdum;
-      for(int i=0;i<match.size();i++){
-	point A = {planes[p]->center_x[triangles[match[i]].xa],planes[p]->center_y[triangles[match[i]].ya]};
-	point B = {planes[p]->center_x[triangles[match[i]].xb],planes[p]->center_y[triangles[match[i]].yb]};
-	point C = {planes[p]->center_x[triangles[match[i]].xc],planes[p]->center_y[triangles[match[i]].yc]};
-	circumcircle(A,B,C,xdum,ydum,rdum);
-	xc_tmp.push_back(xdum);
-	yc_tmp.push_back(ydum);
-	rc_tmp.push_back(rdum);
-      }
-      
-      // Maybe Write rectangular of the image plane
-    }
-
-    // Evaluate stopping criterion: all image planes must be smaller than some fraction of a pixel
-    // Otherwise create new image planes and redefine planes vector
-    int counter = 0;
-    for(int i=0;i<rc_tmp.size();i++){
-      if( rc_tmp[i] > final_scale ){
-	counter++;
-      }
-    }
-    if( counter > 0 ){
-      // Set new smalle image planes around xc,yc
-      for(int p=0;p<planes.size();p++){
-	delete(planes[p]);
-      }
-      planes.resize(xc_tmp.size());
-      for(int p=0;p<planes.size();p++){
-	RectGrid* img = new RectGrid(10,10,xc_tmp[p]-rc_tmp[p],xc_tmp[p]+rc_tmp[p],yc_tmp[p]-rc_tmp[p],yc_tmp[p]+rc_tmp[p]);
-	planes[p] = img;
-      }
-      //std::cout << "Zooming in... (planes " << planes.size() << ")" <<  std::endl;
-    } else {
-      // Exit loop and write multiple image positions
-      copy(xc_tmp.begin(),xc_tmp.end(),back_inserter(xc)); 
-      copy(yc_tmp.begin(),yc_tmp.end(),back_inserter(yc)); 
-      copy(rc_tmp.begin(),rc_tmp.end(),back_inserter(rc)); 
-      for(int p=0;p<planes.size();p++){
-	delete(planes[p]);
-      }
-      condition = false;
-    }   
-
-  }
+  ScopedTimer timer_find("image finding");
+  findImagePositions(&mylens,point_source,xmin,xmax,ymin,ymax,final_scale,xc,yc,rc);
+  timer_find.stop();
   
   // Filter images by location
   std::vector<double> xc_final;
@@ -209,26 +118,17 @@ int main(int argc,char* argv[]){
   
   
   //=============== BEGIN:CORRESPONDING KAPPA, GAMMA, AND TIME DELAY =======================
-  for(int i=0;i<multipleImages.size();i++){
-    double x = multipleImages[i]->x;
-    double y = multipleImages[i]->y;
-    multipleImages[i]->k = mass_collection.all_kappa(x,y);
-    double gamma_mag,gamma_phi;
-    mass_collection.all_gamma(x,y,gamma_mag,gamma_phi);
-    multipleImages[i]->g    = gamma_mag;
-    multipleImages[i]->phig = gamma_phi/0.01745329251 - 90.0; // in degrees east-of-north;
-    multipleImages[i]->mag  = 1.0/mass_collection.detJacobian(x,y);
-  }
-    
-  // Calculate time delays
+  ScopedTimer timer_properties("image properties");
+  // Everything from a single trace of each image, the time delays in days
   std::vector<double> delays(multipleImages.size());
   for(int i=0;i<multipleImages.size();i++){
-    double x = multipleImages[i]->x;
-    double y = multipleImages[i]->y;
-    double psi_tot = mass_collection.all_psi(x,y);
-    double time = 0.5*(pow(point_source.x-x,2) + pow(point_source.y-y,2)) - psi_tot;
-    //double time = 0.5*(pow(point_source.x-x,2) + pow(point_source.y-y,2));
-    delays[i] = time;
+    LensPoint point;
+    mylens.evaluate(multipleImages[i]->x,multipleImages[i]->y,point_source.x,point_source.y,point);
+    multipleImages[i]->k    = point.kappa;
+    multipleImages[i]->g    = point.gamma_mag;
+    multipleImages[i]->phig = point.gamma_phi/0.01745329251 - 90.0; // in degrees east-of-north;
+    multipleImages[i]->mag  = point.mag;
+    delays[i] = point.time;
   }
 
   double d_min = delays[0];
@@ -238,16 +138,34 @@ int main(int argc,char* argv[]){
     }
   }
 
-  double factor = 0.0281*(1.0+jlens["redshift"].asDouble())*cosmo[0]["Dl"].asDouble()*cosmo[0]["Ds"].asDouble()/(cosmo[0]["Dls"].asDouble()); // in days
-  //*** this factor has to be mutliplied by rad^2, i.e. converted from arcsec^2 that are the units of the potential and the other time delay term.
   for(int i=0;i<multipleImages.size();i++){
-    multipleImages[i]->dt = (delays[i] - d_min)*factor;
+    multipleImages[i]->dt = delays[i] - d_min;
   }
+  timer_properties.stop();
   //================= END:CORRESPONDING KAPPA, GAMMA, AND TIME DELAY =======================
 
 
 
 
+  //=============== BEGIN:LENS MAPS =======================
+  // Over the frame shared by all the instruments, at the observed resolution of the finest one times 'factor'
+  if( config.output.lens_maps ){
+    ScopedTimer timer_maps("lens maps");
+    std::vector<double> resolutions;
+    for(int b=0;b<config.instruments.size();b++){
+      resolutions.push_back(Instrument::getResolution(config.instruments[b].name));
+    }
+    SharedFrame shared(config.instruments,resolutions,config.output.lens_maps_factor);
+    LensMaps maps(shared.Nx,shared.Ny,shared.xmin,shared.xmax,shared.ymin,shared.ymax);
+    double factor = 0.0281*(1.0+jlens["redshift"].asDouble())*cosmo[0]["Dl"].asDouble()*cosmo[0]["Ds"].asDouble()/(cosmo[0]["Dls"].asDouble()); // in days
+    maps.compute(&mylens,point_source.x,point_source.y,d_min,factor);
+    maps.write(output+"lens_maps.fits",config.output.single_precision);
+  }
+  //================= END:LENS MAPS =======================
+
+
+
+
 
   //=============== BEGIN:OUTPUT =======================
   // Multiple images
@@ -273,6 +191,8 @@ int main(int argc,char* argv[]){
   for(int i=0;i<multipleImages.size();i++){
     delete(multipleImages[i]);
   }
+
+  Profiler::getInstance()->write(output+"timing_point_source.json");
   //================= END:OUTPUT =======================
 
 
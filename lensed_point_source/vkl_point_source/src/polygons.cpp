@@ -1,8 +1,11 @@
+#include <algorithm>
+#include <iterator>
 #include <vector>
 
 #include "polygons.hpp"
 #include "massModels.hpp"
 #include "imagePlane.hpp"
+#include "multi_plane.hpp"
 
 
 std::vector<triangle> imagePlaneToTriangles(RectGrid* image){
@@ -131,19 +134,98 @@ void circumcircle(point A,point B,point C,double& xc,double& yc,double& r){
   r  = sqrt( bb/aa + (sx*sx+sy*sy)/pow(aa,2) );  
 }
 
+void findImagePositions(MultiPlaneLens* mylens,point point_source,double xmin,double xmax,double ymin,double ymax,double final_scale,std::vector<double>& xc,std::vector<double>& yc,std::vector<double>& rc){
+  // Zoom in on the image plane triangles that are mapped on the point source, until their circumcircles are smaller than final_scale.
+  // The centers and radii of the final circumcircles are returned (the same image may appear more than once).
+  // Create and deflect image plane
+  std::vector<RectGrid*> planes;
+  RectGrid* img = new RectGrid(10,10,xmin,xmax,ymin,ymax);
+  planes.push_back(img);
+  bool condition = true;
+
+  while( condition ){
+    std::vector<double> xc_tmp;
+    std::vector<double> yc_tmp;
+    std::vector<double> rc_tmp;
+
+    for(int p=0;p<planes.size();p++){
+      // Deflect image plane
+      double* tmp_defl_x = (double*) malloc(planes[p]->Nz*sizeof(double));
+      double* tmp_defl_y = (double*) malloc(planes[p]->Nz*sizeof(double));
+      
+      for(int i=0;i<planes[p]->Ny;i++){
+	for(int j=0;j<planes[p]->Nx;j++){
+	  mylens->all_defl(planes[p]->center_x[j],planes[p]->center_y[i],tmp_defl_x[i*planes[p]->Nx+j],tmp_defl_y[i*planes[p]->Nx+j]);
+	}
+      }
+      
+      // Create triangle indices based on the image plane pixel indices
+      std::vector<itriangle> triangles = imagePlaneToTriangleIndices(planes[p]);
+      
+      // Find which deflected triangles contain the point source
+      std::vector<int> match;
+      for(int k=0;k<triangles.size();k++){
+	int indA = triangles[k].ya*planes[p]->Nx+triangles[k].xa;
+	int indB = triangles[k].yb*planes[p]->Nx+triangles[k].xb;
+	int indC = triangles[k].yc*planes[p]->Nx+triangles[k].xc;
+	point p1 = {tmp_defl_x[indA],tmp_defl_y[indA]};
+	point p2 = {tmp_defl_x[indB],tmp_defl_y[indB]};
+	point p3 = {tmp_defl_x[indC],tmp_defl_y[indC]};
+	
+	if( pointInTriangle(point_source,p1,p2,p3) ){
+	  match.push_back(k);
+	}
+      }
+      free(tmp_defl_x);
+      free(tmp_defl_y);
+      
+      // Get the center and radius of the circumcircle of each image triangle
+      double xdum,ydum,rdum;
+      for(int i=0;i<match.size();i++){
+	point A = {planes[p]->center_x[triangles[match[i]].xa],planes[p]->center_y[triangles[match[i]].ya]};
+	point B = {planes[p]->center_x[triangles[match[i]].xb],planes[p]->center_y[triangles[match[i]].yb]};
+	point C = {planes[p]->center_x[triangles[match[i]].xc],planes[p]->center_y[triangles[match[i]].yc]};
+	circumcircle(A,B,C,xdum,ydum,rdum);
+	xc_tmp.push_back(xdum);
+	yc_tmp.push_back(ydum);
+	rc_tmp.push_back(rdum);
+      }
+      
+      // Maybe Write rectangular of the image plane
+    }
 
+    // Evaluate stopping criterion: all image planes must be smaller than some fraction of a pixel
+    // Otherwise create new image planes and redefine planes vector
+    int counter = 0;
+    for(int i=0;i<rc_tmp.size();i++){
+      if( rc_tmp[i] > final_scale ){
+	counter++;
+      }
+    }
+    if( counter > 0 ){
+      // Set new smalle image planes around xc,yc
+      for(int p=0;p<planes.size();p++){
+	delete(planes[p]);
+      }
+      planes.resize(xc_tmp.size());
+      for(int p=0;p<planes.size();p++){
+	RectGrid* img = new RectGrid(10,10,xc_tmp[p]-rc_tmp[p],xc_tmp[p]+rc_tmp[p],yc_tmp[p]-rc_tmp[p],yc_tmp[p]+rc_tmp[p]);
+	planes[p] = img;
+      }
+      //std::cout << "Zooming in... (planes " << planes.size() << ")" <<  std::endl;
+    } else {
+      // Exit loop and write multiple image positions
+      copy(xc_tmp.begin(),xc_tmp.end(),back_inserter(xc)); 
+      copy(yc_tmp.begin(),yc_tmp.end(),back_inserter(yc)); 
+      copy(rc_tmp.begin(),rc_tmp.end(),back_inserter(rc)); 
+      for(int p=0;p<planes.size();p++){
+	delete(planes[p]);
+      }
+      condition = false;
+    }   
 
-
-
-
-
-
-
-
-
-
-
-
+  }
+}
 
 
 int pnpoly(int nvert,double* vertx,double* verty,double testx,double testy){
@@ -3,22 +3,26 @@
 GPP = g++
 
 
-CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math
-CPP_LIBS  = -ljsoncpp
+CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math -pthread
+CPP_LIBS  = -ljsoncpp -pthread
 
 ROOT_DIR = cosmology/angular_diameter_distances
 INC_DIR = $(ROOT_DIR)/inc
 SRC_DIR = $(ROOT_DIR)/src
 BIN_DIR = $(ROOT_DIR)/bin
+LIB_DIR = $(ROOT_DIR)/lib
 OBJ_DIR = $(ROOT_DIR)/obj
 $(shell mkdir -p $(OBJ_DIR))
 $(shell mkdir -p $(BIN_DIR))
+$(shell mkdir -p $(LIB_DIR))
 
 
-DEPS = auxiliary_functions.hpp
-OBJ  = auxiliary_functions.o   angular_diameter_distances.o
+DEPS = auxiliary_functions.hpp cosmology.hpp
+OBJ  = auxiliary_functions.o   cosmology.o   angular_diameter_distances.o
+LIB_OBJ = auxiliary_functions.o   cosmology.o
 FULL_DEPS = $(patsubst %,$(INC_DIR)/%,$(DEPS)) #Pad names with dir
 FULL_OBJ  = $(patsubst %,$(OBJ_DIR)/%,$(OBJ))  #Pad names with dir
+FULL_LIB_OBJ = $(patsubst %,$(OBJ_DIR)/%,$(LIB_OBJ))  #Pad names with dir
 #$(info $$OBJ is [${FULL_DEPS}])
 
 $(OBJ_DIR)/%.o: $(SRC_DIR)/%.cpp $(FULL_DEPS)
@@ -26,6 +30,7 @@ $(OBJ_DIR)/%.o: $(SRC_DIR)/%.cpp $(FULL_DEPS)
 
 angular_diameter_distances: $(FULL_OBJ)
 	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -o $(BIN_DIR)/angular_diameter_distances $(FULL_OBJ) $(CPP_LIBS)
+	$(GPP) -shared -Wl,-soname,libcosmology.so -o $(LIB_DIR)/libcosmology.so $(FULL_LIB_OBJ)
 clean:
-	$(RM) -r $(OBJ_DIR)/* $(BIN_DIR)/*
+	$(RM) -r $(OBJ_DIR)/* $(BIN_DIR)/* $(LIB_DIR)/*
 
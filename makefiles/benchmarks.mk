@@ -0,0 +1,48 @@
+.DEFAULT_GOAL := benchmarks
+
+GPP = g++
+
+
+CPP_FLAGS = -std=c++11 -fPIC -O2 -g -frounding-math -pthread
+CPP_LIBS  = -lfftw3 -ljsoncpp -lvkl -lgfortran -lCCfits -lcfitsio -lgmp -lCGAL
+EXT_LIBS  = -linstruments
+COM_LIBS  = -lmolet_common
+
+EXT_LIB_DIR = instrument_modules/lib
+EXT_INC_DIR = instrument_modules/include
+COM_LIB_DIR = common_modules/lib
+COM_INC_DIR = common_modules/include
+
+# The benchmarked functions that are not in a library are compiled from the sources of their stage
+FPR_DIR = lensed_extended_source/vkl_fproject
+PNT_DIR = lensed_point_source/vkl_point_source
+CMB_DIR = combined_light
+STAGE_INC = -I $(FPR_DIR)/inc -I $(PNT_DIR)/inc -I $(CMB_DIR)/inc
+
+ROOT_DIR = benchmarks
+SRC_DIR = $(ROOT_DIR)/src
+INC_DIR = $(ROOT_DIR)/inc
+BIN_DIR = $(ROOT_DIR)/bin
+OBJ_DIR = $(ROOT_DIR)/obj
+$(shell mkdir -p $(OBJ_DIR))
+$(shell mkdir -p $(BIN_DIR))
+
+
+HEADERS = $(shell find $(INC_DIR) $(FPR_DIR)/inc $(PNT_DIR)/inc $(CMB_DIR)/inc -type f -name '*.hpp')
+OBJ  = harness.o benchmarks.o caustics.o polygons.o auxiliary_functions.o
+FULL_OBJ  = $(patsubst %,$(OBJ_DIR)/%,$(OBJ))  #Pad names with dir
+
+
+$(OBJ_DIR)/%.o: $(SRC_DIR)/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) $(STAGE_INC) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+$(OBJ_DIR)/%.o: $(FPR_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) $(STAGE_INC) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+$(OBJ_DIR)/%.o: $(PNT_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) $(STAGE_INC) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+$(OBJ_DIR)/%.o: $(CMB_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) $(STAGE_INC) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+
+benchmarks: $(FULL_OBJ)
+	$(GPP) $(CPP_FLAGS) -o $(BIN_DIR)/bench $(FULL_OBJ) $(CPP_LIBS) $(EXT_LIBS) -L $(EXT_LIB_DIR) -Wl,-rpath,$(EXT_LIB_DIR) $(COM_LIBS) -L $(COM_LIB_DIR) -Wl,-rpath,$(COM_LIB_DIR)
+clean:
+	$(RM) -r $(OBJ_DIR)/* $(BIN_DIR)/*
@@ -3,12 +3,15 @@
 GPP = g++
 
 
-CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math
+CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math -pthread
 CPP_LIBS  = -lfftw3 -ljsoncpp -lvkl -lgfortran -lCCfits -lcfitsio -lgmp -lCGAL
 EXT_LIBS  = -linstruments
+COM_LIBS  = -lmolet_common
 
 EXT_LIB_DIR = instrument_modules/lib
 EXT_INC_DIR = instrument_modules/include
+COM_LIB_DIR = common_modules/lib
+COM_INC_DIR = common_modules/include
 
 ROOT_DIR = combined_light
 SRC_DIR = $(ROOT_DIR)/src
@@ -20,18 +23,21 @@ $(shell mkdir -p $(BIN_DIR))
 
 
 HEADERS = $(shell find $(INC_DIR) -type f -name '*.hpp')
-OBJ  = mask_functions.o auxiliary_functions.o combine_light.o
+OBJ  = mask_functions.o auxiliary_functions.o cutouts.o combine_light.o
 FULL_OBJ  = $(patsubst %,$(OBJ_DIR)/%,$(OBJ))  #Pad names with dir
+CUT_OBJ  = cutouts.o get_cutout.o
+FULL_CUT_OBJ  = $(patsubst %,$(OBJ_DIR)/%,$(CUT_OBJ))
 
 #$(info $$OBJ is [${HEADERS}])
 #$(info $$OBJ is [${FULL_OBJ}])
 
 
 $(OBJ_DIR)/%.o: $(SRC_DIR)/%.cpp $(HEADERS)
-	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -I $(EXT_INC_DIR) -c -o $@ $<
+	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
 
-combined_light: $(FULL_OBJ)
-	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -I $(EXT_INC_DIR) -o $(BIN_DIR)/combine_light $(FULL_OBJ) $(CPP_LIBS) $(EXT_LIBS) -L $(EXT_LIB_DIR) -Wl,-rpath,$(EXT_LIB_DIR)
+combined_light: $(FULL_OBJ) $(FULL_CUT_OBJ)
+	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -o $(BIN_DIR)/combine_light $(FULL_OBJ) $(CPP_LIBS) $(EXT_LIBS) -L $(EXT_LIB_DIR) -Wl,-rpath,$(EXT_LIB_DIR) $(COM_LIBS) -L $(COM_LIB_DIR) -Wl,-rpath,$(COM_LIB_DIR)
+	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -o $(BIN_DIR)/get_cutout $(FULL_CUT_OBJ) $(CPP_LIBS) $(EXT_LIBS) -L $(EXT_LIB_DIR) -Wl,-rpath,$(EXT_LIB_DIR) $(COM_LIBS) -L $(COM_LIB_DIR) -Wl,-rpath,$(COM_LIB_DIR)
 clean:
 	$(RM) -r $(OBJ_DIR)/* $(BIN_DIR)/*
 
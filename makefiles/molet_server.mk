@@ -0,0 +1,60 @@
+.DEFAULT_GOAL := molet_server
+
+GPP = g++
+
+
+CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math -pthread
+CPP_LIBS  = -lfftw3 -ljsoncpp -lvkl -lgfortran -lCCfits -lcfitsio -lgmp -lCGAL
+EXT_LIBS  = -linstruments
+COM_LIBS  = -lmolet_common
+
+EXT_LIB_DIR = instrument_modules/lib
+EXT_INC_DIR = instrument_modules/include
+COM_LIB_DIR = common_modules/lib
+COM_INC_DIR = common_modules/include
+
+# The stages are compiled from their own sources, with their main renamed, so that the server can run them in-process
+DST_DIR = cosmology/angular_diameter_distances
+FPR_DIR = lensed_extended_source/vkl_fproject
+PNT_DIR = lensed_point_source/vkl_point_source
+LLM_DIR = lens_light_mass/vkl_llm
+CMB_DIR = combined_light
+
+ROOT_DIR = molet_server
+SRC_DIR = $(ROOT_DIR)/src
+INC_DIR = $(ROOT_DIR)/inc
+BIN_DIR = $(ROOT_DIR)/bin
+OBJ_DIR = $(ROOT_DIR)/obj
+$(shell mkdir -p $(OBJ_DIR))
+$(shell mkdir -p $(BIN_DIR))
+
+
+HEADERS = $(shell find $(INC_DIR) $(DST_DIR)/inc $(FPR_DIR)/inc $(PNT_DIR)/inc $(CMB_DIR)/inc -type f -name '*.hpp')
+OBJ  = protocol.o molet_server.o
+OBJ += dst_auxiliary_functions.o dst_cosmology.o dst_angular_diameter_distances.o
+OBJ += fpr_fproject.o fpr_caustics.o fpr_adaptive.o
+OBJ += pnt_polygons.o pnt_point_source.o pnt_lens_maps.o
+OBJ += llm_lens_light_mass.o
+OBJ += cmb_mask_functions.o cmb_auxiliary_functions.o cmb_cutouts.o cmb_combine_light.o
+FULL_OBJ  = $(patsubst %,$(OBJ_DIR)/%,$(OBJ))  #Pad names with dir
+RUN_OBJ  = $(OBJ_DIR)/protocol.o $(OBJ_DIR)/molet_run.o
+
+
+$(OBJ_DIR)/%.o: $(SRC_DIR)/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+$(OBJ_DIR)/dst_%.o: $(DST_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -Dmain=distances_main -I $(DST_DIR)/inc -c -o $@ $<
+$(OBJ_DIR)/fpr_%.o: $(FPR_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -Dmain=fproject_main -I $(FPR_DIR)/inc -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+$(OBJ_DIR)/pnt_%.o: $(PNT_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -Dmain=point_source_main -I $(PNT_DIR)/inc -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+$(OBJ_DIR)/llm_%.o: $(LLM_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -Dmain=llm_main -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+$(OBJ_DIR)/cmb_%.o: $(CMB_DIR)/src/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -Dmain=combine_light_main -I $(CMB_DIR)/inc -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
+
+molet_server: $(FULL_OBJ) $(RUN_OBJ)
+	$(GPP) $(CPP_FLAGS) -o $(BIN_DIR)/molet_server $(FULL_OBJ) $(CPP_LIBS) $(EXT_LIBS) -L $(EXT_LIB_DIR) -Wl,-rpath,$(EXT_LIB_DIR) $(COM_LIBS) -L $(COM_LIB_DIR) -Wl,-rpath,$(COM_LIB_DIR)
+	$(GPP) $(CPP_FLAGS) -o $(BIN_DIR)/molet_run $(RUN_OBJ)
+clean:
+	$(RM) -r $(OBJ_DIR)/* $(BIN_DIR)/*
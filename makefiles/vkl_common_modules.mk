@@ -0,0 +1,33 @@
+.DEFAULT_GOAL := common_modules
+
+GPP = g++
+
+CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math -pthread
+CPP_LIBS  = -lvkl -ljsoncpp -lCCfits -lcfitsio -pthread
+
+ROOT_DIR = common_modules
+SRC_DIR = $(ROOT_DIR)/src
+INC_DIR = $(ROOT_DIR)/include
+LIB_DIR = $(ROOT_DIR)/lib
+BIN_DIR = $(ROOT_DIR)/bin
+OBJ_DIR = $(ROOT_DIR)/obj
+$(shell mkdir -p $(OBJ_DIR))
+$(shell mkdir -p $(LIB_DIR))
+$(shell mkdir -p $(BIN_DIR))
+
+
+HEADERS = $(shell find $(INC_DIR) -type f -name '*.hpp')
+
+SOURCES = tile_renderer.cpp deflection_field.cpp multi_plane.cpp profiler.cpp fits_output.cpp pixel_integrator.cpp molet_config.cpp task_graph.cpp shared_frame.cpp source_map.cpp
+FULL_SOURCES = $(patsubst %, $(SRC_DIR)/%,$(SOURCES))
+OBJ_SOURCES  = $(patsubst $(SRC_DIR)/%,$(OBJ_DIR)/%,$(FULL_SOURCES:.cpp=.o))
+
+
+$(OBJ_DIR)/%.o: $(SRC_DIR)/%.cpp $(HEADERS)
+	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -c -o $@ $<
+
+common_modules: $(OBJ_SOURCES)
+	$(GPP) -shared -Wl,-soname,libmolet_common.so -o $(LIB_DIR)/libmolet_common.so $(OBJ_SOURCES) $(CPP_LIBS)
+	$(GPP) $(CPP_FLAGS) -I $(INC_DIR) -o $(BIN_DIR)/molet_config $(SRC_DIR)/molet_config_cli.cpp -L $(LIB_DIR) -Wl,-rpath,$(abspath $(LIB_DIR)) -lmolet_common $(CPP_LIBS)
+clean:
+	$(RM) -r $(OBJ_DIR)/* $(LIB_DIR)/* $(BIN_DIR)/*
@@ -5,7 +5,7 @@
 GPP = g++
 
 CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math
-CPP_LIBS  = -lvkl -lfftw3 -ljsoncpp
+CPP_LIBS  = -lvkl -lfftw3 -lfftw3f -ljsoncpp
 
 ROOT_DIR = instrument_modules
 SRC_DIR = $(ROOT_DIR)/src
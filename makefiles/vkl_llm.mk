@@ -4,12 +4,15 @@ GPP = g++
 
 
 
-CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math
+CPP_FLAGS = -std=c++11 -fPIC -g -frounding-math -pthread
 CPP_LIBS  = -ljsoncpp -lvkl -lgfortran -lCCfits -lcfitsio -lgmp -lCGAL
 EXT_LIBS  = -linstruments
+COM_LIBS  = -lmolet_common
 
 EXT_LIB_DIR = instrument_modules/lib
 EXT_INC_DIR = instrument_modules/include
+COM_LIB_DIR = common_modules/lib
+COM_INC_DIR = common_modules/include
 
 ROOT_DIR  = lens_light_mass/vkl_llm
 SRC_DIR = $(ROOT_DIR)/src
@@ -24,9 +27,9 @@ FULL_OBJ  = $(patsubst %,$(OBJ_DIR)/%,$(OBJ))  #Pad names with dir
 
 
 $(OBJ_DIR)/%.o: $(SRC_DIR)/%.cpp
-	$(GPP) $(CPP_FLAGS) -I $(EXT_INC_DIR) -c -o $@ $<
+	$(GPP) $(CPP_FLAGS) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -c -o $@ $<
 
 lens_light_mass: $(FULL_OBJ)
-	$(GPP) $(CPP_FLAGS) -I $(EXT_INC_DIR) -o $(BIN_DIR)/llm $(FULL_OBJ) $(CPP_LIBS) $(EXT_LIBS) -L $(EXT_LIB_DIR) -Wl,-rpath,$(EXT_LIB_DIR)
+	$(GPP) $(CPP_FLAGS) -I $(EXT_INC_DIR) -I $(COM_INC_DIR) -o $(BIN_DIR)/llm $(FULL_OBJ) $(CPP_LIBS) $(EXT_LIBS) -L $(EXT_LIB_DIR) -Wl,-rpath,$(EXT_LIB_DIR) $(COM_LIBS) -L $(COM_LIB_DIR) -Wl,-rpath,$(COM_LIB_DIR)
 clean:
 	$(RM) -r $(OBJ_DIR)/* $(BIN_DIR)/*
@@ -14,8 +14,10 @@ myprocess () {
     printf "%-100s" "$msg"
 
     error_file=$(mktemp)
+    start=`date +%s.%N`
     out=$($cmd_list 2>$error_file)
     exit_code=$?
+    end=`date +%s.%N`
     err=$(< $error_file)
     rm $error_file
     
@@ -24,7 +26,7 @@ myprocess () {
         printf "\n===> Failed with error: \n%s" "$err"
 	printf "\n===> Use the following command on its own to debug:\n"
 	printf "$cmd_list\n"
-	exit
+	exit 1
     fi
 
     if [ "$exit_code" -ne "0" ]
@@ -37,19 +39,186 @@ myprocess () {
     then
        echo "$out" >> $log_file
     fi
+
+    # Wall time of the step, the binaries write their own detailed reports in output/timing_<stage>.json
+    wall=`awk -v a=$start -v b=$end 'BEGIN{printf "%.3f",b-a}'`
+    echo "WALL TIME: $wall s" >> $log_file
+    jq -n -c --arg step "$msg" --argjson wall $wall '{"step":$step,"wall_s":$wall}' >> $timing_file
        
     printf "%-10s\n" "...done"
 }
 
 
+# Incremental runs: each stage gets a key, the sha256 of the part of the input json that it reads, of the files it depends on,
+# and of the keys of the upstream stages. The keys of the stages that completed are kept in output/manifest.json.
+# A stage is skipped if its key is the same as in the manifest and its outputs exist (set MOLET_NO_CACHE=1 to run everything).
+stage_key () {
+    # stage_key <stage> <jq filter> [files or upstream keys...]
+    name=$1
+    filter=$2
+    shift 2
+    {
+	echo $name
+	echo $injson | jq -S -c "$filter"
+	for item in "$@"
+	do
+	    if [ -f "$item" ]
+	    then
+		sha256sum < $item
+	    else
+		echo $item
+	    fi
+	done
+    } | sha256sum | cut -d' ' -f1
+}
+
+is_cached () {
+    # is_cached <stage> <key> [outputs...]
+    if [ ! -z "$MOLET_NO_CACHE" ] || [ "`jq -r --arg s $1 '.[$s] // ""' $manifest`" != "$2" ]
+    then
+	return 1
+    fi
+    shift 2
+    for f in "$@"
+    do
+	if [ ! -e "$f" ]
+	then
+	    return 1
+	fi
+    done
+    return 0
+}
+
+set_manifest () {
+    # set_manifest <stage> <key>, an empty key removes the stage
+    # Stages can run at the same time (see background_stage), so the manifest is updated under a lock
+    until mkdir ${manifest}".lock" 2>/dev/null
+    do
+	sleep 0.1
+    done
+    tmp=$(mktemp)
+    if [ -z "$2" ]
+    then
+	jq --arg s $1 'del(.[$s])' $manifest > $tmp
+    else
+	jq --arg s $1 --arg k $2 '.[$s] = $k' $manifest > $tmp
+    fi
+    mv $tmp $manifest
+    rmdir ${manifest}".lock"
+}
+
+skipped () {
+    printf "%-100s%-10s\n" "$1" "...unchanged, skipped"
+    echo "SKIPPED (unchanged inputs): $1" >> $log_file
+}
+
+mystage () {
+    # mystage <stage> <key> <message> <command> [outputs...]
+    stage=$1
+    key=$2
+    msg=$3
+    cmd_list=$4
+    shift 4
+    if is_cached $stage $key "$@"
+    then
+	skipped "$msg"
+	return
+    fi
+    set_manifest $stage ""
+    myprocess "$msg" "$cmd_list" "$log_file"
+    if [ "$exit_code" -eq "0" ]
+    then
+	set_manifest $stage $key
+    fi
+}
+
+# Stages that do not depend on each other run at the same time: e.g. fproject runs in the background while point_source, llm, and the microlensing run.
+# A background stage writes its log and messages in its own files, which are added to the others when it is joined, before the stages that need its outputs.
+# Set MOLET_SERIAL=1 to run all the stages one after the other.
+background_pids=()
+background_names=()
+trap 'kill ${background_pids[@]} 2>/dev/null; rm -f ${out_path}"output/.stage_"*' EXIT
+
+background_stage () {
+    # background_stage <stage> <key> <message> <command> [outputs...], as mystage
+    if [ ! -z "$MOLET_SERIAL" ]
+    then
+	mystage "$@"
+	return
+    fi
+    bg_files=${out_path}"output/.stage_"$1
+    rm -f ${bg_files}".log" ${bg_files}".out"
+    ( log_file=${bg_files}".log"; mystage "$@" ) > ${bg_files}".out" &
+    background_pids+=( $! )
+    background_names+=( $1 )
+}
+
+join_stages () {
+    # Waits for the background stages, in the order they started, and exits if any of them failed
+    for (( j=0; j<${#background_pids[@]}; j++ ))
+    do
+	wait ${background_pids[$j]}
+	bg_status=$?
+	bg_files=${out_path}"output/.stage_"${background_names[$j]}
+	if [ -f ${bg_files}".log" ]
+	then
+	    cat ${bg_files}".log" >> $log_file
+	fi
+	cat ${bg_files}".out"
+	rm -f ${bg_files}".log" ${bg_files}".out"
+	if [ $bg_status -ne 0 ]
+	then
+	    background_pids=()
+	    exit 1
+	fi
+    done
+    background_pids=()
+    background_names=()
+}
+
+
 
 
 infile=$1
 infile=`realpath $infile`
-injson=`grep -o '^[^//]*' $infile`
 in_path=`dirname $infile`"/"
 molet_home=`pwd`"/"
 
+# With a molet_server running on the socket MOLET_SERVER, the stages built in the server run there, without starting a new process (see molet_server/src/molet_server.cpp)
+run=""
+if [ ! -z "$MOLET_SERVER" ]
+then
+    run=${molet_home}"molet_server/bin/molet_run "$MOLET_SERVER" "
+fi
+
+
+# Check if optional output path argument is present
+if [ $# -eq 2 ]
+then
+    out_path=$2
+    i=$((${#out_path}-1))
+    if [ "${out_path:$i:1}" != "/" ]
+    then
+	out_path=${out_path}"/"
+    fi
+else
+    out_path=$in_path
+fi
+if [ ! -d ${out_path}"output" ]
+then
+    mkdir ${out_path}"output"
+fi
+
+
+# Parse and validate the input once: this sets injson (the input without comments), Ninstruments, instruments, has_point_source, extrinsic, and frame,
+# and writes the parsed input in output/molet_config.bin, from where the stages read it
+config=`${molet_home}"common_modules/bin/molet_config" $infile $out_path`
+if [ $? -ne 0 ]
+then
+    exit 1
+fi
+eval "$config"
+
 
 # Check if input_files directory exists (it needs to contain at least the intrinsic variability file)
 if [ ! -d ${in_path}"input_files" ]
@@ -61,13 +230,6 @@ fi
 
 # Check instrument compatibility
 available=($(ls -d ${molet_home}instrument_modules/*))
-Ninstruments=`echo $injson | jq '.instruments | length'`
-instruments=()
-for (( b=0; b<$Ninstruments; b++ ))
-do
-    name=`echo $injson | jq ".instruments[$b].name" | sed -e 's/^"//' -e 's/"$//'`
-    instruments+=( $name )
-done
 # Check if instrument name exists in the modules
 for (( b=0; b<$Ninstruments; b++ ))
 do
@@ -97,8 +259,7 @@ do
     fi
 done
 # Check if instruments match the EXTRINSIC light curve files (one file per instrument)
-extrinsic=`echo $injson | jq ".point_source.variability.extrinsic.type" | sed -e 's/^"//' -e 's/"$//'`
-if [ $extrinsic = custom ]
+if [ "$extrinsic" = custom ]
 then
     for (( b=0; b<$Ninstruments; b++ ))
     do  
@@ -111,23 +272,16 @@ then
 fi
 
 
-# Check if optional output path argument is present
-if [ $# -eq 2 ]
-then
-    out_path=$2
-    i=$((${#out_path}-1))
-    if [ "${out_path:$i:1}" != "/" ]
-    then
-	out_path=${out_path}"/"
-    fi
-else
-    out_path=$in_path
-fi
-if [ ! -d ${out_path}"output" ]
+log_file=${out_path}"output/log.txt"
+timing_file=${out_path}"output/timing_driver.txt"
+rm -f $timing_file ${out_path}"output/timing_"*.json
+touch $timing_file
+manifest=${out_path}"output/manifest.json"
+if [ ! -f $manifest ]
 then
-    mkdir ${out_path}"output"
+    echo "{}" > $manifest
 fi
-log_file=${out_path}"output/log.txt"
+rmdir ${manifest}".lock" 2>/dev/null # left by an interrupted run
 
 
 # Get map path
@@ -136,34 +290,61 @@ map_path=`${molet_home}"variability/extrinsic/get_map_path/bin/get_map_path"`
 
 
 
+# Dependencies of the stages for the incremental runs
+static_inputs=`ls ${in_path}"input_files/"* 2>/dev/null | grep -v "_LC_"` # e.g. perturbation fields, custom light profiles
+instrument_files=()
+instrument_specs=()
+for (( b=0; b<$Ninstruments; b++ ))
+do
+    instrument_dir=${molet_home}"instrument_modules/"${instruments[$b]}"/"
+    instrument_files+=( ${instrument_dir}"specs.json" ${instrument_dir}"psf.fits" )
+    instrument_specs+=( ${instrument_dir}"specs.json" )
+    # The basis of a field-dependent PSF
+    for basis in `jq -r '.psf.variation.basis // [] | .[]' ${instrument_dir}"specs.json"`
+    do
+	instrument_files+=( ${instrument_dir}${basis} )
+    done
+done
+fov='(.instruments[0] | {name,"field-of-view_xmin","field-of-view_xmax","field-of-view_ymin","field-of-view_ymax"})'
+# fproject and llm work on the frame shared by all the instruments (their fields of view and the finest resolution)
+frames='[.instruments[] | {name,"field-of-view_xmin","field-of-view_xmax","field-of-view_ymin","field-of-view_ymax"}]'
+
+
+
     
 # Step 1:
 # Get angular diameter distances
 ####################################################################################
 msg="Getting angular diameter distances..."
-cmd=$molet_home"cosmology/angular_diameter_distances/bin/angular_diameter_distances "$infile" "$out_path
-myprocess "$msg" "$cmd" "$log_file"
+exe=$molet_home"cosmology/angular_diameter_distances/bin/angular_diameter_distances"
+cmd=$run$exe" "$infile" "$out_path
+key_dist=$(stage_key distances '{cosmology, lenses: [.lenses[].redshift], source: .source.redshift}' $exe)
+mystage distances $key_dist "$msg" "$cmd" ${out_path}"output/angular_diameter_distances.json"
 
 
 
 # Step 2:
-# Get extended lensed images of the source
+# Get extended lensed images of the source (in the background, only combine_light needs them)
 ####################################################################################
 msg="Getting extended source lensed features..."
-cmd=$molet_home"lensed_extended_source/vkl_fproject/bin/fproject "$infile" "$in_path" "$out_path
-myprocess "$msg" "$cmd" "$log_file"
+exe=$molet_home"lensed_extended_source/vkl_fproject/bin/fproject"
+cmd=$run$exe" "$infile" "$in_path" "$out_path
+key_fproject=$(stage_key fproject "{lenses: [.lenses[] | {redshift, mass_model}], source, precision: .output_options.precision, out_of_core: .output_options.out_of_core, integration: .output_options.integration, adaptive: .output_options.adaptive, source_map: .output_options.source_map, frames: $frames}" $exe $key_dist $static_inputs ${instrument_specs[@]})
+background_stage fproject $key_fproject "$msg" "$cmd" ${out_path}"output/lensed_image_"${frame}".fits" ${out_path}"output/detA.fits" ${out_path}"output/caustics.json"
 
 
 
 # Intermediate step:
 # Get point source images, their locations are needed for the following
 ####################################################################################
-check=`echo $injson | jq '. | select(.point_source)'`
-if [ ! -z "${check}" ]
+key_ps="none"
+if [ $has_point_source -eq 1 ]
 then
     msg="Getting point-like source lensed images..."
-    cmd=$molet_home"lensed_point_source/vkl_point_source/bin/point_source "$infile" "$in_path" "$out_path
-    myprocess "$msg" "$cmd" "$log_file"
+    exe=$molet_home"lensed_point_source/vkl_point_source/bin/point_source"
+    cmd=$run$exe" "$infile" "$in_path" "$out_path
+    key_ps=$(stage_key point_source "{lenses: [.lenses[] | {redshift, mass_model}], point_source: (.point_source | {x0,y0}), fov: $fov, lens_maps: .output_options.lens_maps, frames: $frames}" $exe $key_dist $static_inputs ${instrument_files[0]} ${instrument_files[1]} ${instrument_specs[@]})
+    mystage point_source $key_ps "$msg" "$cmd" ${out_path}"output/multiple_images.json"
 fi
 
 
@@ -172,40 +353,61 @@ fi
 # Get light profile of the lens (and compact matter if required)
 ####################################################################################
 msg="Getting light profile of the lens..."
-cmd=$molet_home"lens_light_mass/vkl_llm/bin/llm "$infile" "$in_path" "$out_path
-myprocess "$msg" "$cmd" "$log_file"
+exe=$molet_home"lens_light_mass/vkl_llm/bin/llm"
+cmd=$run$exe" "$infile" "$in_path" "$out_path
+key_llm=$(stage_key llm "{lenses: [.lenses[] | {light_profile, compact_mass_model}], point_source: has(\"point_source\"), render: .output_options.render, precision: .output_options.precision, out_of_core: .output_options.out_of_core, integration: .output_options.integration, frames: $frames}" $exe $key_dist $key_ps $static_inputs ${instrument_specs[@]})
+mystage llm $key_llm "$msg" "$cmd" ${out_path}"output/lens_light_"${frame}".fits"
 
 
     
 # Intermediate step:
 # Get variability
 ####################################################################################
-check=`echo $injson | jq '. | select(.point_source)'`
-if [ ! -z "${check}" ]
+key_ml="none"
+if [ $has_point_source -eq 1 ]
 then
     # Extrinsic
-    ex_type=`echo $injson | jq '.point_source.variability.extrinsic.type' | sed -e 's/^"//' -e 's/"$//'`
+    ex_type=$extrinsic
     if [ $ex_type != "custom" ]
     then
-	msg="Matching macro-images to GERLUMPH maps..."
-	cmd=$molet_home"variability/extrinsic/match_to_gerlumph/bin/match_to_gerlumph "$molet_home"data/gerlumph.db "$out_path
-	myprocess "$msg" "$cmd" "$log_file"
-
-	msg="Checking if GERLUMPH maps exist locally..."
-	cmd=$molet_home"variability/extrinsic/match_to_gerlumph/check_map_files.sh "$map_path" "$out_path
-	myprocess "$msg" "$cmd" "$log_file"
-
-	if [ $ex_type = moving_disc ]
+	ml_exe=( ${molet_home}"variability/extrinsic/match_to_gerlumph/bin/match_to_gerlumph" ${molet_home}"variability/extrinsic/"${ex_type}"/bin/"${ex_type} )
+	key_ml=$(stage_key microlensing '{variability: .point_source.variability, instruments: [.instruments[] | {name, time}]}' ${ml_exe[@]} ${molet_home}"data/gerlumph.db" $key_dist $key_llm)
+	ml_outputs=( ${out_path}"output/gerlumph_maps.json" )
+	for (( b=0; b<$Ninstruments; b++ ))
+	do
+	    ml_outputs+=( ${out_path}"output/"${instruments[$b]}"_LC_extrinsic.json" )
+	done
+
+	if is_cached microlensing $key_ml ${ml_outputs[@]}
 	then
-	    msg="Getting 'moving_disc' microlensing variability for each image..."
-	    cmd=$molet_home"variability/extrinsic/moving_disc/bin/moving_disc "$infile" "$out_path
+	    skipped "Getting '${ex_type}' microlensing variability for each image..."
+	else
+	    set_manifest microlensing ""
+	    
+	    msg="Matching macro-images to GERLUMPH maps..."
+	    cmd=$molet_home"variability/extrinsic/match_to_gerlumph/bin/match_to_gerlumph "$molet_home"data/gerlumph.db "$out_path
 	    myprocess "$msg" "$cmd" "$log_file"
-	elif [ $ex_type = expanding_supernova ]
-	then
-	    msg="Getting 'expanding_supernova' microlensing variability for each image..."
-	    cmd=$molet_home"variability/extrinsic/expanding_supernova/bin/expanding_supernova "$infile" "$out_path
+
+	    msg="Checking if GERLUMPH maps exist locally..."
+	    cmd=$molet_home"variability/extrinsic/match_to_gerlumph/check_map_files.sh "$map_path" "$out_path
 	    myprocess "$msg" "$cmd" "$log_file"
-	fi  
+
+	    if [ $ex_type = moving_disc ]
+	    then
+		msg="Getting 'moving_disc' microlensing variability for each image..."
+		cmd=$molet_home"variability/extrinsic/moving_disc/bin/moving_disc "$infile" "$out_path
+		myprocess "$msg" "$cmd" "$log_file"
+	    elif [ $ex_type = expanding_supernova ]
+	    then
+		msg="Getting 'expanding_supernova' microlensing variability for each image..."
+		cmd=$molet_home"variability/extrinsic/expanding_supernova/bin/expanding_supernova "$infile" "$out_path
+		myprocess "$msg" "$cmd" "$log_file"
+	    fi
+	    if [ "$exit_code" -eq "0" ]
+	    then
+		set_manifest microlensing $key_ml
+	    fi
+	fi
     fi    
 fi
 
@@ -213,21 +415,63 @@ fi
 # Step 4:
 # Combine different light components
 ####################################################################################
-# Create output directories if necessary
-check=`echo $injson | jq '. | select(.point_source)'`
-if [ ! -z "${check}" ]
+join_stages
+# With MOLET_UPSTREAM_ONLY set, the run stops here (used by molet_sweep.sh to compute the shared stages once)
+if [ -z "$MOLET_UPSTREAM_ONLY" ]
 then
-   msg="Mock output directories created..."
-   cmd=$molet_home"combined_light/setup_dirs.sh "$infile" "$in_path" "$out_path
-   myprocess "$msg" "$cmd" "$log_file"
-fi
+    # This stage depends on the whole input, the light curves, and all the previous stages
+    exe=$molet_home"combined_light/bin/combine_light"
+    key_comb=$(stage_key combine . $exe ${molet_home}"combined_light/setup_dirs.sh" $key_dist $key_fproject $key_ps $key_llm $key_ml ${in_path}"input_files/"* ${instrument_files[@]})
+    if [ $has_point_source -eq 1 ]
+    then
+	comb_outputs=( ${out_path}"mock_0000_0000" )
+    else
+	comb_outputs=()
+	for (( b=0; b<$Ninstruments; b++ ))
+	do
+	    comb_outputs+=( ${out_path}"output/OBS_"${instruments[$b]}".fits" )
+	done
+    fi
 
+    msg="Combining light components and including instrumental effects..."
+    if is_cached combine $key_comb ${comb_outputs[@]}
+    then
+	skipped "$msg"
+    else
+	set_manifest combine ""
+    
+	# Create output directories if necessary
+	if [ $has_point_source -eq 1 ]
+	then
+	    msg="Mock output directories created..."
+	    cmd=$molet_home"combined_light/setup_dirs.sh "$infile" "$in_path" "$out_path
+	    myprocess "$msg" "$cmd" "$log_file"
+	fi
 
-# Combine light
-msg="Combining light components and including instrumental effects..."
-cmd=$molet_home"combined_light/bin/combine_light "$infile" "$in_path" "$out_path
-myprocess "$msg" "$cmd" "$log_file"
+	# Combine light
+	msg="Combining light components and including instrumental effects..."
+	cmd=$run$exe" "$infile" "$in_path" "$out_path
+	myprocess "$msg" "$cmd" "$log_file"
+	if [ "$exit_code" -eq "0" ]
+	then
+	    set_manifest combine $key_comb
+	fi
+    fi
     
+fi
+
+
+# Timing report
+####################################################################################
+# Collect the wall time of each step and the detailed reports of the stages (timers, counters and peak memory) in output/timing.json
+stage_reports=`ls ${out_path}"output/timing_"*.json 2>/dev/null`
+cat $stage_reports /dev/null | jq -s --slurpfile driver $timing_file '{"driver":$driver,"stages":.}' > ${out_path}"output/timing.json"
+rm $timing_file
+dum="=========================================="
+echo "TIMING SUMMARY" >> $log_file
+echo $dum$dum$dum$dum$dum >> $log_file
+jq -r '.stages[] | "\(.stage): \(.wall_s) s, peak memory \(.peak_rss_kb) kB", (.timers[] | "    \(.name): \(.total_s) s (\(.calls) calls)"), (.counters[]? | "    \(.name): \(.value)")' ${out_path}"output/timing.json" >> $log_file
+
 
 printf "\nCompleted successfully!\n\n"
 printf "Output in: %s\n" $out_path
@@ -0,0 +1,19 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <string>
+#include <vector>
+
+// The messages between molet_run and molet_server, over a Unix socket.
+// A request is the standard input, output and error of the client (passed as file descriptors, so that the stage writes directly to them),
+// followed by the working directory and the command line of the stage.
+// The reply is the exit status of the stage, or one of the codes below, in which case the client runs the stage itself.
+const int REPLY_BUSY    = -1; // the queue of the server is full
+const int REPLY_UNKNOWN = -2; // the stage is not built in the server
+
+bool sendRequest(int sock,const std::string& cwd,const std::vector<std::string>& args);
+bool receiveRequest(int sock,int fds[3],std::string& cwd,std::vector<std::string>& args);
+bool sendReply(int sock,int status);
+bool receiveReply(int sock,int& status);
+
+#endif /* PROTOCOL_HPP */
@@ -0,0 +1,48 @@
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "protocol.hpp"
+
+int main(int argc,char* argv[]){
+  /*
+    Usage: molet_run <socket> <stage executable> [arguments...]
+    Runs a stage in molet_server, with the standard input, output and error of this process, and exits with the status of the stage.
+    If the server is not running, is busy, or does not have the stage, the executable is run directly.
+  */
+  if( argc < 3 ){
+    fprintf(stderr,"Usage: %s <socket> <stage executable> [arguments...]\n",argv[0]);
+    return 1;
+  }
+
+  // A busy server closes the connection without reading the request
+  signal(SIGPIPE,SIG_IGN);
+  int sock = socket(AF_UNIX,SOCK_STREAM,0);
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path,argv[1],sizeof(addr.sun_path)-1);
+  if( sock >= 0 && connect(sock,(struct sockaddr*) &addr,sizeof(addr)) == 0 ){
+    char cwd[PATH_MAX];
+    std::vector<std::string> args(argv+2,argv+argc);
+    int status;
+    if( getcwd(cwd,sizeof(cwd)) != NULL && sendRequest(sock,cwd,args) && receiveReply(sock,status) && status >= 0 ){
+      close(sock);
+      return status;
+    }
+  }
+  if( sock >= 0 ){
+    close(sock);
+  }
+
+  signal(SIGPIPE,SIG_DFL);
+  execv(argv[2],argv+2);
+  fprintf(stderr,"Could not run '%s'\n",argv[2]);
+  return 127;
+}
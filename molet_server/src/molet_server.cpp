@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "json/json.h"
+
+#include "instruments.hpp"
+#include "protocol.hpp"
+
+// The stages built in the server, from the same sources as their executables (see makefiles/molet_server.mk)
+int distances_main(int argc,char* argv[]);
+int fproject_main(int argc,char* argv[]);
+int point_source_main(int argc,char* argv[]);
+int llm_main(int argc,char* argv[]);
+int combine_light_main(int argc,char* argv[]);
+
+typedef int (*StageMain)(int,char**);
+
+
+// A bounded queue of connections: when it is full, new requests are turned down and the clients run the stages themselves
+class JobQueue {
+public:
+  JobQueue(int capacity):capacity(capacity){}
+
+  bool push(int conn){
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if( this->jobs.size() >= this->capacity ){
+      return false;
+    }
+    this->jobs.push_back(conn);
+    this->cv.notify_one();
+    return true;
+  }
+
+  int pop(){
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->cv.wait(lock,[this]{ return !this->jobs.empty(); });
+    int conn = this->jobs.front();
+    this->jobs.pop_front();
+    return conn;
+  }
+
+private:
+  int capacity;
+  std::deque<int> jobs;
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+
+
+static void runStage(int conn,const std::map<std::string,StageMain>& stages){
+  int fds[3];
+  std::string cwd;
+  std::vector<std::string> args;
+  if( !receiveRequest(conn,fds,cwd,args) || args.empty() ){
+    close(conn);
+    return;
+  }
+  std::string name = args[0].substr(args[0].find_last_of('/')+1);
+  std::map<std::string,StageMain>::const_iterator it = stages.find(name);
+  if( it == stages.end() ){
+    sendReply(conn,REPLY_UNKNOWN);
+  } else {
+    // The stage runs in a child process: it starts with everything this process has loaded (libraries, instrument specs and PSFs),
+    // and anything it does (global state, exit on errors, crashes) does not affect the server
+    pid_t pid = fork();
+    if( pid == 0 ){
+      signal(SIGPIPE,SIG_DFL);
+      for(int k=0;k<3;k++){
+	dup2(fds[k],k);
+      }
+      if( chdir(cwd.c_str()) != 0 ){
+	fprintf(stderr,"Could not change to the directory '%s'\n",cwd.c_str());
+	_exit(1);
+      }
+      std::vector<char*> argv(args.size()+1,NULL);
+      for(int i=0;i<args.size();i++){
+	argv[i] = &args[i][0];
+      }
+      exit(it->second(args.size(),argv.data()));
+    }
+    int status = 1;
+    if( pid > 0 ){
+      waitpid(pid,&status,0);
+      status = (WIFEXITED(status))? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    sendReply(conn,status);
+  }
+  for(int k=0;k<3;k++){
+    close(fds[k]);
+  }
+  close(conn);
+}
+
+static void preloadInstruments(){
+  // The specs and PSF images of all the instruments are read once, and shared by all the stages (which read again the files that changed since, see Instrument)
+  Json::Value no_noise;
+  no_noise["type"] = "NoNoise";
+  DIR* dir = opendir(Instrument::path.c_str());
+  if( dir == NULL ){
+    return;
+  }
+  struct dirent* entry;
+  while( (entry = readdir(dir)) != NULL ){
+    std::string name = entry->d_name;
+    struct stat st;
+    if( name[0] != '.' && stat((Instrument::path + name + "/specs.json").c_str(),&st) == 0 ){
+      Instrument cam(name,no_noise);
+      printf("Loaded instrument '%s'\n",name.c_str());
+    }
+  }
+  closedir(dir);
+}
+
+
+int main(int argc,char* argv[]){
+  /*
+    Usage: molet_server <socket> [workers] [queue size] [cache directory]
+    Runs the stages of molet_driver.sh that are requested with molet_run (set MOLET_SERVER=<socket> before calling molet_driver.sh).
+    Workers: the number of stages running at the same time (default: the number of cores).
+    Queue size: the number of requests waiting for a worker, beyond which the clients run the stages themselves (default: 4 times the workers).
+    Cache directory: the PSF kernels prepared by combine_light are kept there and shared by all the simulations (default: the output directory of each simulation).
+  */
+  if( argc < 2 ){
+    fprintf(stderr,"Usage: %s <socket> [workers] [queue size] [cache directory]\n",argv[0]);
+    return 1;
+  }
+  std::string socket_path = argv[1];
+  int Nworkers = std::thread::hardware_concurrency();
+  if( argc > 2 ){
+    Nworkers = atoi(argv[2]);
+  }
+  Nworkers = std::max(Nworkers,1);
+  int capacity = 4*Nworkers;
+  if( argc > 3 ){
+    capacity = atoi(argv[3]);
+  }
+  if( argc > 4 ){
+    setenv("MOLET_CACHE_DIR",argv[4],1);
+  }
+
+  std::map<std::string,StageMain> stages;
+  stages["angular_diameter_distances"] = distances_main;
+  stages["fproject"]      = fproject_main;
+  stages["point_source"]  = point_source_main;
+  stages["llm"]           = llm_main;
+  stages["combine_light"] = combine_light_main;
+
+  preloadInstruments();
+  fflush(stdout);
+  signal(SIGPIPE,SIG_IGN);
+
+  int sock = socket(AF_UNIX,SOCK_STREAM,0);
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path,socket_path.c_str(),sizeof(addr.sun_path)-1);
+  unlink(socket_path.c_str());
+  if( sock < 0 || bind(sock,(struct sockaddr*) &addr,sizeof(addr)) != 0 || listen(sock,capacity) != 0 ){
+    fprintf(stderr,"Could not listen on '%s': %s\n",socket_path.c_str(),strerror(errno));
+    return 1;
+  }
+  printf("Listening on '%s' with %d workers and a queue of %d\n",socket_path.c_str(),Nworkers,capacity);
+  fflush(stdout);
+
+  JobQueue queue(capacity);
+  std::vector<std::thread> workers;
+  for(int w=0;w<Nworkers;w++){
+    workers.push_back(std::thread([&](){
+      while( true ){
+	runStage(queue.pop(),stages);
+      }
+    }));
+  }
+
+  while( true ){
+    int conn = accept(sock,NULL,NULL);
+    if( conn < 0 ){
+      continue;
+    }
+    if( !queue.push(conn) ){
+      sendReply(conn,REPLY_BUSY);
+      close(conn);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,131 @@
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "protocol.hpp"
+
+static bool writeAll(int sock,const void* data,size_t size){
+  const char* p = (const char*) data;
+  while( size > 0 ){
+    ssize_t n = write(sock,p,size);
+    if( n <= 0 ){
+      return false;
+    }
+    p    += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool readAll(int sock,void* data,size_t size){
+  char* p = (char*) data;
+  while( size > 0 ){
+    ssize_t n = read(sock,p,size);
+    if( n <= 0 ){
+      return false;
+    }
+    p    += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool writeString(int sock,const std::string& str){
+  uint32_t n = str.size();
+  return writeAll(sock,&n,sizeof(uint32_t)) && writeAll(sock,str.data(),n);
+}
+
+static bool readString(int sock,std::string& str){
+  uint32_t n;
+  if( !readAll(sock,&n,sizeof(uint32_t)) ){
+    return false;
+  }
+  str.resize(n);
+  return n == 0 || readAll(sock,&str[0],n);
+}
+
+bool sendRequest(int sock,const std::string& cwd,const std::vector<std::string>& args){
+  // The three standard file descriptors go with the first byte
+  int fds[3] = {STDIN_FILENO,STDOUT_FILENO,STDERR_FILENO};
+  char byte = 0;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len  = 1;
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control,0,sizeof(control));
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg),fds,sizeof(fds));
+  if( sendmsg(sock,&msg,0) != 1 ){
+    return false;
+  }
+
+  uint32_t N = args.size();
+  if( !writeString(sock,cwd) || !writeAll(sock,&N,sizeof(uint32_t)) ){
+    return false;
+  }
+  for(int i=0;i<args.size();i++){
+    if( !writeString(sock,args[i]) ){
+      return false;
+    }
+  }
+  return true;
+}
+
+bool receiveRequest(int sock,int fds[3],std::string& cwd,std::vector<std::string>& args){
+  char byte;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len  = 1;
+  char control[CMSG_SPACE(3*sizeof(int))];
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+  if( recvmsg(sock,&msg,0) != 1 ){
+    return false;
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if( cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3*sizeof(int)) ){
+    return false;
+  }
+  memcpy(fds,CMSG_DATA(cmsg),3*sizeof(int));
+
+  uint32_t N;
+  if( !readString(sock,cwd) || !readAll(sock,&N,sizeof(uint32_t)) ){
+    return false;
+  }
+  args.resize(N);
+  for(uint32_t i=0;i<N;i++){
+    if( !readString(sock,args[i]) ){
+      return false;
+    }
+  }
+  return true;
+}
+
+bool sendReply(int sock,int status){
+  int32_t s = status;
+  return writeAll(sock,&s,sizeof(int32_t));
+}
+
+bool receiveReply(int sock,int& status){
+  int32_t s;
+  if( !readAll(sock,&s,sizeof(int32_t)) ){
+    return false;
+  }
+  status = s;
+  return true;
+}
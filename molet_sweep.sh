@@ -0,0 +1,117 @@
+#!/bin/bash
+
+# Runs many variants of the same molet_input.json, e.g. to create training sets.
+# Usage: ./molet_sweep.sh <molet_input.json> <sweep.json> [output path] [number of parallel runs]
+#
+# The sweep file lists the variants, each one with a name and a list of overrides of the base input (see documentation/sweep_example.json):
+#   {"variants": [ {"name": "sn_20", "overrides": [ {"path": ["instruments",0,"noise","sn"], "value": 20} ]}, ... ]}
+#
+# The stages that are common to all the variants are run once, in <output path>/base/ (the final combine_light step is not run there).
+# Each variant gets its own directory, <output path>/<name>/, starting with a copy of the base output.
+# The variants are then run in parallel with molet_driver.sh, which skips all the stages whose inputs are not changed by the overrides (see output/manifest.json).
+# The default output path is the directory of the input file, and the default number of parallel runs is the number of cores.
+
+
+infile=$1
+infile=`realpath $infile`
+sweepfile=`realpath $2`
+in_path=`dirname $infile`"/"
+molet_home=`pwd`"/"
+
+if [ $# -ge 3 ]
+then
+    sweep_path=$3
+    i=$((${#sweep_path}-1))
+    if [ "${sweep_path:$i:1}" != "/" ]
+    then
+	sweep_path=${sweep_path}"/"
+    fi
+else
+    sweep_path=$in_path
+fi
+if [ $# -ge 4 ]
+then
+    Njobs=$4
+else
+    Njobs=`nproc`
+fi
+mkdir -p $sweep_path
+sweep_path=`realpath $sweep_path`"/"
+
+config=`${molet_home}"common_modules/bin/molet_config" $infile`
+if [ $? -ne 0 ]
+then
+    exit 1
+fi
+eval "$config"
+sweep=`grep -o '^[^//]*' $sweepfile`
+Nvariants=`echo $sweep | jq '.variants | length'`
+
+
+# Create the directory of a run: input json, link to the input files, and output directory
+setup_run () {
+    run_path=$1
+    json=$2
+    mkdir -p ${run_path}"output"
+    echo "$json" > ${run_path}"molet_input.json"
+    if [ ! -e ${run_path}"input_files" ]
+    then
+	ln -s ${in_path}"input_files" ${run_path}"input_files"
+    fi
+}
+
+
+
+# Step 1:
+# Shared stages
+####################################################################################
+printf "Running the shared stages in %s\n\n" ${sweep_path}"base/"
+base_path=${sweep_path}"base/"
+setup_run $base_path "$injson"
+MOLET_UPSTREAM_ONLY=1 ./molet_driver.sh ${base_path}"molet_input.json" $base_path
+if [ ! -f ${base_path}"output/manifest.json" ]
+then
+    printf "The shared stages failed, see %s\n" ${base_path}"output/log.txt"
+    exit 1
+fi
+
+
+
+# Step 2:
+# Variants
+####################################################################################
+names=()
+for (( v=0; v<$Nvariants; v++ ))
+do
+    name=`echo $sweep | jq -r ".variants[$v].name"`
+    names+=( $name )
+    variant_json=`echo $injson | jq --argjson ov "$(echo $sweep | jq -c ".variants[$v].overrides")" 'reduce $ov[] as $o (.; setpath($o.path; $o.value))'`
+    variant_path=${sweep_path}${name}"/"
+    rm -rf ${variant_path}"output"
+    setup_run $variant_path "$variant_json"
+    cp -r ${base_path}"output/." ${variant_path}"output/"
+    rm -f ${variant_path}"output/log.txt"
+done
+
+printf "\nRunning %d variants (%d in parallel)\n" $Nvariants $Njobs
+printf "%s\n" "${names[@]}" | xargs -P $Njobs -I{} sh -c './molet_driver.sh '${sweep_path}'{}/molet_input.json '${sweep_path}'{}/ > '${sweep_path}'{}/output/driver.txt 2>&1'
+
+
+
+# Summary
+####################################################################################
+summary_file=${sweep_path}"sweep_summary.json"
+for name in ${names[@]}
+do
+    if grep -q "Completed successfully" ${sweep_path}${name}"/output/driver.txt"
+    then
+	status="ok"
+    else
+	status="failed"
+    fi
+    skipped=`grep -c "SKIPPED" ${sweep_path}${name}"/output/log.txt"`
+    jq -n -c --arg name $name --arg status $status --argjson skipped $skipped '{"name":$name,"status":$status,"skipped_stages":$skipped}'
+done | jq -s '.' > $summary_file
+
+printf "Done: %d of %d variants completed successfully\n" `jq '[.[] | select(.status == "ok")] | length' $summary_file` $Nvariants
+printf "Summary in: %s\n" $summary_file